@@ -0,0 +1,92 @@
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <new>
+#include "../simple_websocket.hpp"
+
+// Counts heap allocations on the calling thread, for the allocations_per_frame counters below. Replacing operator new
+// applies to the whole benchmark binary, at the cost of one thread-local increment per allocation.
+namespace {
+  thread_local int64_t heapAllocations = 0;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC takes the malloc inside the replacement operator new for the allocation that free() is then matched against.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size) {
+  ++heapAllocations;
+  if (void *pointer = std::malloc(size == 0 ? 1 : size)) {
+    return pointer;
+  }
+  throw std::bad_alloc{};
+}
+
+void operator delete(void *pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+namespace {
+  // A feed's mix: mostly short ticks, some pings, the odd book snapshot and binary blob.
+  struct Frames {
+    Frames() : tick(R"({"type":"trade","symbol":"BTC-USD","price":"64100.10","size":"0.0100","side":"buy"})"),
+               book(6000, 'b'),
+               blob(1024, 'x') {
+      for (int i = 0; i < 64; ++i) {
+        if (i % 16 == 0) {
+          views.emplace_back(SimpleWebSocket::TextFrameView{book});
+        } else if (i % 8 == 0) {
+          views.emplace_back(SimpleWebSocket::PingFrameView{"ping"});
+        } else if (i % 8 == 1) {
+          views.emplace_back(SimpleWebSocket::BinaryFrameView{std::as_bytes(std::span{blob})});
+        } else {
+          views.emplace_back(SimpleWebSocket::TextFrameView{tick});
+        }
+      }
+    }
+
+    std::string tick;
+    std::string book;
+    std::string blob;
+    std::vector<SimpleWebSocket::MessageView> views;
+  };
+
+  template<class Materialize>
+  void materialize(benchmark::State &state, Materialize &&materialize) {
+    const Frames frames;
+    std::size_t next = 0;
+    const int64_t before = heapAllocations;
+    for (auto _ : state) {
+      auto message = materialize(frames.views[next++ % frames.views.size()]);
+      benchmark::DoNotOptimize(message);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["allocations_per_frame"] =
+        benchmark::Counter(static_cast<double>(heapAllocations - before) / static_cast<double>(state.iterations()),
+                           benchmark::Counter::kAvgThreads);
+  }
+}
+
+// Every frame copied into a Message with the global allocator, as handlers that keep messages do today.
+static void BM_MaterializeMessage(benchmark::State &state) {
+  materialize(state, [](const SimpleWebSocket::MessageView &view) { return view.materialize(); });
+}
+BENCHMARK(BM_MaterializeMessage)->ThreadRange(1, 4)->UseRealTime();
+
+// The same frames copied into pmr::Messages backed by a per-thread PayloadArena.
+static void BM_MaterializeArenaMessage(benchmark::State &state) {
+  SimpleWebSocket::PayloadArena arena;
+  std::pmr::polymorphic_allocator<char> allocator{&arena};
+  materialize(state, [&allocator](const SimpleWebSocket::MessageView &view) { return view.materialize(allocator); });
+}
+BENCHMARK(BM_MaterializeArenaMessage)->ThreadRange(1, 4)->UseRealTime();
+
+// The same frames copied into CompactMessages, which keep pings and other short payloads inline.
+static void BM_MaterializeCompactMessage(benchmark::State &state) {
+  materialize(state, [](const SimpleWebSocket::MessageView &view) { return SimpleWebSocket::CompactMessage{view}; });
+}
+BENCHMARK(BM_MaterializeCompactMessage)->ThreadRange(1, 4)->UseRealTime();
@@ -0,0 +1,141 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+#if __has_include(<sys/epoll.h>)
+namespace {
+  const std::string TICK = R"({"type":"trade","symbol":"BTC-USD","price":"64123.50","size":"0.0150"})";
+  constexpr int BURST = 64;
+
+  struct IgnoringFrameHandler final : SimpleWebSocket::FrameHandler {
+    void handlePing(const SimpleWebSocket::PingFrame &) override { }
+
+    void handlePong(const SimpleWebSocket::PongFrame &) override { }
+
+    void handleText(const SimpleWebSocket::TextFrame &) override { }
+
+    void handleBinary(const SimpleWebSocket::BinaryFrame &) override { }
+
+    void handleClose(const SimpleWebSocket::CloseFrame &) override { }
+
+    void handleUndefined(const SimpleWebSocket::UndefinedFrame &) override { }
+  };
+
+  // state.range(0) server connections, each with a plain socket on the other end that a thread reads and discards.
+  struct FanOut final {
+    explicit FanOut(std::size_t subscribers) : reactor_(2), epoll_(::epoll_create1(EPOLL_CLOEXEC)) {
+      auto listening = reactor_.listen([this](const std::shared_ptr<SimpleWebSocket::Connection> &connection,
+                                              const SimpleWebSocket::Handshake::Upgrade &) {
+        std::lock_guard lock{mutex_};
+        connections_.push_back(connection);
+        broadcast_.subscribe(connection);
+        return std::make_unique<IgnoringFrameHandler>();
+      }, {.host = "127.0.0.1"});
+      const uint16_t port = std::get<std::shared_ptr<SimpleWebSocket::Listener>>(listening)->port();
+
+      const std::string key = SimpleWebSocket::Handshake::key();
+      const std::string request = SimpleWebSocket::Handshake::request(SimpleWebSocket::ExecutionContext{"127.0.0.1", port, "/"}, key);
+      for (std::size_t i = 0; i < subscribers; ++i) {
+        const int client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ::sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::connect(client, reinterpret_cast<const ::sockaddr *>(&address), sizeof(address));
+        ::send(client, request.data(), request.size(), 0);
+        ::epoll_event event{EPOLLIN, {.fd = client}};
+        ::epoll_ctl(epoll_, EPOLL_CTL_ADD, client, &event);
+        clients_.push_back(client);
+      }
+      drainer_ = std::thread{[this] { drain(); }};
+      expected_ = subscribers * SimpleWebSocket::Handshake::response(key).size();
+      wait();
+    }
+
+    ~FanOut() {
+      running_ = false;
+      drainer_.join();
+      for (int client : clients_) {
+        ::close(client);
+      }
+      ::close(epoll_);
+    }
+
+    // Until every subscriber has read all that was sent to it.
+    void wait() {
+      while (drained_ < expected_) {
+        std::this_thread::yield();
+      }
+    }
+
+    void sent(std::size_t bytes) {
+      expected_ += bytes * clients_.size();
+    }
+
+    SimpleWebSocket::Broadcast &broadcast() {
+      return broadcast_;
+    }
+
+    std::vector<std::shared_ptr<SimpleWebSocket::Connection>> &connections() {
+      return connections_;
+    }
+
+  private:
+    void drain() {
+      std::vector<char> buffer(1 << 16);
+      std::array<::epoll_event, 64> events{};
+      while (running_) {
+        const int ready = ::epoll_wait(epoll_, events.data(), static_cast<int>(events.size()), 10);
+        for (int i = 0; i < ready; ++i) {
+          const ssize_t received = ::recv(events[static_cast<std::size_t>(i)].data.fd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+          if (received > 0) {
+            drained_ += static_cast<std::size_t>(received);
+          }
+        }
+      }
+    }
+
+    SimpleWebSocket::Reactor reactor_;
+    SimpleWebSocket::Broadcast broadcast_;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<SimpleWebSocket::Connection>> connections_;
+    std::vector<int> clients_;
+    int epoll_;
+    std::thread drainer_;
+    std::atomic<bool> running_ = true;
+    std::atomic<std::size_t> drained_ = 0;
+    std::size_t expected_ = 0;
+  };
+}
+
+// Each iteration publishes a burst of ticks, encoded once and shared by every subscriber.
+static void BM_BroadcastPublish(benchmark::State &state) {
+  FanOut fanOut{static_cast<std::size_t>(state.range(0))};
+  const std::size_t frameSize = SimpleWebSocket::encodeShared(SimpleWebSocket::OpCode::Text, TICK)->size();
+  for (auto _ : state) {
+    for (int tick = 0; tick < BURST; ++tick) {
+      fanOut.broadcast().publish(SimpleWebSocket::OpCode::Text, TICK);
+    }
+    fanOut.sent(frameSize * BURST);
+    fanOut.wait();
+  }
+  state.SetItemsProcessed(state.iterations() * BURST * state.range(0));
+}
+BENCHMARK(BM_BroadcastPublish)->Arg(16)->Arg(256)->UseRealTime();
+
+// The same, sending to each connection in turn, which encodes and posts once per subscriber.
+static void BM_BroadcastSendEach(benchmark::State &state) {
+  FanOut fanOut{static_cast<std::size_t>(state.range(0))};
+  const std::size_t frameSize = SimpleWebSocket::encodeShared(SimpleWebSocket::OpCode::Text, TICK)->size();
+  for (auto _ : state) {
+    for (int tick = 0; tick < BURST; ++tick) {
+      for (const auto &connection : fanOut.connections()) {
+        connection->send(SimpleWebSocket::OpCode::Text, TICK);
+      }
+    }
+    fanOut.sent(frameSize * BURST);
+    fanOut.wait();
+  }
+  state.SetItemsProcessed(state.iterations() * BURST * state.range(0));
+}
+BENCHMARK(BM_BroadcastSendEach)->Arg(16)->Arg(256)->UseRealTime();
+#endif
@@ -0,0 +1,136 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+namespace {
+  const SimpleWebSocket::MaskingKey MASKING_KEY{'\x37', '\xfa', '\x21', '\x3d'};
+
+  void maskScalar(const char *in, char *out, std::size_t size, uint32_t pattern) {
+    char bytes[4];
+    std::memcpy(bytes, &pattern, sizeof(pattern));
+    for (std::size_t i = 0; i < size; ++i) {
+      out[i] = static_cast<char>(in[i] ^ bytes[i & 3]);
+    }
+  }
+
+  void mask(benchmark::State &state, SimpleWebSocket::Mask::Kernel kernel) {
+    std::vector<char> payload(static_cast<std::size_t>(state.range(0)) + 1, 'x');
+    // Start one byte in so the kernels see an unaligned buffer and a rotated key.
+    std::span<char> body = std::span<char>{payload}.subspan(1);
+    const uint32_t pattern = SimpleWebSocket::Mask::pattern(MASKING_KEY, 1);
+    for (auto _ : state) {
+      kernel(body.data(), body.data(), body.size(), pattern);
+      benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+  }
+}
+
+static void BM_MaskScalar(benchmark::State &state) {
+  mask(state, maskScalar);
+}
+BENCHMARK(BM_MaskScalar)->Arg(125)->Arg(4096)->Arg(1 << 20)->Arg(8 << 20);
+
+static void BM_MaskWord(benchmark::State &state) {
+  mask(state, SimpleWebSocket::Mask::word);
+}
+BENCHMARK(BM_MaskWord)->Arg(125)->Arg(4096)->Arg(1 << 20)->Arg(8 << 20);
+
+#ifdef SIMPLE_WEBSOCKET_X86_KERNELS
+static void BM_MaskSse2(benchmark::State &state) {
+  mask(state, SimpleWebSocket::Mask::sse2);
+}
+BENCHMARK(BM_MaskSse2)->Arg(125)->Arg(4096)->Arg(1 << 20)->Arg(8 << 20);
+
+static void BM_MaskAvx2(benchmark::State &state) {
+  if (!__builtin_cpu_supports("avx2")) {
+    state.SkipWithError("AVX2 is not supported on this CPU");
+    return;
+  }
+  mask(state, SimpleWebSocket::Mask::avx2);
+}
+BENCHMARK(BM_MaskAvx2)->Arg(125)->Arg(4096)->Arg(1 << 20)->Arg(8 << 20);
+#endif
+
+static void BM_EncodeMaskedFrame(benchmark::State &state) {
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  std::vector<char> out(SimpleWebSocket::FrameHeader::MAX_SIZE + payload.size());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SimpleWebSocket::encodeFrame(out, true, SimpleWebSocket::OpCode::Binary, payload, MASKING_KEY));
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeMaskedFrame)->Arg(16)->Arg(4096)->Arg(1 << 20);
+
+static void BM_DecodeMaskedFrames(benchmark::State &state) {
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  std::vector<char> frame(SimpleWebSocket::FrameHeader::MAX_SIZE + payload.size());
+  frame.resize(SimpleWebSocket::encodeFrame(frame, true, SimpleWebSocket::OpCode::Binary, payload, MASKING_KEY));
+  std::vector<char> wire;
+  for (int i = 0; i < 64; ++i) {
+    wire.insert(wire.end(), frame.begin(), frame.end());
+  }
+
+  SimpleWebSocket::FrameDecoder decoder{SimpleWebSocket::Role::Server};
+  std::size_t frames = 0;
+  std::vector<char> input(wire.size());
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::copy(wire.begin(), wire.end(), input.begin());
+    state.ResumeTiming();
+    auto failure = decoder.decode(input, [&frames](const SimpleWebSocket::FrameHeader &, std::span<char> body) {
+      benchmark::DoNotOptimize(body.data());
+      ++frames;
+    });
+    benchmark::DoNotOptimize(failure);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(frames));
+  state.SetBytesProcessed(static_cast<int64_t>(frames) * state.range(0));
+}
+BENCHMARK(BM_DecodeMaskedFrames)->Arg(16)->Arg(4096)->Arg(65536);
+
+static void BM_ValidateUtf8Ascii(benchmark::State &state) {
+  std::string text;
+  while (text.size() < static_cast<std::size_t>(state.range(0))) {
+    text += "{\"symbol\":\"AAPL\",\"bid\":189.25,\"ask\":189.27,\"size\":300},";
+  }
+  text.resize(static_cast<std::size_t>(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SimpleWebSocket::validUtf8(text));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateUtf8Ascii)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
+static void BM_ValidateUtf8Mixed(benchmark::State &state) {
+  std::string text;
+  while (text.size() < static_cast<std::size_t>(state.range(0))) {
+    text += "{\"name\":\"M\xc3\xbcnchen \xe2\x82\xac\",\"emoji\":\"\xf0\x9f\x98\x80\",\"note\":\"mostly ascii otherwise\"},";
+  }
+  text.resize(static_cast<std::size_t>(state.range(0)) - 4);
+  text += "done";
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SimpleWebSocket::validUtf8(text));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateUtf8Mixed)->Arg(4096)->Arg(1 << 20);
+
+static void BM_ValidateUtf8NonAscii(benchmark::State &state) {
+  const std::string_view words =
+    "\xe6\x9d\xb1\xe4\xba\xac\xe8\xa8\xbc\xe5\x88\xb8\xe5\x8f\x96\xe5\xbc\x95\xe6\x89\x80 \xd0\x9c\xd0\xbe\xd1\x81\xd0\xba\xd0\xb2\xd0\xb0 \xf0\x9f\x93\x88";
+  std::string text;
+  while (text.size() + words.size() <= static_cast<std::size_t>(state.range(0))) {
+    text += words;
+  }
+  text.resize(static_cast<std::size_t>(state.range(0)), ' ');
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SimpleWebSocket::validUtf8(text));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateUtf8NonAscii)->Arg(4096)->Arg(1 << 20);
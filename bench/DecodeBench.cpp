@@ -0,0 +1,92 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+namespace {
+  struct Trade {
+    double price;
+    double size;
+  };
+
+  using Decoded = std::variant<std::monostate, Trade>;
+
+  // A feed where one message in four is a trade, and the rest are order book snapshots nobody here wants.
+  std::vector<std::string> feed() {
+    std::vector<std::string> messages;
+    for (int sequence = 0; sequence < 64; ++sequence) {
+      if (sequence % 4 == 0) {
+        messages.push_back(R"({"type":"trade","symbol":"BTC-USD","sequence":)" + std::to_string(sequence) +
+                           R"(,"price":64123.5,"size":0.015,"side":"buy"})");
+      } else {
+        std::string book = R"({"type":"snapshot","symbol":"BTC-USD","sequence":)" + std::to_string(sequence) + R"(,"bids":[)";
+        for (int level = 0; level < 50; ++level) {
+          book += (level ? "," : "") + std::string{"["} + std::to_string(64100 - level) + ".5," + std::to_string(level + 1) + "]";
+        }
+        messages.push_back(book + "]}");
+      }
+    }
+    return messages;
+  }
+
+  double number(std::string_view json, std::string_view key) {
+    const std::size_t at = json.find(key) + key.size() + 2;
+    double value = 0;
+    std::from_chars(json.data() + at, json.data() + json.size(), value);
+    return value;
+  }
+
+  void decode(benchmark::State &state, SimpleWebSocket::MessageParser<Decoded> &parser) {
+    const std::vector<std::string> messages = feed();
+    std::size_t next = 0;
+    std::size_t bytes = 0;
+    for (auto _ : state) {
+      const std::string &message = messages[next++ % messages.size()];
+      Decoded decoded = parser.parse(SimpleWebSocket::MessageView{SimpleWebSocket::TextFrameView{message}});
+      benchmark::DoNotOptimize(decoded);
+      bytes += message.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+  }
+}
+
+// Routing on the type field with the scanner, and decoding trades by hand.
+static void BM_RouteScan(benchmark::State &state) {
+  auto parser = SimpleWebSocket::decodingMessageParser<Decoded>({
+    .text = SimpleWebSocket::Router<Decoded>{}.route("trade", [](std::string_view text) -> Decoded {
+      return Trade{number(text, "price"), number(text, "size")};
+    }),
+  });
+  decode(state, parser);
+}
+BENCHMARK(BM_RouteScan);
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_SIMDJSON
+namespace {
+  Decoded trade(simdjson::ondemand::document &document) {
+    return Trade{double(document["price"]), double(document["size"])};
+  }
+}
+
+// Routing first, so only trades reach simdjson.
+static void BM_JsonDecodeRouted(benchmark::State &state) {
+  auto parser = SimpleWebSocket::decodingMessageParser<Decoded>({
+    .text = SimpleWebSocket::Router<Decoded>{}.route("trade", SimpleWebSocket::JsonDecoder<Decoded>{trade}),
+  });
+  decode(state, parser);
+}
+BENCHMARK(BM_JsonDecodeRouted);
+
+// Every message through simdjson, which reads the type field and skips what it does not want.
+static void BM_JsonDecodeAll(benchmark::State &state) {
+  auto parser = SimpleWebSocket::decodingMessageParser<Decoded>({
+    .text = SimpleWebSocket::JsonDecoder<Decoded>{[](simdjson::ondemand::document &document) -> Decoded {
+      if (std::string_view{document["type"]} != "trade") {
+        return std::monostate{};
+      }
+      return trade(document);
+    }},
+  });
+  decode(state, parser);
+}
+BENCHMARK(BM_JsonDecodeAll);
+#endif
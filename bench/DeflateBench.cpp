@@ -0,0 +1,116 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+namespace {
+  enum Payload { TICK, BOOK, BATCH };
+
+  std::string tick(int sequence) {
+    return R"({"type":"trade","symbol":"BTC-USD","sequence":)" + std::to_string(9200000 + sequence) +
+           R"(,"price":")" + std::to_string(64100 + sequence % 97) + "." + std::to_string(10 + sequence % 89) +
+           R"(","size":"0.0)" + std::to_string(100 + sequence % 900) + R"(","side":")" + (sequence % 3 ? "buy" : "sell") +
+           R"(","time":"2024-05-01T12:00:)" + std::to_string(10 + sequence % 50) + R"(.123456Z"})";
+  }
+
+  std::string book(int sequence) {
+    std::string book = R"({"type":"snapshot","symbol":"BTC-USD","sequence":)" + std::to_string(sequence) + R"(,"bids":[)";
+    for (int level = 0; level < 50; ++level) {
+      book += (level ? "," : "") + std::string{"[\""} + std::to_string(64100 - level - sequence % 7) + ".50\",\"" +
+              std::to_string(1 + (level * 7 + sequence) % 13) + "." + std::to_string(100 + level * 37 % 900) + "\"]";
+    }
+    book += R"(],"asks":[)";
+    for (int level = 0; level < 50; ++level) {
+      book += (level ? "," : "") + std::string{"[\""} + std::to_string(64101 + level + sequence % 5) + ".00\",\"" +
+              std::to_string(1 + (level * 11 + sequence) % 17) + "." + std::to_string(100 + level * 53 % 900) + "\"]";
+    }
+    return book + "]}";
+  }
+
+  std::string batch(int sequence) {
+    std::string batch = "[";
+    for (int i = 0; i < 100; ++i) {
+      batch += (i ? "," : "") + tick(sequence * 100 + i);
+    }
+    return batch + "]";
+  }
+
+  // A rotating set of similar but not identical messages, as a feed would produce.
+  std::vector<std::string> messages(Payload payload) {
+    std::vector<std::string> messages;
+    for (int sequence = 0; sequence < 64; ++sequence) {
+      messages.push_back(payload == TICK ? tick(sequence) : payload == BOOK ? book(sequence) : batch(sequence));
+    }
+    return messages;
+  }
+
+  // range(0) is the payload, range(1) the window bits and range(2) is 1 without context takeover.
+  void deflate(benchmark::State &state) {
+    const std::vector<std::string> payloads = messages(static_cast<Payload>(state.range(0)));
+    SimpleWebSocket::Deflater deflater{static_cast<int>(state.range(1)), 8, state.range(2) != 0};
+    std::size_t raw = 0;
+    std::size_t wire = 0;
+    std::size_t next = 0;
+    for (auto _ : state) {
+      const std::string &payload = payloads[next++ % payloads.size()];
+      std::string_view compressed = deflater.deflate(payload);
+      benchmark::DoNotOptimize(compressed.data());
+      raw += payload.size();
+      wire += compressed.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(raw));
+    state.counters["raw_bytes"] = benchmark::Counter(static_cast<double>(raw) / static_cast<double>(state.iterations()));
+    state.counters["wire_bytes"] = benchmark::Counter(static_cast<double>(wire) / static_cast<double>(state.iterations()));
+    state.counters["ratio"] = benchmark::Counter(static_cast<double>(wire) / static_cast<double>(raw));
+  }
+
+  void inflate(benchmark::State &state) {
+    const std::vector<std::string> payloads = messages(static_cast<Payload>(state.range(0)));
+    const bool noContextTakeover = state.range(2) != 0;
+    SimpleWebSocket::Deflater deflater{static_cast<int>(state.range(1)), 8, noContextTakeover};
+    std::vector<std::string> compressed;
+    std::size_t raw = 0;
+    for (const std::string &payload : payloads) {
+      compressed.emplace_back(deflater.deflate(payload));
+      raw += payload.size();
+    }
+
+    std::vector<char> out;
+    for (auto _ : state) {
+      // A stream with context takeover can only be replayed from the start, so every iteration inflates the set.
+      SimpleWebSocket::Inflater inflater{noContextTakeover};
+      for (const std::string &message : compressed) {
+        out.clear();
+        if (inflater.inflate(message, true, out, 1 << 20)) {
+          state.SkipWithError("inflate failed");
+          return;
+        }
+        benchmark::DoNotOptimize(out.data());
+      }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(compressed.size()));
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(raw));
+  }
+
+  void payloads(benchmark::internal::Benchmark *benchmark) {
+    benchmark->ArgNames({"payload", "window", "no_context"});
+    for (int payload : {TICK, BOOK, BATCH}) {
+      for (int window : {15, 10}) {
+        for (int noContextTakeover : {0, 1}) {
+          benchmark->Args({payload, window, noContextTakeover});
+        }
+      }
+    }
+  }
+}
+
+static void BM_Deflate(benchmark::State &state) {
+  deflate(state);
+}
+BENCHMARK(BM_Deflate)->Apply(payloads);
+
+static void BM_Inflate(benchmark::State &state) {
+  inflate(state);
+}
+BENCHMARK(BM_Inflate)->Apply(payloads);
+#endif
@@ -0,0 +1,100 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+namespace {
+  std::vector<SimpleWebSocket::Message> mixedMessages() {
+    const SimpleWebSocket::Message ping{SimpleWebSocket::PingFrame{"ping"}};
+    const SimpleWebSocket::Message binary{SimpleWebSocket::BinaryFrame{{'b', 'i', 'n'}}};
+    const SimpleWebSocket::Message text{SimpleWebSocket::TextFrame{"{\"px\":101.25,\"qty\":300}"}};
+
+    std::vector<SimpleWebSocket::Message> messages;
+    for (int i = 0; i < 4096; ++i) {
+      messages.push_back(i % 8 == 0 ? ping : i % 8 == 1 ? binary : text);
+    }
+    return messages;
+  }
+
+  struct CountingFrameHandler final : SimpleWebSocket::FrameHandler {
+    explicit CountingFrameHandler(std::size_t &bytes) : bytes_(bytes) {}
+
+    void handlePing(const SimpleWebSocket::PingFrame &pingFrame) override { bytes_ += pingFrame.value().size(); }
+
+    void handlePong(const SimpleWebSocket::PongFrame &pongFrame) override { bytes_ += pongFrame.value().size(); }
+
+    void handleText(const SimpleWebSocket::TextFrame &textFrame) override { bytes_ += textFrame.value().size(); }
+
+    void handleBinary(const SimpleWebSocket::BinaryFrame &binaryFrame) override { bytes_ += binaryFrame.value().size(); }
+
+    void handleClose(const SimpleWebSocket::CloseFrame &closeFrame) override { bytes_ += closeFrame.value().size(); }
+
+    void handleUndefined(const SimpleWebSocket::UndefinedFrame &) override { }
+
+  private:
+    std::size_t &bytes_;
+  };
+
+  struct CountingStaticFrameHandler final {
+    std::size_t bytes = 0;
+
+    void handlePing(const SimpleWebSocket::PingFrame &pingFrame) { bytes += pingFrame.value().size(); }
+
+    void handlePong(const SimpleWebSocket::PongFrame &pongFrame) { bytes += pongFrame.value().size(); }
+
+    void handleText(const SimpleWebSocket::TextFrame &textFrame) { bytes += textFrame.value().size(); }
+
+    void handleBinary(const SimpleWebSocket::BinaryFrame &binaryFrame) { bytes += binaryFrame.value().size(); }
+
+    void handleClose(const SimpleWebSocket::CloseFrame &closeFrame) { bytes += closeFrame.value().size(); }
+
+    void handleUndefined(const SimpleWebSocket::UndefinedFrame &) { }
+  };
+
+  template<class Handler>
+  void dispatch(benchmark::State &state, Handler &handler, const std::size_t &bytes) {
+    const std::vector<SimpleWebSocket::Message> messages = mixedMessages();
+    std::size_t frames = 0;
+    for (auto _ : state) {
+      for (const SimpleWebSocket::Message &message : messages) {
+        handler.handle(message);
+      }
+      frames += messages.size();
+      benchmark::DoNotOptimize(bytes);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(frames));
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+  }
+}
+
+static void BM_VirtualDispatch(benchmark::State &state) {
+  std::size_t bytes = 0;
+  SimpleWebSocket::MessageHandler messageHandler{std::make_unique<CountingFrameHandler>(bytes)};
+  dispatch(state, messageHandler, bytes);
+}
+BENCHMARK(BM_VirtualDispatch);
+
+// The same handler with every message counted and timed into a Metrics.
+static void BM_MeteredDispatch(benchmark::State &state) {
+  std::size_t bytes = 0;
+  SimpleWebSocket::Metrics metrics;
+  SimpleWebSocket::BasicMessageHandler<SimpleWebSocket::Metered> messageHandler{std::make_unique<CountingFrameHandler>(bytes),
+                                                                               SimpleWebSocket::Metered{metrics}};
+  dispatch(state, messageHandler, bytes);
+}
+BENCHMARK(BM_MeteredDispatch);
+
+static void BM_StaticDispatch(benchmark::State &state) {
+  SimpleWebSocket::StaticMessageHandler messageHandler{CountingStaticFrameHandler{}};
+  dispatch(state, messageHandler, messageHandler.delegate().bytes);
+}
+BENCHMARK(BM_StaticDispatch);
+
+static void BM_VisitorDispatch(benchmark::State &state) {
+  std::size_t bytes = 0;
+  SimpleWebSocket::StaticMessageHandler messageHandler{SimpleWebSocket::visitor{
+    [&bytes](const SimpleWebSocket::BinaryFrame &binaryFrame) { bytes += binaryFrame.value().size(); },
+    [](const SimpleWebSocket::UndefinedFrame &) { },
+    [&bytes](const auto &frame) { bytes += frame.value().size(); }
+  }};
+  dispatch(state, messageHandler, bytes);
+}
+BENCHMARK(BM_VisitorDispatch);
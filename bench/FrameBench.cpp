@@ -0,0 +1,101 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+namespace {
+  struct LengthFrameParser final : SimpleWebSocket::FrameParser<std::size_t> {
+    std::size_t handlePing(const SimpleWebSocket::PingFrame &pingFrame) override { return pingFrame.value().size(); }
+
+    std::size_t handlePong(const SimpleWebSocket::PongFrame &pongFrame) override { return pongFrame.value().size(); }
+
+    std::size_t handleText(const SimpleWebSocket::TextFrame &textFrame) override { return textFrame.value().size(); }
+
+    std::size_t handleBinary(const SimpleWebSocket::BinaryFrame &binaryFrame) override { return binaryFrame.value().size(); }
+
+    std::size_t handleClose(const SimpleWebSocket::CloseFrame &closeFrame) override { return closeFrame.value().size(); }
+
+    std::size_t handleUndefined(const SimpleWebSocket::UndefinedFrame &) override { return 0; }
+  };
+
+  void frameSizes(benchmark::internal::Benchmark *benchmark) {
+    for (int flags : {SimpleWebSocket::Poco::PING_FRAME, SimpleWebSocket::Poco::PONG_FRAME, SimpleWebSocket::Poco::CLOSE_FRAME}) {
+      for (int size : {0, 16, 125}) {
+        benchmark->Args({flags, size});
+      }
+    }
+    for (int flags : {SimpleWebSocket::Poco::TEXT_FRAME, SimpleWebSocket::Poco::BINARY_FRAME}) {
+      for (int size : {16, 256, 4096, 65536, 1 << 20}) {
+        benchmark->Args({flags, size});
+      }
+    }
+  }
+
+  void frameRate(benchmark::State &state, std::size_t payloadSize) {
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(payloadSize));
+  }
+}
+
+static void BM_FromPoco(benchmark::State &state) {
+  const int flags = static_cast<int>(state.range(0));
+  const std::string payload(static_cast<std::size_t>(state.range(1)), 'x');
+  for (auto _ : state) {
+    SimpleWebSocket::Message message = SimpleWebSocket::Poco::fromPoco(flags, payload.data(), static_cast<int>(payload.size()));
+    benchmark::DoNotOptimize(message);
+  }
+  frameRate(state, payload.size());
+}
+BENCHMARK(BM_FromPoco)->Apply(frameSizes);
+
+static void BM_ViewFromPoco(benchmark::State &state) {
+  const int flags = static_cast<int>(state.range(0));
+  const std::string payload(static_cast<std::size_t>(state.range(1)), 'x');
+  for (auto _ : state) {
+    SimpleWebSocket::MessageView messageView = SimpleWebSocket::Poco::viewFromPoco(flags, payload.data(), static_cast<int>(payload.size()));
+    benchmark::DoNotOptimize(messageView);
+  }
+  frameRate(state, payload.size());
+}
+BENCHMARK(BM_ViewFromPoco)->Apply(frameSizes);
+
+static void BM_MessageParserParse(benchmark::State &state) {
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  const SimpleWebSocket::Message message{SimpleWebSocket::TextFrame{payload}};
+  SimpleWebSocket::MessageParser<std::size_t> messageParser{std::make_unique<LengthFrameParser>()};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(messageParser.parse(message));
+  }
+  frameRate(state, payload.size());
+}
+BENCHMARK(BM_MessageParserParse)->Arg(16)->Arg(4096);
+
+static void BM_StaticMessageParserParse(benchmark::State &state) {
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  const SimpleWebSocket::Message message{SimpleWebSocket::TextFrame{payload}};
+  SimpleWebSocket::StaticMessageParser<std::size_t, LengthFrameParser> messageParser{LengthFrameParser{}};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(messageParser.parse(message));
+  }
+  frameRate(state, payload.size());
+}
+BENCHMARK(BM_StaticMessageParserParse)->Arg(16)->Arg(4096);
+
+static void BM_MessageEquals(benchmark::State &state) {
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  const SimpleWebSocket::Message lhs{SimpleWebSocket::TextFrame{payload}};
+  const SimpleWebSocket::Message rhs{SimpleWebSocket::TextFrame{payload}};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(lhs == rhs);
+  }
+  frameRate(state, payload.size());
+}
+BENCHMARK(BM_MessageEquals)->Arg(16)->Arg(4096)->Arg(65536);
+
+static void BM_MessageEqualsMismatchedFrames(benchmark::State &state) {
+  const SimpleWebSocket::Message lhs{SimpleWebSocket::CloseFrame{"close"}};
+  const SimpleWebSocket::Message rhs{SimpleWebSocket::UndefinedFrame{}};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(lhs == rhs);
+  }
+  frameRate(state, 0);
+}
+BENCHMARK(BM_MessageEqualsMismatchedFrames);
@@ -0,0 +1,80 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+namespace {
+  constexpr std::string_view TICK =
+      R"({"type":"trade","symbol":"BTC-USD","sequence":9200001,"price":"64100.10","size":"0.0100","side":"buy"})";
+
+  // Stands in for business logic: state.range(0) rounds of hashing per message.
+  struct WorkingFrameHandler final : SimpleWebSocket::FrameHandler {
+    WorkingFrameHandler(int rounds, std::atomic<int64_t> &handled) : rounds_(rounds), handled_(handled) {}
+
+    void handlePing(const SimpleWebSocket::PingFrame &) override {}
+
+    void handlePong(const SimpleWebSocket::PongFrame &) override {}
+
+    void handleText(const SimpleWebSocket::TextFrame &textFrame) override { work(textFrame.value()); }
+
+    void handleBinary(const SimpleWebSocket::BinaryFrame &) override {}
+
+    void handleClose(const SimpleWebSocket::CloseFrame &) override {}
+
+    void handleUndefined(const SimpleWebSocket::UndefinedFrame &) override {}
+
+    void handleTextView(const SimpleWebSocket::TextFrameView &textFrameView) override { work(textFrameView.value()); }
+
+  private:
+    void work(std::string_view text) {
+      std::size_t hash = 0;
+      for (int round = 0; round < rounds_; ++round) {
+        hash ^= std::hash<std::string_view>{}(text) + static_cast<std::size_t>(round);
+      }
+      benchmark::DoNotOptimize(hash);
+      handled_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int rounds_;
+    std::atomic<int64_t> &handled_;
+  };
+}
+
+// The receive thread runs the handler itself.
+static void BM_HandlerInline(benchmark::State &state) {
+  std::atomic<int64_t> handled = 0;
+  SimpleWebSocket::MessageHandler messageHandler{std::make_unique<WorkingFrameHandler>(static_cast<int>(state.range(0)), handled)};
+  for (auto _ : state) {
+    messageHandler.handle(SimpleWebSocket::MessageView{SimpleWebSocket::TextFrameView{TICK}});
+  }
+  state.SetItemsProcessed(handled);
+}
+BENCHMARK(BM_HandlerInline)->ArgName("rounds")->Arg(0)->Arg(64)->UseRealTime();
+
+// The receive thread queues messages from range(1) connections for a pool of range(2) workers, and the time includes
+// draining the queues.
+static void BM_HandlerWorkerPool(benchmark::State &state) {
+  std::atomic<int64_t> handled = 0;
+  int64_t queued = 0;
+  {
+    SimpleWebSocket::WorkerPool pool{{.threads = static_cast<std::size_t>(state.range(2)), .capacity = 4096}};
+    std::vector<std::unique_ptr<SimpleWebSocket::MessageHandler>> messageHandlers;
+    for (int64_t connection = 0; connection < state.range(1); ++connection) {
+      messageHandlers.push_back(std::make_unique<SimpleWebSocket::MessageHandler>(
+          pool.attach(std::make_unique<WorkingFrameHandler>(static_cast<int>(state.range(0)), handled))));
+    }
+    for (auto _ : state) {
+      messageHandlers[static_cast<std::size_t>(queued++) % messageHandlers.size()]->handle(
+          SimpleWebSocket::MessageView{SimpleWebSocket::TextFrameView{TICK}});
+    }
+    while (handled < queued) {
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(handled);
+}
+BENCHMARK(BM_HandlerWorkerPool)
+    ->ArgNames({"rounds", "connections", "workers"})
+    ->Args({0, 8, 1})
+    ->Args({64, 8, 1})
+    ->Args({64, 8, 2})
+    ->Args({64, 8, 4})
+    ->UseRealTime();
@@ -0,0 +1,111 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+#include "../test/LoopbackServer.h"
+
+namespace {
+  constexpr int FRAME_SIZE = 1 << 20;
+}
+
+// The server streams frames of state.range(0) bytes as fast as the client reads them.
+static void BM_WrapperReceive(benchmark::State &state) {
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  LoopbackServer server{[&payload](Poco::Net::WebSocket &webSocket) {
+    try {
+      while (true) {
+        webSocket.sendFrame(payload.data(), static_cast<int>(payload.size()), Poco::Net::WebSocket::FRAME_BINARY);
+      }
+    } catch (const std::exception &) { }
+  }};
+
+  {
+    auto delegate = SimpleWebSocket::Poco::wrapper<FRAME_SIZE>("127.0.0.1", server.port(), "/");
+    int flags = 0;
+    for (auto _ : state) {
+      std::span<char> received = delegate.receive(flags);
+      benchmark::DoNotOptimize(received.data());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WrapperReceive)->Arg(16)->Arg(1024)->Arg(65536)->UseRealTime();
+
+// One frame of state.range(0) bytes to an echo server and back per iteration.
+static void BM_WrapperEcho(benchmark::State &state) {
+  LoopbackServer server{[](Poco::Net::WebSocket &webSocket) {
+    std::vector<char> buffer(FRAME_SIZE);
+    int flags = 0;
+    try {
+      int received = webSocket.receiveFrame(buffer.data(), static_cast<int>(buffer.size()), flags);
+      while (received > 0) {
+        webSocket.sendFrame(buffer.data(), received, flags);
+        received = webSocket.receiveFrame(buffer.data(), static_cast<int>(buffer.size()), flags);
+      }
+    } catch (const std::exception &) { }
+  }};
+
+  const std::string payload(static_cast<std::size_t>(state.range(0)), 'x');
+  {
+    auto delegate = SimpleWebSocket::Poco::wrapper<FRAME_SIZE>("127.0.0.1", server.port(), "/");
+    int flags = 0;
+    for (auto _ : state) {
+      delegate.send(payload, Poco::Net::WebSocket::FRAME_BINARY);
+      std::span<char> received = delegate.receive(flags);
+      benchmark::DoNotOptimize(received.data());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0) * 2);
+}
+BENCHMARK(BM_WrapperEcho)->Arg(16)->Arg(1024)->Arg(65536)->UseRealTime();
+
+namespace {
+  // A server that reads and discards frames until the client goes away.
+  void drain(Poco::Net::WebSocket &webSocket) {
+    std::vector<char> buffer(FRAME_SIZE);
+    int flags = 0;
+    try {
+      while (webSocket.receiveFrame(buffer.data(), static_cast<int>(buffer.size()), flags) > 0 || flags != 0) { }
+    } catch (const std::exception &) { }
+  }
+
+  const std::string TICK = R"({"type":"trade","symbol":"BTC-USD","price":"64123.50","size":"0.0150"})";
+}
+
+// state.range(0) small frames per iteration, one sendFrame call each.
+static void BM_WrapperSendEach(benchmark::State &state) {
+  LoopbackServer server{drain};
+  {
+    auto delegate = SimpleWebSocket::Poco::wrapper<FRAME_SIZE>("127.0.0.1", server.port(), "/");
+    for (auto _ : state) {
+      for (int64_t frame = 0; frame < state.range(0); ++frame) {
+        delegate.send(TICK, Poco::Net::WebSocket::FRAME_TEXT);
+      }
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * static_cast<int64_t>(TICK.size()));
+}
+BENCHMARK(BM_WrapperSendEach)->Arg(1)->Arg(16)->Arg(256)->UseRealTime();
+
+// The same frames gathered into one SendBatch per iteration.
+static void BM_WrapperSendBatch(benchmark::State &state) {
+  LoopbackServer server{drain};
+  {
+    auto delegate = SimpleWebSocket::Poco::wrapper<FRAME_SIZE>("127.0.0.1", server.port(), "/");
+    SimpleWebSocket::SendBatch batch{SimpleWebSocket::Role::Client};
+    for (auto _ : state) {
+      for (int64_t frame = 0; frame < state.range(0); ++frame) {
+        batch.add(SimpleWebSocket::OpCode::Text, TICK);
+      }
+      delegate.send(batch);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * static_cast<int64_t>(TICK.size()));
+}
+BENCHMARK(BM_WrapperSendBatch)->Arg(1)->Arg(16)->Arg(256)->UseRealTime();
@@ -0,0 +1,83 @@
+#include <benchmark/benchmark.h>
+#include "../simple_websocket.hpp"
+
+#if __has_include(<sys/mman.h>)
+namespace {
+  struct CountingFrameHandler final : SimpleWebSocket::FrameHandler {
+    void handlePing(const SimpleWebSocket::PingFrame &) override { ++handled; }
+
+    void handlePong(const SimpleWebSocket::PongFrame &) override { ++handled; }
+
+    void handleText(const SimpleWebSocket::TextFrame &) override { ++handled; }
+
+    void handleBinary(const SimpleWebSocket::BinaryFrame &) override { ++handled; }
+
+    void handleClose(const SimpleWebSocket::CloseFrame &) override { ++handled; }
+
+    void handleUndefined(const SimpleWebSocket::UndefinedFrame &) override { ++handled; }
+
+    void handleTextView(const SimpleWebSocket::TextFrameView &textFrameView) override {
+      bytes += textFrameView.value().size();
+      ++handled;
+    }
+
+    std::size_t handled = 0;
+    std::size_t bytes = 0;
+  };
+
+  // A capture of state.range(0) trade ticks, as a feed would have sent them.
+  struct TickCapture final {
+    explicit TickCapture(std::size_t ticks) {
+      ::close(::mkstemp(path));
+      {
+        auto writer = std::get<std::shared_ptr<SimpleWebSocket::CaptureWriter>>(SimpleWebSocket::CaptureWriter::open(path));
+        const auto start = SimpleWebSocket::CaptureWriter::Clock::now();
+        for (std::size_t tick = 0; tick < ticks; ++tick) {
+          writer->record(SimpleWebSocket::OpCode::Text,
+                         R"({"type":"trade","symbol":"BTC-USD","sequence":)" + std::to_string(tick) + R"(,"price":"64123.50"})",
+                         start + tick * std::chrono::microseconds{10});
+        }
+      }
+      capture.emplace(std::move(std::get<SimpleWebSocket::Capture>(SimpleWebSocket::Capture::open(path))));
+    }
+
+    ~TickCapture() {
+      std::remove(path);
+    }
+
+    char path[40] = "/tmp/simple_websocket_benchXXXXXX";
+    std::optional<SimpleWebSocket::Capture> capture;
+  };
+}
+
+// Handler throughput from a mapped capture, with no network in the way.
+static void BM_ReplayCapture(benchmark::State &state) {
+  TickCapture ticks{static_cast<std::size_t>(state.range(0))};
+  auto counting = std::make_unique<CountingFrameHandler>();
+  CountingFrameHandler &handler = *counting;
+  SimpleWebSocket::MessageHandler messageHandler{std::move(counting)};
+  for (auto _ : state) {
+    SimpleWebSocket::replay(*ticks.capture, messageHandler, {.speed = 0});
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(handler.handled));
+  state.SetBytesProcessed(static_cast<int64_t>(handler.bytes));
+}
+BENCHMARK(BM_ReplayCapture)->Arg(1 << 16);
+
+// The cost of recording a message on the receive path.
+static void BM_CaptureRecord(benchmark::State &state) {
+  char path[] = "/tmp/simple_websocket_benchXXXXXX";
+  ::close(::mkstemp(path));
+  {
+    auto writer = std::get<std::shared_ptr<SimpleWebSocket::CaptureWriter>>(SimpleWebSocket::CaptureWriter::open(path));
+    const std::string tick = R"({"type":"trade","symbol":"BTC-USD","sequence":9200000,"price":"64123.50"})";
+    const SimpleWebSocket::MessageView messageView{SimpleWebSocket::TextFrameView{tick}};
+    for (auto _ : state) {
+      writer->record(messageView);
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+  std::remove(path);
+}
+BENCHMARK(BM_CaptureRecord);
+#endif
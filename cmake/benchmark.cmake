@@ -0,0 +1,27 @@
+option(SIMPLE_WEBSOCKET_BENCHMARKS "Build the simple_websocket_bench target" OFF)
+
+if (SIMPLE_WEBSOCKET_BENCHMARKS)
+  set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+  set(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+  FetchContent_Declare(
+      benchmark
+      GIT_SHALLOW    TRUE
+      GIT_REPOSITORY https://github.com/google/benchmark.git
+      GIT_TAG        v1.8.3)
+  FetchContent_MakeAvailable(benchmark)
+  add_executable(simple_websocket_bench
+      bench/AllocationBench.cpp
+      bench/BroadcastBench.cpp
+      bench/CodecBench.cpp
+      bench/DecodeBench.cpp
+      bench/DeflateBench.cpp
+      bench/DispatchBench.cpp
+      bench/FrameBench.cpp
+      bench/HandOffBench.cpp
+      bench/LoopbackBench.cpp
+      bench/ReplayBench.cpp)
+  target_link_libraries(simple_websocket_bench benchmark::benchmark_main Poco::Net Poco::NetSSL)
+  target_compile_options(simple_websocket_bench PRIVATE -Wall -Werror -Wno-deprecated-enum-enum-conversion)
+  simple_websocket_deflate(simple_websocket_bench)
+  simple_websocket_simdjson(simple_websocket_bench)
+endif()
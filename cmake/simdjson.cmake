@@ -0,0 +1,17 @@
+# JsonDecoder parses with simdjson. The header only compiles it in when SIMPLE_WEBSOCKET_ENABLE_SIMDJSON is defined, so
+# targets that never link simdjson are unaffected.
+option(SIMPLE_WEBSOCKET_SIMDJSON "Decode JSON messages with simdjson" OFF)
+if (SIMPLE_WEBSOCKET_SIMDJSON)
+  FetchContent_Declare(
+      simdjson
+      GIT_SHALLOW    TRUE
+      GIT_REPOSITORY https://github.com/simdjson/simdjson.git
+      GIT_TAG        v3.10.1)
+  FetchContent_MakeAvailable(simdjson)
+endif()
+function(simple_websocket_simdjson target)
+  if (SIMPLE_WEBSOCKET_SIMDJSON)
+    target_compile_definitions(${target} PRIVATE SIMPLE_WEBSOCKET_ENABLE_SIMDJSON)
+    target_link_libraries(${target} simdjson::simdjson)
+  endif()
+endfunction()
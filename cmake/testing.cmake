@@ -9,8 +9,10 @@ enable_testing()
 include_directories(.)
 include_directories(../)
 add_executable(simple_websocket_test test/SimpleWebSocketTests.cpp)
-target_link_libraries(simple_websocket_test Catch2::Catch2 Poco::Net)
+target_link_libraries(simple_websocket_test Catch2::Catch2 Poco::Net Poco::NetSSL)
 target_compile_options(simple_websocket_test PRIVATE -Wall -Werror -Wno-deprecated-enum-enum-conversion -Wno-implicit-int-float-conversion)
+simple_websocket_deflate(simple_websocket_test)
+simple_websocket_simdjson(simple_websocket_test)
 include(CTest)
 include(Catch)
 catch_discover_tests(simple_websocket_test)
\ No newline at end of file
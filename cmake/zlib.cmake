@@ -0,0 +1,10 @@
+# permessage-deflate needs zlib. The header only compiles it in when SIMPLE_WEBSOCKET_ENABLE_DEFLATE is defined, so
+# targets that never link zlib are unaffected.
+find_package(ZLIB)
+
+function(simple_websocket_deflate target)
+  if (ZLIB_FOUND)
+    target_compile_definitions(${target} PRIVATE SIMPLE_WEBSOCKET_ENABLE_DEFLATE)
+    target_link_libraries(${target} ZLIB::ZLIB)
+  endif()
+endfunction()
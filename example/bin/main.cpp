@@ -39,8 +39,8 @@ int main() {
     },
     [](const SimpleWebSocket::Failure &failure) {
       std::cout << failure << std::endl;
-      std::this_thread::sleep_for(1s);
-    }
+    },
+    SimpleWebSocket::ReconnectPolicy{{.initialDelay = 250ms, .maxDelay = 30s}}
   };
 
   workflow.runUntilCancelled();
@@ -8,28 +8,36 @@ struct WebSocketClient final {
   explicit WebSocketClient(SimpleWebSocket::ExecutionContext executionContext,
                            std::function<SimpleWebSocket::WorkflowResult(const std::variant<SimpleWebSocket::Failure, std::monostate>&)> resultFn)
     : executionContext_(std::move(executionContext))
-    , resultFn_(resultFn)
+    , resultFn_(std::move(resultFn))
   { }
 
    [[nodiscard]] SimpleWebSocket::WorkflowResult start(std::atomic<bool> &continueRunning) const {
-    ExampleFrameParser frameParser;
     SimpleWebSocket::MessageParser<std::variant<std::monostate, std::string>> parser{
-      std::make_unique<ExampleFrameParser>(frameParser)
+      std::make_unique<ExampleFrameParser>()
     };
 
-    int flags;
-
     try {
       SimpleWebSocket::Poco::Wrapper<FRAME_SIZE> delegate = SimpleWebSocket::Poco::wrapper<FRAME_SIZE>(
           executionContext_.host(),
           executionContext_.port(),
           executionContext_.uri()
       );
+      delegate.keepAlive({.interval = std::chrono::seconds{5}, .maxMissedPongs = 2});
+      SimpleWebSocket::Reassembler reassembler = delegate.reassembler();
 
       while (continueRunning) {
-        std::span<char> result = delegate.receive(flags);
-        SimpleWebSocket::Message message = SimpleWebSocket::Poco::fromPoco(flags, result.data(), static_cast<int>(result.size()));
-        const std::variant<std::monostate, std::string> &parseResult = parser.parse(message);
+        SimpleWebSocket::ReassemblyResult result = delegate.receive(reassembler);
+        if (const auto *failure = std::get_if<SimpleWebSocket::Failure>(&result)) {
+          return resultFn_(*failure);
+        }
+        const auto *messageView = std::get_if<SimpleWebSocket::MessageView>(&result);
+        // The Wrapper answers pings and consumes the pongs to its own pings.
+        if (messageView == nullptr ||
+            std::holds_alternative<SimpleWebSocket::PingFrameView>(messageView->value()) ||
+            std::holds_alternative<SimpleWebSocket::PongFrameView>(messageView->value())) {
+          continue;
+        }
+        const std::variant<std::monostate, std::string> &parseResult = parser.parse(*messageView);
         if (std::holds_alternative<std::monostate>(parseResult)) {
           return resultFn_(SimpleWebSocket::Failure{"WebSocket connection closed"});
         }
@@ -1,22 +1,95 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <span>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <array>
+#include <cstring>
+#include <algorithm>
 #include <utility>
 #include <vector>
 #include <variant>
 #include <memory>
+#include <memory_resource>
 #include <functional>
+#include <concepts>
+#include <type_traits>
+#include <mutex>
+#include <random>
+#include <bit>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <chrono>
+#include <deque>
+#include <cmath>
+#include <compare>
+#include <charconv>
+#include <limits>
+#include <iterator>
+#include <map>
+#include <stop_token>
+#include <condition_variable>
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+#include <zlib.h>
+#endif
+#ifdef SIMPLE_WEBSOCKET_ENABLE_SIMDJSON
+#include <simdjson.h>
+#include <unistd.h>
+#endif
+#if __has_include(<sys/random.h>)
+#include <sys/types.h>
+#include <sys/random.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SIMPLE_WEBSOCKET_X86_KERNELS 1
+#include <immintrin.h>
+#endif
 
 namespace SimpleWebSocket {
+    constexpr std::size_t CACHE_LINE_SIZE = 64;
+
     template<class... As>
     struct visitor : As ... {
         using As::operator()...;
     };
     template<class... As> visitor(As...) -> visitor<As...>;
 
+    enum class OpCode : uint8_t {
+        Continuation = 0x0,
+        Text = 0x1,
+        Binary = 0x2,
+        Close = 0x8,
+        Ping = 0x9,
+        Pong = 0xA
+    };
+
+    enum class Role {
+        Client,
+        Server
+    };
+
+    enum class CloseCode : uint16_t {
+        Normal = 1000,
+        GoingAway = 1001,
+        ProtocolError = 1002,
+        UnsupportedData = 1003,
+        AbnormalClosure = 1006,
+        InvalidPayload = 1007,
+        PolicyViolation = 1008,
+        MessageTooBig = 1009,
+        InternalError = 1011
+    };
+
     struct Failure final {
         explicit Failure(std::string value) : value_(std::move(value)) {}
 
+        Failure(std::string value, CloseCode closeCode) : value_(std::move(value)), closeCode_(closeCode) {}
+
         friend std::ostream &operator<<(std::ostream &os, const Failure &failure) {
             os << failure.value_;
             return os;
@@ -26,111 +99,205 @@ namespace SimpleWebSocket {
             return value_;
         }
 
+        [[nodiscard]] std::optional<CloseCode> closeCode() const {
+            return closeCode_;
+        }
+
     private:
         std::string value_;
+        std::optional<CloseCode> closeCode_;
+    };
+
+    // Thrown by a FrameHandler to end the connection with the given Failure, and its close code, rather than the
+    // InternalError any other exception ends it with.
+    struct FailureError final : std::runtime_error {
+        explicit FailureError(Failure failure) : std::runtime_error(failure.value()), failure_(std::move(failure)) {}
+
+        [[nodiscard]] const Failure &failure() const {
+            return failure_;
+        }
+
+    private:
+        Failure failure_;
     };
 
 
-    struct PingFrame final {
-        explicit PingFrame(std::string value) : value_(std::move(value)) {}
+    template<class Allocator = std::allocator<char>>
+    struct BasicPingFrame final {
+        using allocator_type = Allocator;
+        using value_type = std::basic_string<char, std::char_traits<char>, Allocator>;
+
+        explicit BasicPingFrame(value_type value) : value_(std::move(value)) {}
 
-        bool operator==(const PingFrame &rhs) const {
+        BasicPingFrame(std::string_view value, const Allocator &allocator) : value_(value, allocator) {}
+
+        bool operator==(const BasicPingFrame &rhs) const {
             return value_ == rhs.value_;
         }
 
-        bool operator!=(const PingFrame &rhs) const {
+        bool operator!=(const BasicPingFrame &rhs) const {
             return !(rhs == *this);
         }
 
         [[nodiscard]]
-        const std::string &value() const {
+        const value_type &value() const {
             return value_;
         }
 
+        // Moves the payload out, so a handler that keeps it does not copy it.
+        [[nodiscard]]
+        value_type take() && {
+            return std::move(value_);
+        }
+
     private:
-        std::string value_;
+        value_type value_;
     };
 
-    struct PongFrame final {
-        explicit PongFrame(std::string value) : value_(std::move(value)) {}
+    using PingFrame = BasicPingFrame<>;
+
+    template<class Allocator = std::allocator<char>>
+    struct BasicPongFrame final {
+        using allocator_type = Allocator;
+        using value_type = std::basic_string<char, std::char_traits<char>, Allocator>;
 
-        bool operator==(const PongFrame &rhs) const {
+        explicit BasicPongFrame(value_type value) : value_(std::move(value)) {}
+
+        BasicPongFrame(std::string_view value, const Allocator &allocator) : value_(value, allocator) {}
+
+        bool operator==(const BasicPongFrame &rhs) const {
             return value_ == rhs.value_;
         }
 
-        bool operator!=(const PongFrame &rhs) const {
+        bool operator!=(const BasicPongFrame &rhs) const {
             return !(rhs == *this);
         }
 
         [[nodiscard]]
-        const std::string &value() const {
+        const value_type &value() const {
             return value_;
         }
 
+        // Moves the payload out, so a handler that keeps it does not copy it.
+        [[nodiscard]]
+        value_type take() && {
+            return std::move(value_);
+        }
+
     private:
-        std::string value_;
+        value_type value_;
     };
 
-    struct TextFrame final {
-        explicit TextFrame(std::string value) : value_(std::move(value)) {}
+    using PongFrame = BasicPongFrame<>;
+
+    template<class Allocator = std::allocator<char>>
+    struct BasicTextFrame final {
+        using allocator_type = Allocator;
+        using value_type = std::basic_string<char, std::char_traits<char>, Allocator>;
+
+        explicit BasicTextFrame(value_type value) : value_(std::move(value)) {}
 
-        bool operator==(const TextFrame &rhs) const {
+        BasicTextFrame(std::string_view value, const Allocator &allocator) : value_(value, allocator) {}
+
+        bool operator==(const BasicTextFrame &rhs) const {
             return value_ == rhs.value_;
         }
 
-        bool operator!=(const TextFrame &rhs) const {
+        bool operator!=(const BasicTextFrame &rhs) const {
             return !(rhs == *this);
         }
 
         [[nodiscard]]
-        const std::string &value() const {
+        const value_type &value() const {
             return value_;
         }
 
+        // Moves the payload out, so a handler that keeps it does not copy it.
+        [[nodiscard]]
+        value_type take() && {
+            return std::move(value_);
+        }
+
     private:
-        std::string value_;
+        value_type value_;
     };
 
-    struct BinaryFrame final {
-        explicit BinaryFrame(std::vector<char> value) : value_(std::move(value)) {}
+    using TextFrame = BasicTextFrame<>;
+
+    template<class Allocator = std::allocator<char>>
+    struct BasicBinaryFrame final {
+        using allocator_type = Allocator;
+        using value_type = std::vector<char, Allocator>;
+
+        explicit BasicBinaryFrame(value_type value) : value_(std::move(value)) {}
+
+        // Sized first and copied in one go: an allocator with its own construct(), such as polymorphic_allocator, would
+        // otherwise be called byte by byte.
+        BasicBinaryFrame(std::span<const char> value, const Allocator &allocator) : value_(value.size(), allocator) {
+            if (!value.empty()) {
+                std::memcpy(value_.data(), value.data(), value.size());
+            }
+        }
 
-        bool operator==(const BinaryFrame &rhs) const {
+        bool operator==(const BasicBinaryFrame &rhs) const {
             return value_ == rhs.value_;
         }
 
-        bool operator!=(const BinaryFrame &rhs) const {
+        bool operator!=(const BasicBinaryFrame &rhs) const {
             return !(rhs == *this);
         }
 
         [[nodiscard]]
-        const std::vector<char> &value() const {
+        const value_type &value() const {
             return value_;
         }
 
+        // Moves the payload out, so a handler that keeps it does not copy it.
+        [[nodiscard]]
+        value_type take() && {
+            return std::move(value_);
+        }
+
     private:
-        std::vector<char> value_;
+        value_type value_;
     };
 
-    struct CloseFrame final {
-        explicit CloseFrame(std::string value) : value_(std::move(value)) {}
+    using BinaryFrame = BasicBinaryFrame<>;
+
+    template<class Allocator = std::allocator<char>>
+    struct BasicCloseFrame final {
+        using allocator_type = Allocator;
+        using value_type = std::basic_string<char, std::char_traits<char>, Allocator>;
+
+        explicit BasicCloseFrame(value_type value) : value_(std::move(value)) {}
+
+        BasicCloseFrame(std::string_view value, const Allocator &allocator) : value_(value, allocator) {}
 
-        bool operator==(const CloseFrame &rhs) const {
+        bool operator==(const BasicCloseFrame &rhs) const {
             return value_ == rhs.value_;
         }
 
-        bool operator!=(const CloseFrame &rhs) const {
+        bool operator!=(const BasicCloseFrame &rhs) const {
             return !(rhs == *this);
         }
 
         [[nodiscard]]
-        const std::string &value() const {
+        const value_type &value() const {
             return value_;
         }
 
+        // Moves the payload out, so a handler that keeps it does not copy it.
+        [[nodiscard]]
+        value_type take() && {
+            return std::move(value_);
+        }
+
     private:
-        std::string value_;
+        value_type value_;
     };
 
+    using CloseFrame = BasicCloseFrame<>;
+
     struct UndefinedFrame final {
         bool operator==(const UndefinedFrame &_) const {
             return true;
@@ -141,6 +308,157 @@ namespace SimpleWebSocket {
         }
     };
 
+    struct PingFrameView final {
+        explicit PingFrameView(std::string_view value) : value_(value) {}
+
+        bool operator==(const PingFrameView &rhs) const {
+            return value_ == rhs.value_;
+        }
+
+        bool operator!=(const PingFrameView &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]]
+        std::string_view value() const {
+            return value_;
+        }
+
+        [[nodiscard]]
+        PingFrame materialize() const {
+            return PingFrame{std::string{value_}};
+        }
+
+        template<class Allocator>
+        [[nodiscard]] BasicPingFrame<Allocator> materialize(const Allocator &allocator) const {
+            return BasicPingFrame<Allocator>{value_, allocator};
+        }
+
+    private:
+        std::string_view value_;
+    };
+
+    struct PongFrameView final {
+        explicit PongFrameView(std::string_view value) : value_(value) {}
+
+        bool operator==(const PongFrameView &rhs) const {
+            return value_ == rhs.value_;
+        }
+
+        bool operator!=(const PongFrameView &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]]
+        std::string_view value() const {
+            return value_;
+        }
+
+        [[nodiscard]]
+        PongFrame materialize() const {
+            return PongFrame{std::string{value_}};
+        }
+
+        template<class Allocator>
+        [[nodiscard]] BasicPongFrame<Allocator> materialize(const Allocator &allocator) const {
+            return BasicPongFrame<Allocator>{value_, allocator};
+        }
+
+    private:
+        std::string_view value_;
+    };
+
+    struct TextFrameView final {
+        explicit TextFrameView(std::string_view value) : value_(value) {}
+
+        bool operator==(const TextFrameView &rhs) const {
+            return value_ == rhs.value_;
+        }
+
+        bool operator!=(const TextFrameView &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]]
+        std::string_view value() const {
+            return value_;
+        }
+
+        [[nodiscard]]
+        TextFrame materialize() const {
+            return TextFrame{std::string{value_}};
+        }
+
+        template<class Allocator>
+        [[nodiscard]] BasicTextFrame<Allocator> materialize(const Allocator &allocator) const {
+            return BasicTextFrame<Allocator>{value_, allocator};
+        }
+
+    private:
+        std::string_view value_;
+    };
+
+    struct BinaryFrameView final {
+        explicit BinaryFrameView(std::span<const std::byte> value) : value_(value) {}
+
+        bool operator==(const BinaryFrameView &rhs) const {
+            return std::ranges::equal(value_, rhs.value_);
+        }
+
+        bool operator!=(const BinaryFrameView &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]]
+        std::span<const std::byte> value() const {
+            return value_;
+        }
+
+        [[nodiscard]]
+        BinaryFrame materialize() const {
+            const char *data = reinterpret_cast<const char *>(value_.data());
+            return BinaryFrame{std::vector<char>(data, data + value_.size())};
+        }
+
+        template<class Allocator>
+        [[nodiscard]] BasicBinaryFrame<Allocator> materialize(const Allocator &allocator) const {
+            return BasicBinaryFrame<Allocator>{{reinterpret_cast<const char *>(value_.data()), value_.size()}, allocator};
+        }
+
+    private:
+        std::span<const std::byte> value_;
+    };
+
+    struct CloseFrameView final {
+        explicit CloseFrameView(std::string_view value) : value_(value) {}
+
+        bool operator==(const CloseFrameView &rhs) const {
+            return value_ == rhs.value_;
+        }
+
+        bool operator!=(const CloseFrameView &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]]
+        std::string_view value() const {
+            return value_;
+        }
+
+        [[nodiscard]]
+        CloseFrame materialize() const {
+            return CloseFrame{std::string{value_}};
+        }
+
+        template<class Allocator>
+        [[nodiscard]] BasicCloseFrame<Allocator> materialize(const Allocator &allocator) const {
+            return BasicCloseFrame<Allocator>{value_, allocator};
+        }
+
+    private:
+        std::string_view value_;
+    };
+
     struct FrameHandler {
         virtual ~FrameHandler() = default;
 
@@ -155,6 +473,26 @@ namespace SimpleWebSocket {
         virtual void handleClose(const CloseFrame &closeFrame) = 0;
 
         virtual void handleUndefined(const UndefinedFrame &undefinedFrame) = 0;
+
+        virtual void handlePingView(const PingFrameView &pingFrameView) {
+            handlePing(pingFrameView.materialize());
+        }
+
+        virtual void handlePongView(const PongFrameView &pongFrameView) {
+            handlePong(pongFrameView.materialize());
+        }
+
+        virtual void handleTextView(const TextFrameView &textFrameView) {
+            handleText(textFrameView.materialize());
+        }
+
+        virtual void handleBinaryView(const BinaryFrameView &binaryFrameView) {
+            handleBinary(binaryFrameView.materialize());
+        }
+
+        virtual void handleCloseView(const CloseFrameView &closeFrameView) {
+            handleClose(closeFrameView.materialize());
+        }
     };
 
     template<class A>
@@ -172,31 +510,68 @@ namespace SimpleWebSocket {
         virtual A handleClose(const CloseFrame &closeFrame) = 0;
 
         virtual A handleUndefined(const UndefinedFrame &undefinedFrame) = 0;
+
+        virtual A handlePingView(const PingFrameView &pingFrameView) {
+            return handlePing(pingFrameView.materialize());
+        }
+
+        virtual A handlePongView(const PongFrameView &pongFrameView) {
+            return handlePong(pongFrameView.materialize());
+        }
+
+        virtual A handleTextView(const TextFrameView &textFrameView) {
+            return handleText(textFrameView.materialize());
+        }
+
+        virtual A handleBinaryView(const BinaryFrameView &binaryFrameView) {
+            return handleBinary(binaryFrameView.materialize());
+        }
+
+        virtual A handleCloseView(const CloseFrameView &closeFrameView) {
+            return handleClose(closeFrameView.materialize());
+        }
     };
 
-    struct Message final {
-        explicit Message(std::variant<PingFrame, PongFrame, TextFrame, BinaryFrame, CloseFrame, UndefinedFrame> value)
-                : value_(std::move(value)) {}
+    struct MessageView;
+
+    template<class Allocator = std::allocator<char>>
+    struct BasicMessage final {
+        using allocator_type = Allocator;
+        using value_type = std::variant<BasicPingFrame<Allocator>, BasicPongFrame<Allocator>, BasicTextFrame<Allocator>,
+                                        BasicBinaryFrame<Allocator>, BasicCloseFrame<Allocator>, UndefinedFrame>;
 
-        bool operator==(const Message &rhs) const {
-            if (std::holds_alternative<PingFrame>(value_) && std::holds_alternative<PingFrame>(rhs.value())) {
-                return std::get<PingFrame>(value_) == std::get<PingFrame>(rhs.value());
+        explicit BasicMessage(value_type value) : value_(std::move(value)) {}
+
+        // Builds the frame straight into the message, e.g. Message{std::in_place_type<TextFrame>, std::move(payload)}.
+        template<class Frame, class... Args>
+        explicit BasicMessage(std::in_place_type_t<Frame> frame, Args &&... args)
+                : value_(frame, std::forward<Args>(args)...) {}
+
+        // Replaces the frame with one built in place, and returns it.
+        template<class Frame, class... Args>
+        Frame &emplace(Args &&... args) {
+            return value_.template emplace<Frame>(std::forward<Args>(args)...);
+        }
+
+        bool operator==(const BasicMessage &rhs) const {
+            if (std::holds_alternative<BasicPingFrame<Allocator>>(value_) && std::holds_alternative<BasicPingFrame<Allocator>>(rhs.value())) {
+                return std::get<BasicPingFrame<Allocator>>(value_) == std::get<BasicPingFrame<Allocator>>(rhs.value());
             }
 
-            if (std::holds_alternative<PongFrame>(value_) && std::holds_alternative<PongFrame>(rhs.value())) {
-                return std::get<PongFrame>(value_) == std::get<PongFrame>(rhs.value());
+            if (std::holds_alternative<BasicPongFrame<Allocator>>(value_) && std::holds_alternative<BasicPongFrame<Allocator>>(rhs.value())) {
+                return std::get<BasicPongFrame<Allocator>>(value_) == std::get<BasicPongFrame<Allocator>>(rhs.value());
             }
 
-            if (std::holds_alternative<TextFrame>(value_) && std::holds_alternative<TextFrame>(rhs.value())) {
-                return std::get<TextFrame>(value_) == std::get<TextFrame>(rhs.value());
+            if (std::holds_alternative<BasicTextFrame<Allocator>>(value_) && std::holds_alternative<BasicTextFrame<Allocator>>(rhs.value())) {
+                return std::get<BasicTextFrame<Allocator>>(value_) == std::get<BasicTextFrame<Allocator>>(rhs.value());
             }
 
-            if (std::holds_alternative<BinaryFrame>(value_) && std::holds_alternative<BinaryFrame>(rhs.value())) {
-                return std::get<BinaryFrame>(value_) == std::get<BinaryFrame>(rhs.value());
+            if (std::holds_alternative<BasicBinaryFrame<Allocator>>(value_) && std::holds_alternative<BasicBinaryFrame<Allocator>>(rhs.value())) {
+                return std::get<BasicBinaryFrame<Allocator>>(value_) == std::get<BasicBinaryFrame<Allocator>>(rhs.value());
             }
 
-            if (std::holds_alternative<CloseFrame>(value_) && std::holds_alternative<CloseFrame>(rhs.value())) {
-                return std::get<CloseFrame>(value_) == std::get<CloseFrame>(rhs.value());
+            if (std::holds_alternative<BasicCloseFrame<Allocator>>(value_) && std::holds_alternative<BasicCloseFrame<Allocator>>(rhs.value())) {
+                return std::get<BasicCloseFrame<Allocator>>(value_) == std::get<BasicCloseFrame<Allocator>>(rhs.value());
             }
 
             if (std::holds_alternative<UndefinedFrame>(value_) && std::holds_alternative<UndefinedFrame>(rhs.value())) {
@@ -206,145 +581,6448 @@ namespace SimpleWebSocket {
             return false;
         }
 
-        bool operator!=(const Message &rhs) const {
+        bool operator!=(const BasicMessage &rhs) const {
             return !(rhs == *this);
         }
 
         [[nodiscard]]
-        const std::variant<PingFrame, PongFrame, TextFrame, BinaryFrame, CloseFrame, UndefinedFrame> &value() const {
+        const value_type &value() const {
             return value_;
         }
 
-    private:
-        std::variant<PingFrame, PongFrame, TextFrame, BinaryFrame, CloseFrame, UndefinedFrame> value_;
-    };
-
-    struct MessageHandler final {
-        explicit MessageHandler(std::unique_ptr<FrameHandler> delegate) : delegate_(std::move(delegate)) {}
-
-        virtual ~MessageHandler() = default;
-
-        void handle(const Message &message) {
-            std::visit(visitor{
-                    [this](const PingFrame &pingFrame) { delegate_->handlePing(pingFrame); },
-                    [this](const PongFrame &pongFrame) { delegate_->handlePong(pongFrame); },
-                    [this](const TextFrame &textFrame) { delegate_->handleText(textFrame); },
-                    [this](const BinaryFrame &binaryFrame) { delegate_->handleBinary(binaryFrame); },
-                    [this](const CloseFrame &closeFrame) { delegate_->handleClose(closeFrame); },
-                    [this](const UndefinedFrame &undefinedFrame) { delegate_->handleUndefined(undefinedFrame); },
-            }, message.value());
+        [[nodiscard]]
+        value_type take() && {
+            return std::move(value_);
         }
 
+        // The payload this message owns, to hand to a MessageHandler without copying it again.
+        [[nodiscard]]
+        MessageView view() const;
+
     private:
-        std::unique_ptr<FrameHandler> delegate_;
+        value_type value_;
     };
 
-    template<class A>
-    struct MessageParser final {
-        explicit MessageParser(std::unique_ptr<FrameParser<A>> delegate) : delegate_(std::move(delegate)) {}
+    using Message = BasicMessage<>;
 
-        virtual ~MessageParser() = default;
+    struct MessageView final {
+        explicit MessageView(std::variant<PingFrameView, PongFrameView, TextFrameView, BinaryFrameView, CloseFrameView, UndefinedFrame> value)
+                : value_(value) {}
 
-        A parse(const Message &message) {
-            return std::visit(visitor{
-                    [this](const PingFrame &pingFrame) { return delegate_->handlePing(pingFrame); },
-                    [this](const PongFrame &pongFrame) { return delegate_->handlePong(pongFrame); },
-                    [this](const TextFrame &textFrame) { return delegate_->handleText(textFrame); },
-                    [this](const BinaryFrame &binaryFrame) { return delegate_->handleBinary(binaryFrame); },
-                    [this](const CloseFrame &closeFrame) { return delegate_->handleClose(closeFrame); },
-                    [this](const UndefinedFrame &undefinedFrame) { return delegate_->handleUndefined(undefinedFrame); },
-            }, message.value());
+        bool operator==(const MessageView &rhs) const {
+            return value_ == rhs.value_;
         }
 
-    private:
-        std::unique_ptr<FrameParser<A>> delegate_;
-    };
-
-    struct WorkflowResult final {
-        explicit WorkflowResult(const std::monostate &unit) : value_(unit) {}
-
-        explicit WorkflowResult(const Failure &f) : value_(f) {}
-
-        explicit WorkflowResult(std::variant<Failure, std::monostate> value) : value_(std::move(value)) {}
+        bool operator!=(const MessageView &rhs) const {
+            return !(rhs == *this);
+        }
 
-        [[nodiscard]] const std::variant<Failure, std::monostate> &value() const {
+        [[nodiscard]]
+        const std::variant<PingFrameView, PongFrameView, TextFrameView, BinaryFrameView, CloseFrameView, UndefinedFrame> &value() const {
             return value_;
         }
 
-        [[nodiscard]] bool complete() const {
-            return std::holds_alternative<std::monostate>(value_);
+        [[nodiscard]]
+        Message materialize() const {
+            return std::visit(visitor{
+                    [](const UndefinedFrame &undefinedFrame) { return Message{undefinedFrame}; },
+                    [](const auto &frameView) {
+                        return Message{std::in_place_type<decltype(frameView.materialize())>, frameView.materialize()};
+                    },
+            }, value_);
         }
 
-        template<class R>
-        [[nodiscard]] R
-        match(const std::function<R(const Failure &a)> aFn, const std::function<R(const std::monostate &unit)> uFn) {
+        // Copies the payload into memory from allocator, such as a PayloadArena behind a polymorphic_allocator.
+        template<class Allocator>
+        [[nodiscard]] BasicMessage<Allocator> materialize(const Allocator &allocator) const {
             return std::visit(visitor{
-                    [&aFn](const Failure &a) { return aFn(a); },
-                    [&uFn](const std::monostate &u) { return uFn(u); }
+                    [](const UndefinedFrame &undefinedFrame) { return BasicMessage<Allocator>{undefinedFrame}; },
+                    [&allocator](const auto &frameView) {
+                        using Frame = decltype(frameView.materialize(allocator));
+                        return BasicMessage<Allocator>{std::in_place_type<Frame>, frameView.materialize(allocator)};
+                    },
             }, value_);
         }
 
     private:
-        std::variant<Failure, std::monostate> value_;
+        std::variant<PingFrameView, PongFrameView, TextFrameView, BinaryFrameView, CloseFrameView, UndefinedFrame> value_;
     };
 
-    struct Workflow final {
-        explicit Workflow(std::function<WorkflowResult()> runFn,
-                          std::function<void(const std::monostate &)> successFn,
-                          std::function<void(const Failure &)> recoveryFn)
-                : runFn_(std::move(runFn))
-                , successFn_(std::move(successFn))
-                , recoveryFn_(std::move(recoveryFn))
-        { }
+    template<class Allocator>
+    MessageView BasicMessage<Allocator>::view() const {
+        return std::visit(visitor{
+                [](const BasicPingFrame<Allocator> &pingFrame) { return MessageView{PingFrameView{pingFrame.value()}}; },
+                [](const BasicPongFrame<Allocator> &pongFrame) { return MessageView{PongFrameView{pongFrame.value()}}; },
+                [](const BasicTextFrame<Allocator> &textFrame) { return MessageView{TextFrameView{textFrame.value()}}; },
+                [](const BasicBinaryFrame<Allocator> &binaryFrame) {
+                    return MessageView{BinaryFrameView{std::as_bytes(std::span{binaryFrame.value()})}};
+                },
+                [](const BasicCloseFrame<Allocator> &closeFrame) { return MessageView{CloseFrameView{closeFrame.value()}}; },
+                [](const UndefinedFrame &undefinedFrame) { return MessageView{undefinedFrame}; },
+        }, value_);
+    }
 
-        void runUntilCancelled() {
-            WorkflowResult workflowResult = runFn_();
-            workflowResult.template match<void>(recoveryFn_, successFn_);
+    // Frames and messages whose payloads come from a std::pmr::memory_resource.
+    namespace pmr {
+        using PingFrame = BasicPingFrame<std::pmr::polymorphic_allocator<char>>;
+        using PongFrame = BasicPongFrame<std::pmr::polymorphic_allocator<char>>;
+        using TextFrame = BasicTextFrame<std::pmr::polymorphic_allocator<char>>;
+        using BinaryFrame = BasicBinaryFrame<std::pmr::polymorphic_allocator<char>>;
+        using CloseFrame = BasicCloseFrame<std::pmr::polymorphic_allocator<char>>;
+        using Message = BasicMessage<std::pmr::polymorphic_allocator<char>>;
+    }
 
-            while (!workflowResult.complete()) {
-                workflowResult = runFn_();
-                workflowResult.template match<void>(recoveryFn_, successFn_);
-            }
-        }
+    // Memory resource for one connection's payloads. Blocks come in power-of-two size classes from SMALLEST_BLOCK to
+    // largestBlock and are carved out of slabs from upstream; a freed block goes onto its class's free list and is
+    // handed out again, so a steady stream of frames stops allocating once the lists are warm. Larger requests go
+    // straight to upstream. Slabs are returned when the arena is destroyed. Not thread safe: keep it on the thread
+    // that receives, and use std::pmr::synchronized_pool_resource when messages are freed elsewhere.
+    struct PayloadArena final : std::pmr::memory_resource {
+        static constexpr std::size_t SMALLEST_BLOCK = 64;
+        static constexpr std::size_t SLAB_SIZE = 64 * 1024;
 
-    private:
-        const std::function<WorkflowResult()> runFn_;
-        const std::function<void(const std::monostate &)> successFn_;
-        const std::function<void(const Failure &)> recoveryFn_;
-    };
+        explicit PayloadArena(std::size_t largestBlock = 64 * 1024,
+                              std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+                : largestBlock_(std::bit_ceil(std::max(largestBlock, SMALLEST_BLOCK)))
+                , upstream_(upstream)
+                , freeLists_(sizeClass(largestBlock_) + 1, nullptr) {}
 
+        PayloadArena(const PayloadArena &) = delete;
 
-    struct ExecutionContext final {
-        ExecutionContext(std::string host, uint16_t port, std::string uri)
-                : host_(std::move(host)), port_(port), uri_(std::move(uri)) {}
+        PayloadArena &operator=(const PayloadArena &) = delete;
 
-        [[nodiscard]] const std::string &host() const {
-            return host_;
+        ~PayloadArena() override {
+            for (const auto &[slab, size] : slabs_) {
+                upstream_->deallocate(slab, size, alignof(std::max_align_t));
+            }
         }
 
-        [[nodiscard]] uint16_t port() const {
-            return port_;
+        // Requests served, from a free list or not.
+        [[nodiscard]] std::size_t allocations() const {
+            return allocations_;
         }
 
-        [[nodiscard]] const std::string &uri() const {
-            return uri_;
+        // Requests passed on to upstream, for slabs and for blocks too large to pool.
+        [[nodiscard]] std::size_t upstreamAllocations() const {
+            return upstreamAllocations_;
         }
 
     private:
-        std::string host_;
-        uint16_t port_;
-        std::string uri_;
-    };
+        struct FreeBlock {
+            FreeBlock *next;
+        };
+
+        static std::size_t sizeClass(std::size_t bytes) {
+            return static_cast<std::size_t>(std::countr_zero(std::bit_ceil(std::max(bytes, SMALLEST_BLOCK)))) -
+                   static_cast<std::size_t>(std::countr_zero(SMALLEST_BLOCK));
+        }
+
+        [[nodiscard]] bool pooled(std::size_t bytes, std::size_t alignment) const {
+            return bytes <= largestBlock_ && alignment <= alignof(std::max_align_t);
+        }
+
+        void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+            ++allocations_;
+            if (!pooled(bytes, alignment)) {
+                ++upstreamAllocations_;
+                return upstream_->allocate(bytes, alignment);
+            }
+            const std::size_t index = sizeClass(bytes);
+            if (freeLists_[index] == nullptr) {
+                refill(index);
+            }
+            FreeBlock *block = freeLists_[index];
+            freeLists_[index] = block->next;
+            return block;
+        }
+
+        void do_deallocate(void *pointer, std::size_t bytes, std::size_t alignment) override {
+            if (!pooled(bytes, alignment)) {
+                upstream_->deallocate(pointer, bytes, alignment);
+                return;
+            }
+            const std::size_t index = sizeClass(bytes);
+            freeLists_[index] = ::new(pointer) FreeBlock{freeLists_[index]};
+        }
+
+        [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+            return this == &other;
+        }
+
+        void refill(std::size_t index) {
+            const std::size_t blockSize = SMALLEST_BLOCK << index;
+            const std::size_t slabSize = std::max(SLAB_SIZE, blockSize);
+            auto *slab = static_cast<char *>(upstream_->allocate(slabSize, alignof(std::max_align_t)));
+            ++upstreamAllocations_;
+            slabs_.emplace_back(slab, slabSize);
+            for (std::size_t offset = slabSize; offset >= blockSize; offset -= blockSize) {
+                freeLists_[index] = ::new(slab + offset - blockSize) FreeBlock{freeLists_[index]};
+            }
+        }
+
+        const std::size_t largestBlock_;
+        std::pmr::memory_resource *upstream_;
+        std::vector<FreeBlock *> freeLists_;
+        std::vector<std::pair<void *, std::size_t>> slabs_;
+        std::size_t allocations_ = 0;
+        std::size_t upstreamAllocations_ = 0;
+    };
+
+    // What the metrics count frames and messages by: the op codes of RFC 6455, and everything else as Undefined.
+    enum class FrameKind : uint8_t {
+        Continuation,
+        Text,
+        Binary,
+        Close,
+        Ping,
+        Pong,
+        Undefined
+    };
+
+    constexpr std::size_t FRAME_KINDS = 7;
+
+    constexpr FrameKind frameKind(OpCode opCode) {
+        switch (opCode) {
+            case OpCode::Continuation:
+                return FrameKind::Continuation;
+            case OpCode::Text:
+                return FrameKind::Text;
+            case OpCode::Binary:
+                return FrameKind::Binary;
+            case OpCode::Close:
+                return FrameKind::Close;
+            case OpCode::Ping:
+                return FrameKind::Ping;
+            case OpCode::Pong:
+                return FrameKind::Pong;
+            default:
+                return FrameKind::Undefined;
+        }
+    }
+
+    constexpr std::string_view frameKindName(FrameKind frameKind) {
+        constexpr std::array<std::string_view, FRAME_KINDS> names{"continuation", "text", "binary", "close", "ping", "pong", "undefined"};
+        return names[static_cast<std::size_t>(frameKind)];
+    }
+
+    // Latencies in HDR style: every power of two nanoseconds is split into 16 linear sub-buckets, so any recorded
+    // value, and any percentile, is within 1/16 of the true one whatever its magnitude. Times from 2^40ns, about 18
+    // minutes, on all land in the last bucket.
+    struct LatencyHistogram final {
+        static constexpr unsigned SUB_BUCKET_BITS = 4;
+        static constexpr std::size_t SUB_BUCKETS = std::size_t{1} << SUB_BUCKET_BITS;
+        static constexpr unsigned MAX_EXPONENT = 40;
+        static constexpr std::size_t BUCKETS = SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+        static constexpr std::size_t bucket(uint64_t nanoseconds) {
+            if (nanoseconds < SUB_BUCKETS) {
+                return static_cast<std::size_t>(nanoseconds);
+            }
+            const auto exponent = static_cast<unsigned>(std::bit_width(nanoseconds) - 1);
+            if (exponent >= MAX_EXPONENT) {
+                return BUCKETS - 1;
+            }
+            const uint64_t subBucket = (nanoseconds >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+            return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + static_cast<std::size_t>(subBucket);
+        }
+
+        // The smallest and largest number of nanoseconds that fall in bucket.
+        static constexpr std::pair<uint64_t, uint64_t> bounds(std::size_t bucket) {
+            if (bucket < SUB_BUCKETS) {
+                return {bucket, bucket};
+            }
+            const std::size_t shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+            const uint64_t lowest = (SUB_BUCKETS + (bucket - SUB_BUCKETS) % SUB_BUCKETS) << shift;
+            return {lowest, lowest + (uint64_t{1} << shift) - 1};
+        }
+
+        void record(std::chrono::nanoseconds latency) {
+            const auto nanoseconds = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(latency.count(), 0));
+            ++buckets_[bucket(nanoseconds)];
+            ++count_;
+            sum_ += nanoseconds;
+            max_ = std::max(max_, nanoseconds);
+        }
+
+        void merge(const LatencyHistogram &other) {
+            for (std::size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+                buckets_[bucket] += other.buckets_[bucket];
+            }
+            count_ += other.count_;
+            sum_ += other.sum_;
+            max_ = std::max(max_, other.max_);
+        }
+
+        [[nodiscard]] uint64_t count() const {
+            return count_;
+        }
+
+        [[nodiscard]] std::chrono::nanoseconds sum() const {
+            return std::chrono::nanoseconds{static_cast<std::chrono::nanoseconds::rep>(sum_)};
+        }
+
+        [[nodiscard]] std::chrono::nanoseconds max() const {
+            return std::chrono::nanoseconds{static_cast<std::chrono::nanoseconds::rep>(max_)};
+        }
+
+        [[nodiscard]] std::chrono::nanoseconds mean() const {
+            return count_ == 0 ? std::chrono::nanoseconds{} : sum() / static_cast<std::chrono::nanoseconds::rep>(count_);
+        }
+
+        // The time that a fraction quantile of the samples were at or under, e.g. percentile(0.99). It is the top of
+        // the bucket the sample falls in, but never more than the largest time recorded.
+        [[nodiscard]] std::chrono::nanoseconds percentile(double quantile) const {
+            if (count_ == 0) {
+                return std::chrono::nanoseconds{};
+            }
+            const auto rank = static_cast<uint64_t>(std::clamp(quantile, 0.0, 1.0) * static_cast<double>(count_ - 1)) + 1;
+            uint64_t seen = 0;
+            for (std::size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+                seen += buckets_[bucket];
+                if (seen >= rank) {
+                    return std::chrono::nanoseconds{static_cast<std::chrono::nanoseconds::rep>(std::min(bounds(bucket).second, max_))};
+                }
+            }
+            return max();
+        }
+
+        [[nodiscard]] std::span<const uint64_t, BUCKETS> buckets() const {
+            return buckets_;
+        }
+
+    private:
+        friend struct Metrics;
+
+        std::array<uint64_t, BUCKETS> buckets_{};
+        uint64_t count_ = 0;
+        uint64_t sum_ = 0;
+        uint64_t max_ = 0;
+    };
+
+    // Totals across every thread that recorded into a Metrics, at the time of the snapshot. Frame counts are of the
+    // frames on the wire, message counts of the messages that reached a MessageHandler, both by FrameKind.
+    struct MetricsSnapshot final {
+        std::array<uint64_t, FRAME_KINDS> framesReceived{};
+        std::array<uint64_t, FRAME_KINDS> framesSent{};
+        std::array<uint64_t, FRAME_KINDS> messagesHandled{};
+        uint64_t bytesReceived = 0;
+        uint64_t bytesSent = 0;
+        uint64_t reconnects = 0;
+        // From the frame being read off the socket to its handler being called.
+        LatencyHistogram dispatchLatency;
+        // Time spent in the handlers.
+        LatencyHistogram handlerLatency;
+        // Time spent handing frames to the socket.
+        LatencyHistogram sendLatency;
+
+        [[nodiscard]] uint64_t framesReceivedOf(FrameKind frameKind) const {
+            return framesReceived[static_cast<std::size_t>(frameKind)];
+        }
+
+        [[nodiscard]] uint64_t framesSentOf(FrameKind frameKind) const {
+            return framesSent[static_cast<std::size_t>(frameKind)];
+        }
+
+        [[nodiscard]] uint64_t messagesHandledOf(FrameKind frameKind) const {
+            return messagesHandled[static_cast<std::size_t>(frameKind)];
+        }
+
+        // The Prometheus text exposition format, every metric name starting with prefix. Counters are by op code and
+        // latencies are summaries in seconds.
+        [[nodiscard]] std::string prometheus(std::string_view prefix = "simple_websocket") const {
+            std::string text;
+            const auto header = [&](std::string_view name, std::string_view type, std::string_view help) {
+                text.append("# HELP ").append(prefix).append(name).append(" ").append(help).append("\n");
+                text.append("# TYPE ").append(prefix).append(name).append(" ").append(type).append("\n");
+            };
+            const auto byKind = [&](std::string_view name, std::string_view help, const std::array<uint64_t, FRAME_KINDS> &counts) {
+                header(name, "counter", help);
+                for (std::size_t kind = 0; kind < FRAME_KINDS; ++kind) {
+                    text.append(prefix).append(name).append("{opcode=\"").append(frameKindName(static_cast<FrameKind>(kind)))
+                        .append("\"} ").append(std::to_string(counts[kind])).append("\n");
+                }
+            };
+            const auto counter = [&](std::string_view name, std::string_view help, uint64_t value) {
+                header(name, "counter", help);
+                text.append(prefix).append(name).append(" ").append(std::to_string(value)).append("\n");
+            };
+            const auto seconds = [&text](std::chrono::nanoseconds nanoseconds) {
+                std::array<char, 32> formatted{};
+                const auto result = std::to_chars(formatted.data(), formatted.data() + formatted.size(),
+                                                  std::chrono::duration<double>{nanoseconds}.count());
+                text.append(formatted.data(), result.ptr);
+            };
+            const auto summary = [&](std::string_view name, std::string_view help, const LatencyHistogram &histogram) {
+                header(name, "summary", help);
+                constexpr std::array<std::pair<std::string_view, double>, 4> quantiles{{{"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999}}};
+                for (const auto &[label, quantile] : quantiles) {
+                    text.append(prefix).append(name).append("{quantile=\"").append(label).append("\"} ");
+                    seconds(histogram.percentile(quantile));
+                    text.append("\n");
+                }
+                text.append(prefix).append(name).append("_sum ");
+                seconds(histogram.sum());
+                text.append("\n").append(prefix).append(name).append("_count ").append(std::to_string(histogram.count())).append("\n");
+            };
+
+            byKind("_frames_received_total", "WebSocket frames received.", framesReceived);
+            counter("_received_bytes_total", "WebSocket payload bytes received.", bytesReceived);
+            byKind("_frames_sent_total", "WebSocket frames sent.", framesSent);
+            counter("_sent_bytes_total", "WebSocket payload bytes sent.", bytesSent);
+            byKind("_messages_handled_total", "WebSocket messages passed to a handler.", messagesHandled);
+            counter("_reconnects_total", "WebSocket reconnect attempts after a failure.", reconnects);
+            summary("_dispatch_seconds", "Time from reading a frame to calling its handler.", dispatchLatency);
+            summary("_handler_seconds", "Time spent in message handlers.", handlerLatency);
+            summary("_send_seconds", "Time spent handing frames to the socket.", sendLatency);
+            return text;
+        }
+    };
+
+    // Counters and latency histograms recorded through a Metered policy. Each thread records into a shard of its own,
+    // so recording takes relaxed loads and stores, with no locked instructions or cache lines shared between threads,
+    // and snapshot() adds the shards up. Thread safe. When a thread exits, its shard is added to the totals of threads
+    // that have gone and handed to the next new thread, so the shards never outnumber the threads alive at once.
+    struct Metrics final {
+        using Clock = std::chrono::steady_clock;
+
+        Metrics() : id_(nextId()), registry_(std::make_shared<Registry>()) {}
+
+        Metrics(const Metrics &) = delete;
+
+        Metrics &operator=(const Metrics &) = delete;
+
+        // The Metrics a default constructed Metered policy records into.
+        [[nodiscard]] static Metrics &shared() {
+            static Metrics metrics;
+            return metrics;
+        }
+
+        void received(OpCode opCode, std::size_t bytes) {
+            Shard &shard = local();
+            add(shard.framesReceived[static_cast<std::size_t>(frameKind(opCode))], 1);
+            add(shard.bytesReceived, bytes);
+        }
+
+        void sent(OpCode opCode, std::size_t bytes) {
+            Shard &shard = local();
+            add(shard.framesSent[static_cast<std::size_t>(frameKind(opCode))], 1);
+            add(shard.bytesSent, bytes);
+        }
+
+        void handled(FrameKind frameKind, Clock::duration latency) {
+            Shard &shard = local();
+            add(shard.messagesHandled[static_cast<std::size_t>(frameKind)], 1);
+            shard.handlerLatency.record(latency);
+        }
+
+        void dispatched(Clock::duration latency) {
+            local().dispatchLatency.record(latency);
+        }
+
+        void sendTook(Clock::duration latency) {
+            local().sendLatency.record(latency);
+        }
+
+        void reconnected() {
+            add(local().reconnects, 1);
+        }
+
+        [[nodiscard]] MetricsSnapshot snapshot() const {
+            MetricsSnapshot snapshot;
+            std::lock_guard lock{registry_->mutex};
+            // Shards waiting for a new thread have been emptied into retired, so every shard can be added up.
+            registry_->retired.addTo(snapshot);
+            for (const Shard &shard : registry_->shards) {
+                shard.addTo(snapshot);
+            }
+            return snapshot;
+        }
+
+        // Shards allocated so far, which is the most threads that have recorded at the same time.
+        [[nodiscard]] std::size_t shards() const {
+            std::lock_guard lock{registry_->mutex};
+            return registry_->shards.size();
+        }
+
+    private:
+        // Only the owning thread writes a shard's counters, so a relaxed load and store is enough to add to them.
+        static void add(std::atomic<uint64_t> &counter, uint64_t amount) {
+            counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        static uint64_t load(const std::atomic<uint64_t> &counter) {
+            return counter.load(std::memory_order_relaxed);
+        }
+
+        struct Latencies {
+            void record(Clock::duration latency) {
+                const auto nanoseconds = static_cast<uint64_t>(
+                        std::max<std::chrono::nanoseconds::rep>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count(), 0));
+                add(buckets[LatencyHistogram::bucket(nanoseconds)], 1);
+                add(sum, nanoseconds);
+                if (nanoseconds > load(max)) {
+                    max.store(nanoseconds, std::memory_order_relaxed);
+                }
+            }
+
+            void addTo(LatencyHistogram &histogram) const {
+                for (std::size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket) {
+                    const uint64_t count = load(buckets[bucket]);
+                    histogram.buckets_[bucket] += count;
+                    histogram.count_ += count;
+                }
+                histogram.sum_ += load(sum);
+                histogram.max_ = std::max(histogram.max_, load(max));
+            }
+
+            // Moves everything recorded here into latencies, leaving this empty.
+            void moveTo(Latencies &latencies) {
+                for (std::size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket) {
+                    add(latencies.buckets[bucket], buckets[bucket].exchange(0, std::memory_order_relaxed));
+                }
+                add(latencies.sum, sum.exchange(0, std::memory_order_relaxed));
+                const uint64_t moved = max.exchange(0, std::memory_order_relaxed);
+                if (moved > load(latencies.max)) {
+                    latencies.max.store(moved, std::memory_order_relaxed);
+                }
+            }
+
+            std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKETS> buckets{};
+            std::atomic<uint64_t> sum = 0;
+            std::atomic<uint64_t> max = 0;
+        };
+
+        struct alignas(CACHE_LINE_SIZE) Shard {
+            std::array<std::atomic<uint64_t>, FRAME_KINDS> framesReceived{};
+            std::array<std::atomic<uint64_t>, FRAME_KINDS> framesSent{};
+            std::array<std::atomic<uint64_t>, FRAME_KINDS> messagesHandled{};
+            std::atomic<uint64_t> bytesReceived = 0;
+            std::atomic<uint64_t> bytesSent = 0;
+            std::atomic<uint64_t> reconnects = 0;
+            Latencies dispatchLatency;
+            Latencies handlerLatency;
+            Latencies sendLatency;
+
+            void addTo(MetricsSnapshot &snapshot) const {
+                for (std::size_t kind = 0; kind < FRAME_KINDS; ++kind) {
+                    snapshot.framesReceived[kind] += load(framesReceived[kind]);
+                    snapshot.framesSent[kind] += load(framesSent[kind]);
+                    snapshot.messagesHandled[kind] += load(messagesHandled[kind]);
+                }
+                snapshot.bytesReceived += load(bytesReceived);
+                snapshot.bytesSent += load(bytesSent);
+                snapshot.reconnects += load(reconnects);
+                dispatchLatency.addTo(snapshot.dispatchLatency);
+                handlerLatency.addTo(snapshot.handlerLatency);
+                sendLatency.addTo(snapshot.sendLatency);
+            }
+
+            // Only once the owning thread has stopped recording into this shard.
+            void moveTo(Shard &shard) {
+                const auto move = [](std::atomic<uint64_t> &from, std::atomic<uint64_t> &to) {
+                    add(to, from.exchange(0, std::memory_order_relaxed));
+                };
+                for (std::size_t kind = 0; kind < FRAME_KINDS; ++kind) {
+                    move(framesReceived[kind], shard.framesReceived[kind]);
+                    move(framesSent[kind], shard.framesSent[kind]);
+                    move(messagesHandled[kind], shard.messagesHandled[kind]);
+                }
+                move(bytesReceived, shard.bytesReceived);
+                move(bytesSent, shard.bytesSent);
+                move(reconnects, shard.reconnects);
+                dispatchLatency.moveTo(shard.dispatchLatency);
+                handlerLatency.moveTo(shard.handlerLatency);
+                sendLatency.moveTo(shard.sendLatency);
+            }
+        };
+
+        // The shards, shared with the threads recording into them so that a thread exiting after the Metrics is gone
+        // knows not to give its shard back.
+        struct Registry {
+            // Called as a thread that recorded into shard exits.
+            void retire(Shard &shard) {
+                std::lock_guard lock{mutex};
+                shard.moveTo(retired);
+                free.push_back(&shard);
+            }
+
+            std::mutex mutex;
+            std::deque<Shard> shards;
+            std::vector<Shard *> free;
+            // What threads that have exited recorded.
+            Shard retired;
+        };
+
+        // A thread's shards, one per Metrics it has recorded into, given back when the thread exits.
+        struct LocalShards {
+            struct Entry {
+                uint64_t id;
+                Shard *shard;
+                std::weak_ptr<Registry> registry;
+            };
+
+            ~LocalShards() {
+                for (const Entry &entry : entries) {
+                    if (const std::shared_ptr<Registry> registry = entry.registry.lock()) {
+                        registry->retire(*entry.shard);
+                    }
+                }
+            }
+
+            std::vector<Entry> entries;
+        };
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> next = 0;
+            return next++;
+        }
+
+        // Registries are told apart by id rather than address, so a thread never picks up the shard of a destroyed
+        // Metrics that another has replaced at the same address.
+        Shard &local() {
+            thread_local LocalShards local;
+            for (const LocalShards::Entry &entry : local.entries) {
+                if (entry.id == id_) {
+                    return *entry.shard;
+                }
+            }
+            // Forget the shards of Metrics that have been destroyed, so the search stays short.
+            std::erase_if(local.entries, [](const LocalShards::Entry &entry) { return entry.registry.expired(); });
+
+            std::lock_guard lock{registry_->mutex};
+            Shard *shard = nullptr;
+            if (registry_->free.empty()) {
+                shard = &registry_->shards.emplace_back();
+            } else {
+                shard = registry_->free.back();
+                registry_->free.pop_back();
+            }
+            local.entries.push_back({id_, shard, registry_});
+            return *shard;
+        }
+
+        const uint64_t id_;
+        const std::shared_ptr<Registry> registry_;
+    };
+
+    // A metrics policy is a small value held by the instrumented type. Hooks that need the time are only called when
+    // ENABLED, so a disabled policy never reads the clock.
+    template<class M>
+    concept MetricsPolicy = std::copyable<M> && requires(const M &metrics, OpCode opCode, FrameKind frameKind,
+                                                         std::size_t bytes, Metrics::Clock::duration latency) {
+        { M::ENABLED } -> std::convertible_to<bool>;
+        metrics.received(opCode, bytes);
+        metrics.sent(opCode, bytes);
+        metrics.handled(frameKind, latency);
+        metrics.dispatched(latency);
+        metrics.sendTook(latency);
+        metrics.reconnected();
+    };
+
+    // Records nothing. Every hook is empty and inlined away, so a type instrumented with it costs the same as one
+    // without instrumentation, and holds no state.
+    struct NoMetrics final {
+        static constexpr bool ENABLED = false;
+
+        void received(OpCode, std::size_t) const {}
+
+        void sent(OpCode, std::size_t) const {}
+
+        void handled(FrameKind, Metrics::Clock::duration) const {}
+
+        void dispatched(Metrics::Clock::duration) const {}
+
+        void sendTook(Metrics::Clock::duration) const {}
+
+        void reconnected() const {}
+    };
+
+    // Records into a Metrics, Metrics::shared() unless given one. The Metrics has to outlive the policy.
+    struct Metered final {
+        static constexpr bool ENABLED = true;
+
+        Metered() : metrics_(&Metrics::shared()) {}
+
+        explicit Metered(Metrics &metrics) : metrics_(&metrics) {}
+
+        void received(OpCode opCode, std::size_t bytes) const {
+            metrics_->received(opCode, bytes);
+        }
+
+        void sent(OpCode opCode, std::size_t bytes) const {
+            metrics_->sent(opCode, bytes);
+        }
+
+        void handled(FrameKind frameKind, Metrics::Clock::duration latency) const {
+            metrics_->handled(frameKind, latency);
+        }
+
+        void dispatched(Metrics::Clock::duration latency) const {
+            metrics_->dispatched(latency);
+        }
+
+        void sendTook(Metrics::Clock::duration latency) const {
+            metrics_->sendTook(latency);
+        }
+
+        void reconnected() const {
+            metrics_->reconnected();
+        }
+
+        [[nodiscard]] Metrics &metrics() const {
+            return *metrics_;
+        }
+
+    private:
+        Metrics *metrics_;
+    };
+
+    // Dispatches messages to a FrameHandler. With a Metered policy M it also counts the messages by kind and times the
+    // handler.
+    template<MetricsPolicy M = NoMetrics>
+    struct BasicMessageHandler final {
+        explicit BasicMessageHandler(std::unique_ptr<FrameHandler> delegate, M metrics = {})
+                : delegate_(std::move(delegate)), metrics_(std::move(metrics)) {}
+
+        virtual ~BasicMessageHandler() = default;
+
+        void handle(const Message &message) {
+            if constexpr (M::ENABLED) {
+                const Metrics::Clock::time_point started = Metrics::Clock::now();
+                dispatch(message);
+                metrics_.handled(messageKind(message.value().index()), Metrics::Clock::now() - started);
+            } else {
+                dispatch(message);
+            }
+        }
+
+        void handle(const MessageView &messageView) {
+            if constexpr (M::ENABLED) {
+                const Metrics::Clock::time_point started = Metrics::Clock::now();
+                dispatch(messageView);
+                metrics_.handled(messageKind(messageView.value().index()), Metrics::Clock::now() - started);
+            } else {
+                dispatch(messageView);
+            }
+        }
+
+        // As handle(messageView), also recording the time since received, when its last frame was read.
+        void handle(const MessageView &messageView, Metrics::Clock::time_point received) {
+            if constexpr (M::ENABLED) {
+                const Metrics::Clock::time_point started = Metrics::Clock::now();
+                metrics_.dispatched(started - received);
+                dispatch(messageView);
+                metrics_.handled(messageKind(messageView.value().index()), Metrics::Clock::now() - started);
+            } else {
+                dispatch(messageView);
+            }
+        }
+
+        [[nodiscard]] const M &metrics() const {
+            return metrics_;
+        }
+
+    private:
+        // Message and MessageView hold their frames in the same order.
+        static constexpr FrameKind messageKind(std::size_t index) {
+            constexpr std::array<FrameKind, 6> kinds{FrameKind::Ping, FrameKind::Pong, FrameKind::Text,
+                                                     FrameKind::Binary, FrameKind::Close, FrameKind::Undefined};
+            return kinds[index];
+        }
+
+        void dispatch(const Message &message) {
+            std::visit(visitor{
+                    [this](const PingFrame &pingFrame) { delegate_->handlePing(pingFrame); },
+                    [this](const PongFrame &pongFrame) { delegate_->handlePong(pongFrame); },
+                    [this](const TextFrame &textFrame) { delegate_->handleText(textFrame); },
+                    [this](const BinaryFrame &binaryFrame) { delegate_->handleBinary(binaryFrame); },
+                    [this](const CloseFrame &closeFrame) { delegate_->handleClose(closeFrame); },
+                    [this](const UndefinedFrame &undefinedFrame) { delegate_->handleUndefined(undefinedFrame); },
+            }, message.value());
+        }
+
+        void dispatch(const MessageView &messageView) {
+            std::visit(visitor{
+                    [this](const PingFrameView &pingFrameView) { delegate_->handlePingView(pingFrameView); },
+                    [this](const PongFrameView &pongFrameView) { delegate_->handlePongView(pongFrameView); },
+                    [this](const TextFrameView &textFrameView) { delegate_->handleTextView(textFrameView); },
+                    [this](const BinaryFrameView &binaryFrameView) { delegate_->handleBinaryView(binaryFrameView); },
+                    [this](const CloseFrameView &closeFrameView) { delegate_->handleCloseView(closeFrameView); },
+                    [this](const UndefinedFrame &undefinedFrame) { delegate_->handleUndefined(undefinedFrame); },
+            }, messageView.value());
+        }
+
+        std::unique_ptr<FrameHandler> delegate_;
+        [[no_unique_address]] M metrics_;
+    };
+
+    using MessageHandler = BasicMessageHandler<>;
+
+    template<class A>
+    struct MessageParser final {
+        explicit MessageParser(std::unique_ptr<FrameParser<A>> delegate) : delegate_(std::move(delegate)) {}
+
+        virtual ~MessageParser() = default;
+
+        A parse(const Message &message) {
+            return std::visit(visitor{
+                    [this](const PingFrame &pingFrame) { return delegate_->handlePing(pingFrame); },
+                    [this](const PongFrame &pongFrame) { return delegate_->handlePong(pongFrame); },
+                    [this](const TextFrame &textFrame) { return delegate_->handleText(textFrame); },
+                    [this](const BinaryFrame &binaryFrame) { return delegate_->handleBinary(binaryFrame); },
+                    [this](const CloseFrame &closeFrame) { return delegate_->handleClose(closeFrame); },
+                    [this](const UndefinedFrame &undefinedFrame) { return delegate_->handleUndefined(undefinedFrame); },
+            }, message.value());
+        }
+
+        A parse(const MessageView &messageView) {
+            return std::visit(visitor{
+                    [this](const PingFrameView &pingFrameView) { return delegate_->handlePingView(pingFrameView); },
+                    [this](const PongFrameView &pongFrameView) { return delegate_->handlePongView(pongFrameView); },
+                    [this](const TextFrameView &textFrameView) { return delegate_->handleTextView(textFrameView); },
+                    [this](const BinaryFrameView &binaryFrameView) { return delegate_->handleBinaryView(binaryFrameView); },
+                    [this](const CloseFrameView &closeFrameView) { return delegate_->handleCloseView(closeFrameView); },
+                    [this](const UndefinedFrame &undefinedFrame) { return delegate_->handleUndefined(undefinedFrame); },
+            }, messageView.value());
+        }
+
+    private:
+        std::unique_ptr<FrameParser<A>> delegate_;
+    };
+
+    template<class H>
+    concept StaticFrameHandler = requires(H &handler,
+                                          const PingFrame &pingFrame,
+                                          const PongFrame &pongFrame,
+                                          const TextFrame &textFrame,
+                                          const BinaryFrame &binaryFrame,
+                                          const CloseFrame &closeFrame,
+                                          const UndefinedFrame &undefinedFrame) {
+        handler.handlePing(pingFrame);
+        handler.handlePong(pongFrame);
+        handler.handleText(textFrame);
+        handler.handleBinary(binaryFrame);
+        handler.handleClose(closeFrame);
+        handler.handleUndefined(undefinedFrame);
+    };
+
+    template<class P, class A>
+    concept StaticFrameParser = requires(P &parser,
+                                         const PingFrame &pingFrame,
+                                         const PongFrame &pongFrame,
+                                         const TextFrame &textFrame,
+                                         const BinaryFrame &binaryFrame,
+                                         const CloseFrame &closeFrame,
+                                         const UndefinedFrame &undefinedFrame) {
+        { parser.handlePing(pingFrame) } -> std::convertible_to<A>;
+        { parser.handlePong(pongFrame) } -> std::convertible_to<A>;
+        { parser.handleText(textFrame) } -> std::convertible_to<A>;
+        { parser.handleBinary(binaryFrame) } -> std::convertible_to<A>;
+        { parser.handleClose(closeFrame) } -> std::convertible_to<A>;
+        { parser.handleUndefined(undefinedFrame) } -> std::convertible_to<A>;
+    };
+
+    // A callable, such as a visitor of lambdas, that accepts every owning frame type and returns something
+    // convertible to R. View frames are passed as views when the callable accepts them and materialized otherwise.
+    template<class V, class R = void>
+    concept FrameVisitor = std::is_invocable_r_v<R, V &, const PingFrame &> &&
+                           std::is_invocable_r_v<R, V &, const PongFrame &> &&
+                           std::is_invocable_r_v<R, V &, const TextFrame &> &&
+                           std::is_invocable_r_v<R, V &, const BinaryFrame &> &&
+                           std::is_invocable_r_v<R, V &, const CloseFrame &> &&
+                           std::is_invocable_r_v<R, V &, const UndefinedFrame &>;
+
+    namespace Dispatch {
+        template<class H> decltype(auto) frame(H &handler, const PingFrame &pingFrame) { return handler.handlePing(pingFrame); }
+
+        template<class H> decltype(auto) frame(H &handler, const PongFrame &pongFrame) { return handler.handlePong(pongFrame); }
+
+        template<class H> decltype(auto) frame(H &handler, const TextFrame &textFrame) { return handler.handleText(textFrame); }
+
+        template<class H> decltype(auto) frame(H &handler, const BinaryFrame &binaryFrame) { return handler.handleBinary(binaryFrame); }
+
+        template<class H> decltype(auto) frame(H &handler, const CloseFrame &closeFrame) { return handler.handleClose(closeFrame); }
+
+        template<class H> decltype(auto) frame(H &handler, const UndefinedFrame &undefinedFrame) { return handler.handleUndefined(undefinedFrame); }
+
+        template<class H> decltype(auto) frame(H &handler, const PingFrameView &pingFrameView) {
+            if constexpr (requires { handler.handlePingView(pingFrameView); }) {
+                return handler.handlePingView(pingFrameView);
+            } else {
+                return handler.handlePing(pingFrameView.materialize());
+            }
+        }
+
+        template<class H> decltype(auto) frame(H &handler, const PongFrameView &pongFrameView) {
+            if constexpr (requires { handler.handlePongView(pongFrameView); }) {
+                return handler.handlePongView(pongFrameView);
+            } else {
+                return handler.handlePong(pongFrameView.materialize());
+            }
+        }
+
+        template<class H> decltype(auto) frame(H &handler, const TextFrameView &textFrameView) {
+            if constexpr (requires { handler.handleTextView(textFrameView); }) {
+                return handler.handleTextView(textFrameView);
+            } else {
+                return handler.handleText(textFrameView.materialize());
+            }
+        }
+
+        template<class H> decltype(auto) frame(H &handler, const BinaryFrameView &binaryFrameView) {
+            if constexpr (requires { handler.handleBinaryView(binaryFrameView); }) {
+                return handler.handleBinaryView(binaryFrameView);
+            } else {
+                return handler.handleBinary(binaryFrameView.materialize());
+            }
+        }
+
+        template<class H> decltype(auto) frame(H &handler, const CloseFrameView &closeFrameView) {
+            if constexpr (requires { handler.handleCloseView(closeFrameView); }) {
+                return handler.handleCloseView(closeFrameView);
+            } else {
+                return handler.handleClose(closeFrameView.materialize());
+            }
+        }
+
+        template<class V, class F> decltype(auto) visit(V &visitor, const F &frame) {
+            if constexpr (std::is_invocable_v<V &, const F &>) {
+                return visitor(frame);
+            } else {
+                return visitor(frame.materialize());
+            }
+        }
+    }
+
+    // Compile-time counterpart of MessageHandler. The delegate is held by value and called without virtual dispatch,
+    // so it can be inlined into the receive loop. H either has the FrameHandler member functions, without needing to
+    // derive from it, or is a FrameVisitor.
+    template<class H> requires StaticFrameHandler<H> || FrameVisitor<H>
+    struct StaticMessageHandler final {
+        explicit StaticMessageHandler(H delegate) : delegate_(std::move(delegate)) {}
+
+        void handle(const Message &message) {
+            std::visit([this](const auto &frame) { dispatch(frame); }, message.value());
+        }
+
+        void handle(const MessageView &messageView) {
+            std::visit([this](const auto &frameView) { dispatch(frameView); }, messageView.value());
+        }
+
+        [[nodiscard]] H &delegate() {
+            return delegate_;
+        }
+
+    private:
+        template<class F>
+        void dispatch(const F &frame) {
+            if constexpr (StaticFrameHandler<H>) {
+                Dispatch::frame(delegate_, frame);
+            } else {
+                Dispatch::visit(delegate_, frame);
+            }
+        }
+
+        H delegate_;
+    };
+
+    template<class H> StaticMessageHandler(H) -> StaticMessageHandler<H>;
+
+    // Compile-time counterpart of MessageParser<A>. P either has the FrameParser<A> member functions or is a
+    // FrameVisitor returning A.
+    template<class A, class P> requires StaticFrameParser<P, A> || FrameVisitor<P, A>
+    struct StaticMessageParser final {
+        explicit StaticMessageParser(P delegate) : delegate_(std::move(delegate)) {}
+
+        A parse(const Message &message) {
+            return std::visit([this](const auto &frame) { return dispatch(frame); }, message.value());
+        }
+
+        A parse(const MessageView &messageView) {
+            return std::visit([this](const auto &frameView) { return dispatch(frameView); }, messageView.value());
+        }
+
+        [[nodiscard]] P &delegate() {
+            return delegate_;
+        }
+
+    private:
+        template<class F>
+        A dispatch(const F &frame) {
+            if constexpr (StaticFrameParser<P, A>) {
+                return Dispatch::frame(delegate_, frame);
+            } else {
+                return Dispatch::visit(delegate_, frame);
+            }
+        }
+
+        P delegate_;
+    };
+
+    template<class A, class P>
+    StaticMessageParser<A, P> staticMessageParser(P delegate) {
+        return StaticMessageParser<A, P>{std::move(delegate)};
+    }
+
+    inline MessageView frameView(OpCode opCode, std::string_view payload) {
+        switch (opCode) {
+            case OpCode::Ping:
+                return MessageView{PingFrameView{payload}};
+            case OpCode::Pong:
+                return MessageView{PongFrameView{payload}};
+            case OpCode::Text:
+                return MessageView{TextFrameView{payload}};
+            case OpCode::Binary:
+                return MessageView{BinaryFrameView{std::as_bytes(std::span{payload})}};
+            case OpCode::Close:
+                return MessageView{CloseFrameView{payload}};
+            default:
+                return MessageView{UndefinedFrame{}};
+        }
+    }
+
+    namespace Json {
+        // Finds the string value of key in the top-level object of json, without parsing anything after it, or the
+        // values before it beyond skipping them. Returns the value as it is written, escapes included. Gives nullopt
+        // if json is not an object, has no such key, or its value is not a string. Not a validator: what it skips is
+        // only scanned for strings and brackets.
+        inline std::optional<std::string_view> findString(std::string_view json, std::string_view key) {
+            std::size_t position = 0;
+            auto skipSpace = [&] {
+                while (position < json.size() && (json[position] == ' ' || json[position] == '\t' || json[position] == '\n' || json[position] == '\r')) {
+                    ++position;
+                }
+            };
+            // From the opening quote, moves past the closing one and returns what was between them.
+            auto string = [&]() -> std::optional<std::string_view> {
+                const std::size_t begin = ++position;
+                while (position < json.size() && json[position] != '"') {
+                    position += json[position] == '\\' ? 2 : 1;
+                }
+                if (position >= json.size()) {
+                    return std::nullopt;
+                }
+                return json.substr(begin, position++ - begin);
+            };
+
+            skipSpace();
+            if (position >= json.size() || json[position] != '{') {
+                return std::nullopt;
+            }
+            ++position;
+            while (true) {
+                skipSpace();
+                if (position >= json.size() || json[position] != '"') {
+                    return std::nullopt;
+                }
+                const std::optional<std::string_view> name = string();
+                skipSpace();
+                if (!name || position >= json.size() || json[position] != ':') {
+                    return std::nullopt;
+                }
+                ++position;
+                skipSpace();
+                if (position >= json.size()) {
+                    return std::nullopt;
+                }
+                if (*name == key) {
+                    return json[position] == '"' ? string() : std::nullopt;
+                }
+
+                // Skips the value, and any objects and arrays nested in it.
+                std::size_t depth = 0;
+                while (position < json.size()) {
+                    const char c = json[position];
+                    if (c == '"') {
+                        if (!string()) {
+                            return std::nullopt;
+                        }
+                        continue;
+                    }
+                    if (c == '{' || c == '[') {
+                        ++depth;
+                    } else if (c == '}' || c == ']') {
+                        if (depth == 0) {
+                            return std::nullopt;
+                        }
+                        --depth;
+                    } else if (c == ',' && depth == 0) {
+                        break;
+                    }
+                    ++position;
+                }
+                if (position >= json.size()) {
+                    return std::nullopt;
+                }
+                ++position;
+            }
+        }
+    }
+
+    // What a DecodingFrameParser turns messages into A with. Decoders get the payload as a view of the frame, so
+    // nothing is copied before them.
+    template<class A>
+    struct Decoders final {
+        // Text messages, e.g. a Router or a JsonDecoder.
+        std::function<A(std::string_view)> text = nullptr;
+        // Binary messages, with the application's own schema.
+        std::function<A(std::span<const std::byte>)> binary = nullptr;
+        // Everything else: pings, pongs, close frames, undefined frames, and text or binary messages without a decoder.
+        // Without it these give A{}, or a FailureError if A has no default.
+        std::function<A(const MessageView &)> other = nullptr;
+    };
+
+    // A FrameParser<A> for MessageParser<A> that hands the payloads of text and binary messages to Decoders<A>.
+    template<class A>
+    struct DecodingFrameParser final : FrameParser<A> {
+        explicit DecodingFrameParser(Decoders<A> decoders) : decoders_(std::move(decoders)) {}
+
+        A handlePing(const PingFrame &pingFrame) override {
+            return handlePingView(PingFrameView{pingFrame.value()});
+        }
+
+        A handlePong(const PongFrame &pongFrame) override {
+            return handlePongView(PongFrameView{pongFrame.value()});
+        }
+
+        A handleText(const TextFrame &textFrame) override {
+            return handleTextView(TextFrameView{textFrame.value()});
+        }
+
+        A handleBinary(const BinaryFrame &binaryFrame) override {
+            return handleBinaryView(BinaryFrameView{std::as_bytes(std::span{binaryFrame.value()})});
+        }
+
+        A handleClose(const CloseFrame &closeFrame) override {
+            return handleCloseView(CloseFrameView{closeFrame.value()});
+        }
+
+        A handleUndefined(const UndefinedFrame &undefinedFrame) override {
+            return other(MessageView{undefinedFrame});
+        }
+
+        A handlePingView(const PingFrameView &pingFrameView) override {
+            return other(MessageView{pingFrameView});
+        }
+
+        A handlePongView(const PongFrameView &pongFrameView) override {
+            return other(MessageView{pongFrameView});
+        }
+
+        A handleTextView(const TextFrameView &textFrameView) override {
+            if (decoders_.text) {
+                return decoders_.text(textFrameView.value());
+            }
+            return other(MessageView{textFrameView});
+        }
+
+        A handleBinaryView(const BinaryFrameView &binaryFrameView) override {
+            if (decoders_.binary) {
+                return decoders_.binary(binaryFrameView.value());
+            }
+            return other(MessageView{binaryFrameView});
+        }
+
+        A handleCloseView(const CloseFrameView &closeFrameView) override {
+            return other(MessageView{closeFrameView});
+        }
+
+    private:
+        A other(const MessageView &messageView) {
+            if (decoders_.other) {
+                return decoders_.other(messageView);
+            }
+            if constexpr (std::default_initializable<A>) {
+                return A{};
+            } else {
+                throw FailureError{Failure{"WebSocket message has no decoder"}};
+            }
+        }
+
+        Decoders<A> decoders_;
+    };
+
+    template<class A>
+    MessageParser<A> decodingMessageParser(Decoders<A> decoders) {
+        return MessageParser<A>{std::make_unique<DecodingFrameParser<A>>(std::move(decoders))};
+    }
+
+    // Picks the decoder for a text message by the string value of one top-level field, e.g. {"type":"trade",...}. Only
+    // as much of the message as precedes that field's value is scanned to pick the route, so message types without one
+    // are never parsed. Use it as Decoders<A>::text.
+    template<class A>
+    struct Router final {
+        explicit Router(std::string field = "type") : field_(std::move(field)) {}
+
+        Router &route(std::string type, std::function<A(std::string_view)> decoder) {
+            routes_.insert_or_assign(std::move(type), std::move(decoder));
+            return *this;
+        }
+
+        // For messages of a type without a route, or with no such field. Without it they give A{}, or a FailureError if
+        // A has no default.
+        Router &otherwise(std::function<A(std::string_view)> decoder) {
+            otherwise_ = std::move(decoder);
+            return *this;
+        }
+
+        A operator()(std::string_view text) const {
+            if (std::optional<std::string_view> type = Json::findString(text, field_)) {
+                if (auto route = routes_.find(*type); route != routes_.end()) {
+                    return route->second(text);
+                }
+            }
+            if (otherwise_) {
+                return otherwise_(text);
+            }
+            if constexpr (std::default_initializable<A>) {
+                return A{};
+            } else {
+                throw FailureError{Failure{"WebSocket message has no route"}};
+            }
+        }
+
+        [[nodiscard]] const std::string &field() const {
+            return field_;
+        }
+
+    private:
+        std::string field_;
+        // Looked up by std::string_view without building a std::string.
+        std::map<std::string, std::function<A(std::string_view)>, std::less<>> routes_;
+        std::function<A(std::string_view)> otherwise_ = nullptr;
+    };
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_SIMDJSON
+    // Decodes text messages with simdjson's On-Demand API, which only parses the fields the decode function asks for.
+    // simdjson reads up to SIMDJSON_PADDING bytes past the end of its input. The message is parsed where it is when
+    // those bytes are on the same memory page as its last byte, as in a connection's read buffer, and is otherwise
+    // copied into a padded buffer the decoder reuses. Under AddressSanitizer it is always copied. Not thread safe: use
+    // one per parser.
+    template<class A>
+    struct JsonDecoder final {
+        using Decode = std::function<A(simdjson::ondemand::document &)>;
+
+        explicit JsonDecoder(Decode decode) : state_(std::make_shared<State>(std::move(decode))) {}
+
+        // Copyable, so that it fits in a std::function, with the copies sharing one parser.
+        A operator()(std::string_view text) const {
+            State &state = *state_;
+            simdjson::padded_string_view input;
+            if (padded(text)) {
+                input = simdjson::padded_string_view{text.data(), text.size(), text.size() + simdjson::SIMDJSON_PADDING};
+            } else {
+                if (state.scratch.size() < text.size() + simdjson::SIMDJSON_PADDING) {
+                    state.scratch.resize(text.size() + simdjson::SIMDJSON_PADDING);
+                }
+                std::memcpy(state.scratch.data(), text.data(), text.size());
+                input = simdjson::padded_string_view{state.scratch.data(), text.size(), state.scratch.size()};
+            }
+
+            simdjson::ondemand::document document;
+            if (simdjson::error_code error = state.parser.iterate(input).get(document)) {
+                throw FailureError{Failure{std::string{"WebSocket message is not JSON: "} + simdjson::error_message(error), CloseCode::InvalidPayload}};
+            }
+            try {
+                return state.decode(document);
+            } catch (const simdjson::simdjson_error &e) {
+                throw FailureError{Failure{std::string{"WebSocket message does not match its schema: "} + e.what(), CloseCode::InvalidPayload}};
+            }
+        }
+
+    private:
+        struct State {
+            explicit State(Decode decode) : decode(std::move(decode)) {}
+
+            Decode decode;
+            simdjson::ondemand::parser parser;
+            std::vector<char> scratch;
+        };
+
+        static bool padded(std::string_view text) {
+#if defined(__SANITIZE_ADDRESS__)
+            return false;
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+            return false;
+#endif
+#endif
+            if (text.empty()) {
+                return false;
+            }
+            static const auto pageSize = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+            const auto last = reinterpret_cast<uintptr_t>(text.data()) + text.size() - 1;
+            return last % pageSize + 1 + simdjson::SIMDJSON_PADDING <= pageSize;
+        }
+
+        std::shared_ptr<State> state_;
+    };
+#endif
+
+    // An owning message in SIZE bytes: an op code tag, a length, and the payload inline when it fits in the rest,
+    // otherwise on the heap. Pings, pongs, close frames and short text stay off the heap entirely, and a queue of them
+    // is a flat array. Undefined frames are tagged UNDEFINED, which no frame on the wire can carry. The length is 32
+    // bits, so a payload over MAX_SIZE throws std::length_error.
+    template<std::size_t SIZE>
+    struct BasicCompactMessage final {
+        static_assert(SIZE >= 16 && SIZE % alignof(char *) == 0, "SIZE must leave room for a pointer after the header");
+
+        static constexpr std::size_t INLINE_CAPACITY = SIZE - 8;
+
+        static constexpr std::size_t MAX_SIZE = std::numeric_limits<uint32_t>::max();
+
+        static constexpr OpCode UNDEFINED = static_cast<OpCode>(0xFF);
+
+        BasicCompactMessage(OpCode opCode, std::string_view payload)
+                : opCode_(opCode), size_(checkedSize(payload.size())) {
+            char *data = inlined() ? inline_ : (heap_ = new char[size_]);
+            if (size_ != 0) {
+                std::memcpy(data, payload.data(), size_);
+            }
+        }
+
+        explicit BasicCompactMessage(const MessageView &messageView)
+                : BasicCompactMessage(opCode(messageView), payload(messageView)) {}
+
+        template<class Allocator>
+        explicit BasicCompactMessage(const BasicMessage<Allocator> &message) : BasicCompactMessage(message.view()) {}
+
+        BasicCompactMessage(const BasicCompactMessage &other) : BasicCompactMessage(other.opCode_, other.payload()) {}
+
+        BasicCompactMessage(BasicCompactMessage &&other) noexcept : opCode_(other.opCode_), size_(other.size_) {
+            if (inlined()) {
+                std::memcpy(inline_, other.inline_, size_);
+            } else {
+                heap_ = std::exchange(other.heap_, nullptr);
+                other.size_ = 0;
+            }
+        }
+
+        BasicCompactMessage &operator=(const BasicCompactMessage &other) {
+            if (this != &other) {
+                *this = BasicCompactMessage{other};
+            }
+            return *this;
+        }
+
+        BasicCompactMessage &operator=(BasicCompactMessage &&other) noexcept {
+            if (this != &other) {
+                this->~BasicCompactMessage();
+                ::new(this) BasicCompactMessage{std::move(other)};
+            }
+            return *this;
+        }
+
+        ~BasicCompactMessage() {
+            if (!inlined()) {
+                delete[] heap_;
+            }
+        }
+
+        bool operator==(const BasicCompactMessage &rhs) const {
+            return opCode_ == rhs.opCode_ && payload() == rhs.payload();
+        }
+
+        bool operator!=(const BasicCompactMessage &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]] OpCode opCode() const {
+            return opCode_;
+        }
+
+        [[nodiscard]] std::string_view payload() const {
+            return {inlined() ? inline_ : heap_, size_};
+        }
+
+        [[nodiscard]] bool inlined() const {
+            return size_ <= INLINE_CAPACITY;
+        }
+
+        [[nodiscard]] MessageView view() const {
+            return frameView(opCode_, payload());
+        }
+
+        [[nodiscard]] Message materialize() const {
+            return view().materialize();
+        }
+
+    private:
+        static OpCode opCode(const MessageView &messageView) {
+            return std::visit(visitor{
+                    [](const PingFrameView &) { return OpCode::Ping; },
+                    [](const PongFrameView &) { return OpCode::Pong; },
+                    [](const TextFrameView &) { return OpCode::Text; },
+                    [](const BinaryFrameView &) { return OpCode::Binary; },
+                    [](const CloseFrameView &) { return OpCode::Close; },
+                    [](const UndefinedFrame &) { return UNDEFINED; },
+            }, messageView.value());
+        }
+
+        static uint32_t checkedSize(std::size_t size) {
+            if (size > MAX_SIZE) {
+                throw std::length_error("SimpleWebSocket::CompactMessage: payload is over 4 GiB");
+            }
+            return static_cast<uint32_t>(size);
+        }
+
+        static std::string_view payload(const MessageView &messageView) {
+            return std::visit(visitor{
+                    [](const BinaryFrameView &binaryFrameView) {
+                        return std::string_view{reinterpret_cast<const char *>(binaryFrameView.value().data()), binaryFrameView.value().size()};
+                    },
+                    [](const UndefinedFrame &) { return std::string_view{}; },
+                    [](const auto &frameView) { return frameView.value(); },
+            }, messageView.value());
+        }
+
+        OpCode opCode_;
+        uint32_t size_;
+        union {
+            char inline_[INLINE_CAPACITY];
+            char *heap_;
+        };
+    };
+
+    // Half a cache line, with 24 bytes inline.
+    using CompactMessage = BasicCompactMessage<32>;
+
+    struct FragmentView final {
+        FragmentView(OpCode opCode, std::string_view value, bool first, bool last)
+                : opCode_(opCode), value_(value), first_(first), last_(last) {}
+
+        bool operator==(const FragmentView &rhs) const {
+            return opCode_ == rhs.opCode_ && value_ == rhs.value_ && first_ == rhs.first_ && last_ == rhs.last_;
+        }
+
+        bool operator!=(const FragmentView &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]] OpCode opCode() const {
+            return opCode_;
+        }
+
+        [[nodiscard]] std::string_view value() const {
+            return value_;
+        }
+
+        [[nodiscard]] bool first() const {
+            return first_;
+        }
+
+        [[nodiscard]] bool last() const {
+            return last_;
+        }
+
+    private:
+        OpCode opCode_;
+        std::string_view value_;
+        bool first_;
+        bool last_;
+    };
+
+    struct FragmentHandler {
+        virtual ~FragmentHandler() = default;
+
+        virtual void handleFragment(const FragmentView &fragmentView) = 0;
+    };
+
+    // UTF-8 validation. A kernel returns the length of a prefix of its input that it has checked to be valid UTF-8
+    // ending on a code point boundary, and the validator steps through whatever follows byte by byte. The portable
+    // kernels only skip runs of ASCII. The SSSE3 and AVX2 kernels check multi-byte sequences a vector at a time with
+    // the lookup algorithm of Keiser and Lemire, and leave the validator only the bytes around an error or a code
+    // point cut off at the end of the input.
+    namespace Utf8 {
+        using Kernel = std::size_t (*)(const char *in, std::size_t size);
+
+        inline std::size_t asciiWord(const char *in, std::size_t size) {
+            std::size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                uint64_t value;
+                std::memcpy(&value, in + i, sizeof(value));
+                if ((value & 0x8080808080808080ULL) != 0) {
+                    break;
+                }
+            }
+            while (i < size && static_cast<uint8_t>(in[i]) < 0x80) {
+                ++i;
+            }
+            return i;
+        }
+
+        // Given that in[0, end) passed the lookup checks, moves end back before a lead byte in the last three
+        // positions, whose continuation bytes would have been checked against the next vector.
+        inline std::size_t lastBoundary(const char *in, std::size_t end) {
+            std::size_t start = end;
+            while (start > 0 && end - start < 3 && (static_cast<uint8_t>(in[start - 1]) & 0xC0) == 0x80) {
+                --start;
+            }
+            if (start > 0 && static_cast<uint8_t>(in[start - 1]) >= 0xC0) {
+                return start - 1;
+            }
+            return end;
+        }
+
+#ifdef SIMPLE_WEBSOCKET_X86_KERNELS
+        __attribute__((target("sse2")))
+        inline std::size_t asciiSse2(const char *in, std::size_t size) {
+            std::size_t i = 0;
+            for (; i + 16 <= size; i += 16) {
+                const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+                if (_mm_movemask_epi8(value) != 0) {
+                    break;
+                }
+            }
+            return i + asciiWord(in + i, size - i);
+        }
+
+        // Each byte is classified by the high and low nibble of the byte before it and its own high nibble. A bit
+        // that survives all three lookups is an error, except TWO_CONTS, which marks a continuation byte following
+        // another one and is checked against where the lead bytes two and three back expect them.
+        namespace Lookup {
+            constexpr uint8_t TOO_SHORT = 1 << 0;
+            constexpr uint8_t TOO_LONG = 1 << 1;
+            constexpr uint8_t OVERLONG_3 = 1 << 2;
+            constexpr uint8_t TOO_LARGE = 1 << 3;
+            constexpr uint8_t SURROGATE = 1 << 4;
+            constexpr uint8_t OVERLONG_2 = 1 << 5;
+            constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+            constexpr uint8_t OVERLONG_4 = 1 << 6;
+            constexpr uint8_t TWO_CONTS = 1 << 7;
+            constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+            alignas(16) inline constexpr uint8_t PREVIOUS_HIGH[16] = {
+                TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+                TOO_SHORT | OVERLONG_2,
+                TOO_SHORT,
+                TOO_SHORT | OVERLONG_3 | SURROGATE,
+                TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+            };
+
+            alignas(16) inline constexpr uint8_t PREVIOUS_LOW[16] = {
+                CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+                CARRY | OVERLONG_2,
+                CARRY,
+                CARRY,
+                CARRY | TOO_LARGE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000
+            };
+
+            alignas(16) inline constexpr uint8_t CURRENT_HIGH[16] = {
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+            };
+
+            // Subtracted with saturation from the last bytes of a vector, leaves a non-zero byte when a sequence
+            // started there runs past its end.
+            alignas(32) inline constexpr uint8_t INCOMPLETE[32] = {
+                255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+                255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+            };
+        }
+
+        __attribute__((target("ssse3")))
+        inline __m128i lookupErrors(__m128i input, __m128i previous) {
+            const __m128i nibble = _mm_set1_epi8(0x0F);
+            const __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+            const __m128i previousHigh = _mm_shuffle_epi8(
+                    _mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::PREVIOUS_HIGH)),
+                    _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+            const __m128i previousLow = _mm_shuffle_epi8(
+                    _mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::PREVIOUS_LOW)),
+                    _mm_and_si128(prev1, nibble));
+            const __m128i currentHigh = _mm_shuffle_epi8(
+                    _mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::CURRENT_HIGH)),
+                    _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+            const __m128i special = _mm_and_si128(_mm_and_si128(previousHigh, previousLow), currentHigh);
+
+            const __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 14), _mm_set1_epi8(0xE0 - 0x80));
+            const __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 13), _mm_set1_epi8(0xF0 - 0x80));
+            const __m128i continuations = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(-0x80));
+            return _mm_xor_si128(continuations, special);
+        }
+
+        __attribute__((target("ssse3")))
+        inline std::size_t lookupSsse3(const char *in, std::size_t size) {
+            const __m128i incompleteBound = _mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::INCOMPLETE + 16));
+            __m128i previous = _mm_setzero_si128();
+            __m128i incomplete = _mm_setzero_si128();
+            alignas(16) char tail[16] = {};
+            std::size_t i = 0;
+            while (i < size) {
+                const bool last = i + 16 > size;
+                if (last) {
+                    std::memcpy(tail, in + i, size - i);
+                }
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(last ? tail : in + i));
+                __m128i errors = incomplete;
+                incomplete = _mm_setzero_si128();
+                if (_mm_movemask_epi8(input) != 0) {
+                    errors = lookupErrors(input, previous);
+                    incomplete = _mm_subs_epu8(input, incompleteBound);
+                }
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) != 0xFFFF) {
+                    return lastBoundary(in, i);
+                }
+                if (last) {
+                    return size;
+                }
+                previous = input;
+                i += 16;
+            }
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(incomplete, _mm_setzero_si128())) == 0xFFFF
+                   ? size
+                   : lastBoundary(in, size);
+        }
+
+        __attribute__((target("avx2")))
+        inline __m256i lookupErrors(__m256i input, __m256i previous) {
+            const __m256i nibble = _mm256_set1_epi8(0x0F);
+            const __m256i carried = _mm256_permute2x128_si256(previous, input, 0x21);
+            const __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+            const __m256i previousHigh = _mm256_shuffle_epi8(
+                    _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::PREVIOUS_HIGH))),
+                    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            const __m256i previousLow = _mm256_shuffle_epi8(
+                    _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::PREVIOUS_LOW))),
+                    _mm256_and_si256(prev1, nibble));
+            const __m256i currentHigh = _mm256_shuffle_epi8(
+                    _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(Lookup::CURRENT_HIGH))),
+                    _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+            const __m256i special = _mm256_and_si256(_mm256_and_si256(previousHigh, previousLow), currentHigh);
+
+            const __m256i third = _mm256_subs_epu8(_mm256_alignr_epi8(input, carried, 14),
+                                                   _mm256_set1_epi8(0xE0 - 0x80));
+            const __m256i fourth = _mm256_subs_epu8(_mm256_alignr_epi8(input, carried, 13),
+                                                    _mm256_set1_epi8(0xF0 - 0x80));
+            const __m256i continuations = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(-0x80));
+            return _mm256_xor_si256(continuations, special);
+        }
+
+        __attribute__((target("avx2")))
+        inline std::size_t lookupAvx2(const char *in, std::size_t size) {
+            const __m256i incompleteBound = _mm256_load_si256(reinterpret_cast<const __m256i *>(Lookup::INCOMPLETE));
+            __m256i previous = _mm256_setzero_si256();
+            __m256i incomplete = _mm256_setzero_si256();
+            alignas(32) char tail[32] = {};
+            std::size_t i = 0;
+            while (i < size) {
+                if (_mm256_testz_si256(incomplete, incomplete)) {
+                    // Between code points, runs of ASCII need no lookups and are skipped two vectors at a time.
+                    const std::size_t start = i;
+                    for (; i + 64 <= size; i += 64) {
+                        const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+                        const __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i + 32));
+                        if (_mm256_movemask_epi8(_mm256_or_si256(first, second)) != 0) {
+                            break;
+                        }
+                    }
+                    if (i != start) {
+                        previous = _mm256_setzero_si256();
+                        if (i == size) {
+                            break;
+                        }
+                    }
+                }
+                const bool last = i + 32 > size;
+                if (last) {
+                    std::memcpy(tail, in + i, size - i);
+                }
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(last ? tail : in + i));
+                __m256i errors = incomplete;
+                incomplete = _mm256_setzero_si256();
+                if (_mm256_movemask_epi8(input) != 0) {
+                    errors = lookupErrors(input, previous);
+                    incomplete = _mm256_subs_epu8(input, incompleteBound);
+                }
+                if (!_mm256_testz_si256(errors, errors)) {
+                    return lastBoundary(in, i);
+                }
+                if (last) {
+                    return size;
+                }
+                previous = input;
+                i += 32;
+            }
+            return _mm256_testz_si256(incomplete, incomplete) ? size : lastBoundary(in, size);
+        }
+
+        inline Kernel select() {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return lookupAvx2;
+            }
+            if (__builtin_cpu_supports("ssse3")) {
+                return lookupSsse3;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                return asciiSse2;
+            }
+            return asciiWord;
+        }
+#else
+        inline Kernel select() {
+            return asciiWord;
+        }
+#endif
+
+        inline Kernel kernel() {
+            static const Kernel selected = select();
+            return selected;
+        }
+    }
+
+    // Incremental UTF-8 validator following RFC 3629: overlong encodings, surrogates and code points above U+10FFFF
+    // are rejected. A code point may be split across calls to feed, as happens with fragmented text messages.
+    struct Utf8Validator final {
+        // Returns false as soon as the input seen so far cannot be the start of valid UTF-8.
+        [[nodiscard]] bool feed(std::string_view piece) {
+            const char *in = piece.data();
+            std::size_t size = piece.size();
+            while (size > 0) {
+                if (remaining_ == 0) {
+                    const std::size_t ascii = Utf8::kernel()(in, size);
+                    in += ascii;
+                    size -= ascii;
+                    if (size == 0) {
+                        break;
+                    }
+                }
+
+                if (!step(static_cast<uint8_t>(*in))) {
+                    return false;
+                }
+                ++in;
+                --size;
+            }
+            return true;
+        }
+
+        // True when everything fed so far ends on a code point boundary.
+        [[nodiscard]] bool complete() const {
+            return remaining_ == 0;
+        }
+
+        void reset() {
+            remaining_ = 0;
+        }
+
+    private:
+        bool step(uint8_t byte) {
+            if (remaining_ > 0) {
+                if (byte < lower_ || byte > upper_) {
+                    return false;
+                }
+                --remaining_;
+                lower_ = 0x80;
+                upper_ = 0xBF;
+                return true;
+            }
+
+            if (byte < 0x80) {
+                return true;
+            }
+            lower_ = 0x80;
+            upper_ = 0xBF;
+            if (byte >= 0xC2 && byte <= 0xDF) {
+                remaining_ = 1;
+            } else if (byte == 0xE0) {
+                remaining_ = 2;
+                lower_ = 0xA0;
+            } else if (byte == 0xED) {
+                remaining_ = 2;
+                upper_ = 0x9F;
+            } else if (byte >= 0xE1 && byte <= 0xEF) {
+                remaining_ = 2;
+            } else if (byte == 0xF0) {
+                remaining_ = 3;
+                lower_ = 0x90;
+            } else if (byte == 0xF4) {
+                remaining_ = 3;
+                upper_ = 0x8F;
+            } else if (byte >= 0xF1 && byte <= 0xF3) {
+                remaining_ = 3;
+            } else {
+                return false;
+            }
+            return true;
+        }
+
+        uint8_t remaining_ = 0;
+        uint8_t lower_ = 0x80;
+        uint8_t upper_ = 0xBF;
+    };
+
+    inline bool validUtf8(std::string_view text) {
+        Utf8Validator validator;
+        return validator.feed(text) && validator.complete();
+    }
+
+    // Checks a close frame payload: empty, or a two byte status code followed by a UTF-8 reason.
+    inline std::optional<Failure> validateClose(std::string_view payload) {
+        if (payload.size() == 1) {
+            return Failure{"WebSocket close frame has a truncated status code", CloseCode::ProtocolError};
+        }
+        if (payload.size() > 2 && !validUtf8(payload.substr(2))) {
+            return Failure{"WebSocket close reason is not valid UTF-8", CloseCode::InvalidPayload};
+        }
+        return std::nullopt;
+    }
+
+    // Checks the UTF-8 requirements of RFC 6455 on a complete message: text payloads and close reasons.
+    inline std::optional<Failure> validate(const MessageView &messageView) {
+        return std::visit(visitor{
+                [](const TextFrameView &textFrameView) -> std::optional<Failure> {
+                    if (!validUtf8(textFrameView.value())) {
+                        return Failure{"WebSocket text message is not valid UTF-8", CloseCode::InvalidPayload};
+                    }
+                    return std::nullopt;
+                },
+                [](const CloseFrameView &closeFrameView) { return validateClose(closeFrameView.value()); },
+                [](const auto &) -> std::optional<Failure> { return std::nullopt; }
+        }, messageView.value());
+    }
+
+    inline std::optional<Failure> validate(const Message &message) {
+        return std::visit(visitor{
+                [](const TextFrame &textFrame) { return validate(MessageView{TextFrameView{textFrame.value()}}); },
+                [](const CloseFrame &closeFrame) { return validateClose(closeFrame.value()); },
+                [](const auto &) -> std::optional<Failure> { return std::nullopt; }
+        }, message.value());
+    }
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+    // permessage-deflate (RFC 7692). What the client offers in Sec-WebSocket-Extensions. A clientMaxWindowBits of
+    // std::nullopt offers the parameter without a value, letting the server pick the window the client deflates with.
+    // memLevel and minimumSize only affect the local deflater: messages shorter than minimumSize are sent
+    // uncompressed.
+    struct DeflateOptions final {
+        bool clientNoContextTakeover = false;
+        bool serverNoContextTakeover = false;
+        std::optional<int> clientMaxWindowBits = std::nullopt;
+        std::optional<int> serverMaxWindowBits = std::nullopt;
+        int memLevel = 8;
+        std::size_t minimumSize = 0;
+
+        [[nodiscard]] std::string offer() const {
+            std::string offer = "permessage-deflate";
+            if (clientNoContextTakeover) {
+                offer += "; client_no_context_takeover";
+            }
+            if (serverNoContextTakeover) {
+                offer += "; server_no_context_takeover";
+            }
+            offer += "; client_max_window_bits";
+            if (clientMaxWindowBits) {
+                offer += "=" + std::to_string(*clientMaxWindowBits);
+            }
+            if (serverMaxWindowBits) {
+                offer += "; server_max_window_bits=" + std::to_string(*serverMaxWindowBits);
+            }
+            return offer;
+        }
+    };
+
+    // The parameters both ends agreed on.
+    struct DeflateParameters final {
+        bool clientNoContextTakeover = false;
+        bool serverNoContextTakeover = false;
+        int clientMaxWindowBits = 15;
+        int serverMaxWindowBits = 15;
+        int memLevel = 8;
+        std::size_t minimumSize = 0;
+
+        bool operator==(const DeflateParameters &rhs) const = default;
+    };
+
+    using DeflateNegotiation = std::variant<std::monostate, DeflateParameters, Failure>;
+
+    // Reads the server's Sec-WebSocket-Extensions response to an offer. std::monostate means the server declined
+    // compression; a Failure means the response is invalid and the connection must be failed.
+    inline DeflateNegotiation negotiateDeflate(const DeflateOptions &options, std::string_view extensions) {
+        auto trim = [](std::string_view value) {
+            const std::size_t begin = value.find_first_not_of(" \t");
+            if (begin == std::string_view::npos) {
+                return std::string_view{};
+            }
+            return value.substr(begin, value.find_last_not_of(" \t") - begin + 1);
+        };
+        auto windowBits = [](std::string_view value) -> std::optional<int> {
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.size() - 2);
+            }
+            if (value.empty() || value.size() > 2 || !std::all_of(value.begin(), value.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+                return std::nullopt;
+            }
+            const int bits = std::stoi(std::string{value});
+            if (bits < 8 || bits > 15) {
+                return std::nullopt;
+            }
+            return bits;
+        };
+
+        while (!extensions.empty()) {
+            const std::size_t comma = extensions.find(',');
+            std::string_view extension = extensions.substr(0, comma);
+            extensions = comma == std::string_view::npos ? std::string_view{} : extensions.substr(comma + 1);
+
+            std::size_t semicolon = extension.find(';');
+            if (trim(extension.substr(0, semicolon)) != "permessage-deflate") {
+                continue;
+            }
+
+            DeflateParameters parameters{
+                    options.clientNoContextTakeover,
+                    false,
+                    options.clientMaxWindowBits.value_or(15),
+                    15,
+                    options.memLevel,
+                    options.minimumSize
+            };
+            while (semicolon != std::string_view::npos) {
+                extension = extension.substr(semicolon + 1);
+                semicolon = extension.find(';');
+                const std::string_view parameter = trim(extension.substr(0, semicolon));
+                const std::size_t equals = parameter.find('=');
+                const std::string_view name = trim(parameter.substr(0, equals));
+                const std::string_view value = equals == std::string_view::npos ? std::string_view{} : trim(parameter.substr(equals + 1));
+
+                if (name == "server_no_context_takeover" && equals == std::string_view::npos) {
+                    parameters.serverNoContextTakeover = true;
+                } else if (name == "client_no_context_takeover" && equals == std::string_view::npos) {
+                    parameters.clientNoContextTakeover = true;
+                } else if (name == "server_max_window_bits" && windowBits(value)) {
+                    parameters.serverMaxWindowBits = *windowBits(value);
+                } else if (name == "client_max_window_bits" && windowBits(value)
+                           && *windowBits(value) <= parameters.clientMaxWindowBits) {
+                    parameters.clientMaxWindowBits = *windowBits(value);
+                } else {
+                    return Failure{"WebSocket server sent an invalid permessage-deflate parameter: " + std::string{parameter},
+                                   CloseCode::ProtocolError};
+                }
+            }
+            return parameters;
+        }
+        return std::monostate{};
+    }
+
+    // Shares zlib streams between connections. Without context takeover a stream is only needed while a message is
+    // being compressed or decompressed, so idle connections hold none, and a handful of streams serve many
+    // connections. Streams are reset when they come back and kept up to maxIdle per kind.
+    struct ZlibPool final {
+        struct Stream final {
+            Stream(bool deflate, int windowBits, int memLevel)
+                    : deflate_(deflate), windowBits_(windowBits), memLevel_(memLevel) {
+                const int status = deflate_
+                        ? deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits_, memLevel_, Z_DEFAULT_STRATEGY)
+                        : inflateInit2(&stream_, -windowBits_);
+                if (status != Z_OK) {
+                    throw std::bad_alloc{};
+                }
+            }
+
+            Stream(const Stream &) = delete;
+
+            Stream &operator=(const Stream &) = delete;
+
+            ~Stream() {
+                deflate_ ? deflateEnd(&stream_) : inflateEnd(&stream_);
+            }
+
+            void reset() {
+                deflate_ ? deflateReset(&stream_) : inflateReset(&stream_);
+            }
+
+            [[nodiscard]] z_stream &get() {
+                return stream_;
+            }
+
+        private:
+            friend ZlibPool;
+
+            z_stream stream_{};
+            bool deflate_;
+            int windowBits_;
+            int memLevel_;
+        };
+
+        explicit ZlibPool(std::size_t maxIdle = 64) : maxIdle_(maxIdle) {}
+
+        // The pool connections use unless given another.
+        static std::shared_ptr<ZlibPool> shared() {
+            static const std::shared_ptr<ZlibPool> pool = std::make_shared<ZlibPool>();
+            return pool;
+        }
+
+        [[nodiscard]] std::unique_ptr<Stream> acquire(bool deflate, int windowBits, int memLevel) {
+            {
+                std::lock_guard lock{mutex_};
+                auto found = std::find_if(idle_.begin(), idle_.end(), [&](const std::unique_ptr<Stream> &stream) {
+                    return stream->deflate_ == deflate && stream->windowBits_ == windowBits && stream->memLevel_ == memLevel;
+                });
+                if (found != idle_.end()) {
+                    std::unique_ptr<Stream> stream = std::move(*found);
+                    *found = std::move(idle_.back());
+                    idle_.pop_back();
+                    return stream;
+                }
+            }
+            return std::make_unique<Stream>(deflate, windowBits, memLevel);
+        }
+
+        void release(std::unique_ptr<Stream> stream) {
+            stream->reset();
+            std::lock_guard lock{mutex_};
+            if (idle_.size() < maxIdle_) {
+                idle_.push_back(std::move(stream));
+            }
+        }
+
+        [[nodiscard]] std::size_t idle() const {
+            std::lock_guard lock{mutex_};
+            return idle_.size();
+        }
+
+    private:
+        std::size_t maxIdle_;
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<Stream>> idle_;
+    };
+
+    // Compresses outgoing messages. With context takeover the stream, and its window, is held for the life of the
+    // connection so later messages can refer back to earlier ones; without it the stream goes back to the pool after
+    // every message.
+    struct Deflater final {
+        Deflater(int windowBits, int memLevel, bool noContextTakeover, std::shared_ptr<ZlibPool> pool = ZlibPool::shared())
+                : windowBits_(windowBits)
+                , memLevel_(memLevel)
+                , noContextTakeover_(noContextTakeover)
+                , pool_(std::move(pool)) {}
+
+        Deflater(Role role, const DeflateParameters &parameters, std::shared_ptr<ZlibPool> pool = ZlibPool::shared())
+                : Deflater(role == Role::Client ? parameters.clientMaxWindowBits : parameters.serverMaxWindowBits,
+                           parameters.memLevel,
+                           role == Role::Client ? parameters.clientNoContextTakeover : parameters.serverNoContextTakeover,
+                           std::move(pool)) {}
+
+        Deflater(const Deflater &) = delete;
+
+        Deflater &operator=(const Deflater &) = delete;
+
+        ~Deflater() {
+            if (stream_) {
+                pool_->release(std::move(stream_));
+            }
+        }
+
+        // Compresses a complete message. The returned view points into a buffer reused by the next call.
+        [[nodiscard]] std::string_view deflate(std::string_view message) {
+            if (!stream_) {
+                stream_ = pool_->acquire(true, windowBits_, memLevel_);
+            }
+            z_stream &stream = stream_->get();
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(message.data()));
+            stream.avail_in = static_cast<uInt>(message.size());
+
+            std::size_t size = 0;
+            if (buffer_.size() < message.size() / 2 + 64) {
+                buffer_.resize(message.size() / 2 + 64);
+            }
+            do {
+                if (size == buffer_.size()) {
+                    buffer_.resize(buffer_.size() * 2);
+                }
+                stream.next_out = reinterpret_cast<Bytef *>(buffer_.data() + size);
+                stream.avail_out = static_cast<uInt>(buffer_.size() - size);
+                ::deflate(&stream, Z_SYNC_FLUSH);
+                size = buffer_.size() - stream.avail_out;
+            } while (stream.avail_out == 0);
+
+            if (noContextTakeover_) {
+                pool_->release(std::move(stream_));
+            }
+            // A sync flush ends in an empty stored block, 00 00 ff ff, which RFC 7692 leaves off the wire. zlib
+            // writes nothing for an empty message right after another flush; a lone 00 starts the same empty block.
+            if (size < 4) {
+                buffer_[0] = 0x00;
+                return {buffer_.data(), 1};
+            }
+            return {buffer_.data(), size - 4};
+        }
+
+    private:
+        int windowBits_;
+        int memLevel_;
+        bool noContextTakeover_;
+        std::shared_ptr<ZlibPool> pool_;
+        std::unique_ptr<ZlibPool::Stream> stream_;
+        std::vector<char> buffer_;
+    };
+
+    // Decompresses incoming messages a fragment at a time. Inflating always uses the largest window, which is valid
+    // whatever window the peer deflated with and lets every inflate stream in the pool be shared.
+    struct Inflater final {
+        explicit Inflater(bool noContextTakeover, std::shared_ptr<ZlibPool> pool = ZlibPool::shared())
+                : noContextTakeover_(noContextTakeover), pool_(std::move(pool)) {}
+
+        Inflater(Role role, const DeflateParameters &parameters, std::shared_ptr<ZlibPool> pool = ZlibPool::shared())
+                : Inflater(role == Role::Client ? parameters.serverNoContextTakeover : parameters.clientNoContextTakeover,
+                           std::move(pool)) {}
+
+        Inflater(const Inflater &) = delete;
+
+        Inflater &operator=(const Inflater &) = delete;
+
+        ~Inflater() {
+            if (stream_) {
+                pool_->release(std::move(stream_));
+            }
+        }
+
+        // Appends the decompressed fragment to out. Fails with CloseCode::MessageTooBig rather than let out grow
+        // past maxSize, so a small compressed message cannot expand without bound.
+        [[nodiscard]] std::optional<Failure> inflate(std::string_view fragment, bool fin, std::vector<char> &out, std::size_t maxSize) {
+            static constexpr char TAIL[] = {0x00, 0x00, static_cast<char>(0xff), static_cast<char>(0xff)};
+
+            if (!stream_) {
+                stream_ = pool_->acquire(false, 15, 0);
+            }
+            std::optional<Failure> failure = run(fragment, out, maxSize);
+            if (!failure && fin) {
+                failure = run({TAIL, sizeof(TAIL)}, out, maxSize);
+            }
+            if (failure || (fin && noContextTakeover_)) {
+                reset();
+            }
+            return failure;
+        }
+
+        // Abandons a partially inflated message, and with it any window carried over from earlier messages.
+        void reset() {
+            if (stream_) {
+                pool_->release(std::move(stream_));
+            }
+        }
+
+    private:
+        std::optional<Failure> run(std::string_view in, std::vector<char> &out, std::size_t maxSize) {
+            z_stream &stream = stream_->get();
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+            stream.avail_in = static_cast<uInt>(in.size());
+
+            std::size_t size = out.size();
+            while (true) {
+                if (size == out.size()) {
+                    if (size > maxSize) {
+                        out.resize(size);
+                        return Failure{"WebSocket message inflates beyond " + std::to_string(maxSize) + " bytes",
+                                       CloseCode::MessageTooBig};
+                    }
+                    const std::size_t grown = std::min(std::max<std::size_t>(size * 2, size + in.size() * 4 + 64), maxSize + 1);
+                    out.reserve(grown);
+                    out.resize(grown);
+                }
+                stream.next_out = reinterpret_cast<Bytef *>(out.data() + size);
+                stream.avail_out = static_cast<uInt>(out.size() - size);
+                const int status = ::inflate(&stream, Z_SYNC_FLUSH);
+                size = out.size() - stream.avail_out;
+                if (status == Z_STREAM_END) {
+                    // The peer ended the deflate stream with a final block; what follows starts a new one.
+                    inflateReset(&stream);
+                    continue;
+                }
+                if (status != Z_OK && status != Z_BUF_ERROR) {
+                    out.resize(size);
+                    return Failure{"WebSocket compressed message is corrupt", CloseCode::ProtocolError};
+                }
+                if (stream.avail_in == 0 && stream.avail_out != 0) {
+                    break;
+                }
+            }
+            out.resize(size);
+            if (size > maxSize) {
+                return Failure{"WebSocket message inflates beyond " + std::to_string(maxSize) + " bytes",
+                               CloseCode::MessageTooBig};
+            }
+            return std::nullopt;
+        }
+
+        bool noContextTakeover_;
+        std::shared_ptr<ZlibPool> pool_;
+        std::unique_ptr<ZlibPool::Stream> stream_;
+    };
+#endif
+
+    using ReassemblyResult = std::variant<std::monostate, MessageView, Failure>;
+
+    // Joins fragmented data frames into complete messages. Control frames may arrive between fragments and are
+    // returned as they come. A MessageView returned by feed points either into the frame passed in or into the
+    // reassembly buffer, and stays valid until the next data frame is fed. The buffer is reused across messages and
+    // never grows beyond maxMessageSize. Given a FragmentHandler, data frames are streamed to it as they arrive and
+    // nothing is buffered. With validateUtf8 set, text messages and close reasons are checked as they arrive, and
+    // invalid UTF-8 fails with CloseCode::InvalidPayload. Once given an Inflater, messages whose first frame has RSV1
+    // set are decompressed as their fragments arrive; the size limit and UTF-8 checks apply to the inflated data.
+    struct Reassembler final {
+        static constexpr std::size_t DEFAULT_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+        explicit Reassembler(std::size_t maxMessageSize = DEFAULT_MAX_MESSAGE_SIZE, bool validateUtf8 = false)
+                : maxMessageSize_(maxMessageSize), validateUtf8_(validateUtf8) {}
+
+        Reassembler(std::size_t maxMessageSize,
+                    std::unique_ptr<FragmentHandler> fragmentHandler,
+                    bool validateUtf8 = false)
+                : maxMessageSize_(maxMessageSize)
+                , validateUtf8_(validateUtf8)
+                , fragmentHandler_(std::move(fragmentHandler)) {}
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+        void setInflater(std::unique_ptr<Inflater> inflater) {
+            inflater_ = std::move(inflater);
+        }
+#endif
+
+        // compressed is the RSV1 bit of the frame, which only the first frame of a compressed message carries.
+        [[nodiscard]] ReassemblyResult feed(bool fin, OpCode opCode, std::string_view payload, bool compressed = false) {
+            if (compressed && (!inflating() || (opCode != OpCode::Text && opCode != OpCode::Binary))) {
+                return fail("WebSocket frame has RSV1 set without permessage-deflate", CloseCode::ProtocolError);
+            }
+
+            switch (opCode) {
+                case OpCode::Ping:
+                case OpCode::Pong:
+                case OpCode::Close:
+                    if (!fin || payload.size() > 125) {
+                        return fail("WebSocket control frame is fragmented or too long", CloseCode::ProtocolError);
+                    }
+                    if (opCode == OpCode::Close && validateUtf8_) {
+                        if (std::optional<Failure> failure = validateClose(payload)) {
+                            return fail(failure->value(), *failure->closeCode());
+                        }
+                    }
+                    return frameView(opCode, payload);
+                case OpCode::Text:
+                case OpCode::Binary:
+                    if (messageOpCode_) {
+                        return fail("WebSocket data frame interrupts a fragmented message", CloseCode::ProtocolError);
+                    }
+                    messageOpCode_ = opCode;
+                    messageSize_ = 0;
+                    compressed_ = compressed;
+                    buffer_.clear();
+                    utf8Validator_.reset();
+                    return append(fin, payload, true);
+                case OpCode::Continuation:
+                    if (!messageOpCode_) {
+                        return fail("WebSocket continuation frame without a message", CloseCode::ProtocolError);
+                    }
+                    return append(fin, payload, false);
+                default:
+                    return fail("WebSocket frame has a reserved op code", CloseCode::ProtocolError);
+            }
+        }
+
+        [[nodiscard]] std::size_t capacity() const {
+            return buffer_.capacity();
+        }
+
+        [[nodiscard]] bool inflating() const {
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+            return inflater_ != nullptr;
+#else
+            return false;
+#endif
+        }
+
+    private:
+        ReassemblyResult append(bool fin, std::string_view payload, bool first) {
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+            if (compressed_) {
+                return appendCompressed(fin, payload, first);
+            }
+#endif
+            messageSize_ += payload.size();
+            if (messageSize_ > maxMessageSize_) {
+                return fail("WebSocket message exceeds " + std::to_string(maxMessageSize_) + " bytes",
+                            CloseCode::MessageTooBig);
+            }
+
+            OpCode opCode = *messageOpCode_;
+            if (validateUtf8_ && opCode == OpCode::Text) {
+                if (!utf8Validator_.feed(payload) || (fin && !utf8Validator_.complete())) {
+                    return fail("WebSocket text message is not valid UTF-8", CloseCode::InvalidPayload);
+                }
+            }
+
+            if (fin) {
+                messageOpCode_.reset();
+            }
+
+            if (fragmentHandler_) {
+                fragmentHandler_->handleFragment(FragmentView{opCode, payload, first, fin});
+                return std::monostate{};
+            }
+
+            if (first && fin) {
+                return frameView(opCode, payload);
+            }
+
+            if (buffer_.size() + payload.size() > buffer_.capacity()) {
+                buffer_.reserve(std::min(std::max(buffer_.capacity() * 2, buffer_.size() + payload.size()), maxMessageSize_));
+            }
+            buffer_.insert(buffer_.end(), payload.begin(), payload.end());
+
+            if (fin) {
+                return frameView(opCode, {buffer_.data(), buffer_.size()});
+            }
+
+            return std::monostate{};
+        }
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+        // Inflates into the reassembly buffer, or into a scratch buffer handed to the FragmentHandler. A compressed
+        // message is never returned as a view of the frame, since the frame holds deflated bytes.
+        ReassemblyResult appendCompressed(bool fin, std::string_view payload, bool first) {
+            std::vector<char> &target = fragmentHandler_ ? inflated_ : buffer_;
+            if (fragmentHandler_) {
+                inflated_.clear();
+            }
+            const std::size_t before = target.size();
+            const std::size_t limit = fragmentHandler_ ? maxMessageSize_ - messageSize_ : maxMessageSize_;
+            if (std::optional<Failure> failure = inflater_->inflate(payload, fin, target, limit)) {
+                return fail(failure->value(), *failure->closeCode());
+            }
+            const std::string_view data{target.data() + before, target.size() - before};
+            messageSize_ += data.size();
+
+            OpCode opCode = *messageOpCode_;
+            if (validateUtf8_ && opCode == OpCode::Text) {
+                if (!utf8Validator_.feed(data) || (fin && !utf8Validator_.complete())) {
+                    return fail("WebSocket text message is not valid UTF-8", CloseCode::InvalidPayload);
+                }
+            }
+
+            if (fin) {
+                messageOpCode_.reset();
+            }
+
+            if (fragmentHandler_) {
+                fragmentHandler_->handleFragment(FragmentView{opCode, data, first, fin});
+                return std::monostate{};
+            }
+
+            if (fin) {
+                return frameView(opCode, {buffer_.data(), buffer_.size()});
+            }
+
+            return std::monostate{};
+        }
+#endif
+
+        ReassemblyResult fail(std::string reason, CloseCode closeCode) {
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+            if (inflater_) {
+                inflater_->reset();
+            }
+#endif
+            messageOpCode_.reset();
+            buffer_.clear();
+            return Failure{std::move(reason), closeCode};
+        }
+
+        std::size_t maxMessageSize_;
+        bool validateUtf8_;
+        std::unique_ptr<FragmentHandler> fragmentHandler_;
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+        std::unique_ptr<Inflater> inflater_;
+        std::vector<char> inflated_;
+#endif
+        Utf8Validator utf8Validator_;
+        std::vector<char> buffer_;
+        std::optional<OpCode> messageOpCode_;
+        std::size_t messageSize_ = 0;
+        bool compressed_ = false;
+    };
+
+    using MaskingKey = std::array<char, 4>;
+
+    // Masking kernels. Each one XORs size bytes of in with the 4-byte pattern repeated and writes them to out, which
+    // may be the same buffer as in. The pattern is the masking key already rotated to the frame offset of in[0].
+    namespace Mask {
+        using Kernel = void (*)(const char *in, char *out, std::size_t size, uint32_t pattern);
+
+        inline uint32_t pattern(const MaskingKey &maskingKey, std::size_t offset) {
+            const std::array<char, 4> rotated{maskingKey[offset & 3], maskingKey[(offset + 1) & 3],
+                                              maskingKey[(offset + 2) & 3], maskingKey[(offset + 3) & 3]};
+            uint32_t value;
+            std::memcpy(&value, rotated.data(), sizeof(value));
+            return value;
+        }
+
+        inline void tail(const char *in, char *out, std::size_t size, uint32_t pattern) {
+            char bytes[4];
+            std::memcpy(bytes, &pattern, sizeof(pattern));
+            for (std::size_t i = 0; i < size; ++i) {
+                out[i] = static_cast<char>(in[i] ^ bytes[i & 3]);
+            }
+        }
+
+        inline void word(const char *in, char *out, std::size_t size, uint32_t pattern) {
+            const uint64_t wide = (static_cast<uint64_t>(pattern) << 32) | pattern;
+            std::size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                uint64_t value;
+                std::memcpy(&value, in + i, sizeof(value));
+                value ^= wide;
+                std::memcpy(out + i, &value, sizeof(value));
+            }
+            tail(in + i, out + i, size - i, pattern);
+        }
+
+#ifdef SIMPLE_WEBSOCKET_X86_KERNELS
+        __attribute__((target("sse2")))
+        inline void sse2(const char *in, char *out, std::size_t size, uint32_t pattern) {
+            const __m128i key = _mm_set1_epi32(static_cast<int>(pattern));
+            std::size_t i = 0;
+            for (; i + 16 <= size; i += 16) {
+                const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_xor_si128(value, key));
+            }
+            word(in + i, out + i, size - i, pattern);
+        }
+
+        __attribute__((target("avx2")))
+        inline void avx2(const char *in, char *out, std::size_t size, uint32_t pattern) {
+            const __m256i key = _mm256_set1_epi32(static_cast<int>(pattern));
+            std::size_t i = 0;
+            for (; i + 64 <= size; i += 64) {
+                const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+                const __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i + 32));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_xor_si256(first, key));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 32), _mm256_xor_si256(second, key));
+            }
+            sse2(in + i, out + i, size - i, pattern);
+        }
+
+        inline Kernel select() {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return avx2;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                return sse2;
+            }
+            return word;
+        }
+#else
+        inline Kernel select() {
+            return word;
+        }
+#endif
+
+        inline Kernel kernel() {
+            static const Kernel selected = select();
+            return selected;
+        }
+    }
+
+    // XORs payload with the masking key. offset is the position of payload[0] within the frame payload, so a
+    // payload that arrives in pieces can be unmasked piece by piece.
+    inline void applyMask(std::span<char> payload, const MaskingKey &maskingKey, std::size_t offset = 0) {
+        Mask::kernel()(payload.data(), payload.data(), payload.size(), Mask::pattern(maskingKey, offset));
+    }
+
+    // Copies payload into out, which must be at least as large, masking it on the way.
+    inline void copyMasked(std::span<char> out, std::string_view payload, const MaskingKey &maskingKey, std::size_t offset = 0) {
+        Mask::kernel()(payload.data(), out.data(), payload.size(), Mask::pattern(maskingKey, offset));
+    }
+
+    // Fills bytes from the operating system's cryptographically secure generator.
+    inline void randomBytes(std::span<char> bytes) {
+#if __has_include(<sys/random.h>)
+        // getentropy hands out at most 256 bytes a call.
+        for (std::size_t offset = 0; offset < bytes.size(); offset += 256) {
+            if (::getentropy(bytes.data() + offset, std::min<std::size_t>(bytes.size() - offset, 256)) != 0) {
+                throw std::runtime_error("SimpleWebSocket could not read random bytes");
+            }
+        }
+#else
+        std::random_device random;
+        for (char &byte : bytes) {
+            byte = static_cast<char>(random());
+        }
+#endif
+    }
+
+    // A fresh client masking key. RFC 6455 section 5.3 needs keys that the frames already sent do not give away, so
+    // they come from randomBytes, read a batch of keys at a time per thread.
+    inline MaskingKey randomMaskingKey() {
+        thread_local std::array<MaskingKey, 256> keys{};
+        thread_local std::size_t next = keys.size();
+        if (next == keys.size()) {
+            static_assert(sizeof(keys) == keys.size() * sizeof(MaskingKey));
+            randomBytes(std::span<char>{keys.front().data(), sizeof(keys)});
+            next = 0;
+        }
+        return keys[next++];
+    }
+
+    struct FrameHeader final {
+        static constexpr std::size_t MAX_SIZE = 14;
+        static constexpr uint8_t RSV1 = 0x40;
+        static constexpr uint8_t RSV2 = 0x20;
+        static constexpr uint8_t RSV3 = 0x10;
+
+        FrameHeader(bool fin,
+                    OpCode opCode,
+                    uint64_t length,
+                    std::optional<MaskingKey> maskingKey = std::nullopt,
+                    uint8_t reserved = 0)
+                : fin_(fin), opCode_(opCode), length_(length), maskingKey_(maskingKey), reserved_(reserved) {}
+
+        bool operator==(const FrameHeader &rhs) const {
+            return fin_ == rhs.fin_ &&
+                   opCode_ == rhs.opCode_ &&
+                   length_ == rhs.length_ &&
+                   maskingKey_ == rhs.maskingKey_ &&
+                   reserved_ == rhs.reserved_;
+        }
+
+        bool operator!=(const FrameHeader &rhs) const {
+            return !(rhs == *this);
+        }
+
+        [[nodiscard]] bool fin() const {
+            return fin_;
+        }
+
+        [[nodiscard]] OpCode opCode() const {
+            return opCode_;
+        }
+
+        [[nodiscard]] uint64_t length() const {
+            return length_;
+        }
+
+        [[nodiscard]] const std::optional<MaskingKey> &maskingKey() const {
+            return maskingKey_;
+        }
+
+        [[nodiscard]] uint8_t reserved() const {
+            return reserved_;
+        }
+
+        [[nodiscard]] std::size_t size() const {
+            return 2 + (length_ > 0xFFFF ? 8 : length_ > 125 ? 2 : 0) + (maskingKey_ ? 4 : 0);
+        }
+
+        // Writes the header in wire format. Returns size(), or 0 when out is too small.
+        std::size_t encode(std::span<char> out) const {
+            const std::size_t headerSize = size();
+            if (out.size() < headerSize) {
+                return 0;
+            }
+
+            out[0] = static_cast<char>((fin_ ? 0x80 : 0) | (reserved_ & 0x70) | static_cast<uint8_t>(opCode_));
+            const char maskBit = static_cast<char>(maskingKey_ ? 0x80 : 0);
+            std::size_t position = 2;
+            if (length_ <= 125) {
+                out[1] = static_cast<char>(maskBit | static_cast<char>(length_));
+            } else if (length_ <= 0xFFFF) {
+                out[1] = static_cast<char>(maskBit | 126);
+                for (int shift = 8; shift >= 0; shift -= 8) {
+                    out[position++] = static_cast<char>((length_ >> shift) & 0xFF);
+                }
+            } else {
+                out[1] = static_cast<char>(maskBit | 127);
+                for (int shift = 56; shift >= 0; shift -= 8) {
+                    out[position++] = static_cast<char>((length_ >> shift) & 0xFF);
+                }
+            }
+
+            if (maskingKey_) {
+                std::memcpy(out.data() + position, maskingKey_->data(), maskingKey_->size());
+            }
+
+            return headerSize;
+        }
+
+    private:
+        bool fin_;
+        OpCode opCode_;
+        uint64_t length_;
+        std::optional<MaskingKey> maskingKey_;
+        uint8_t reserved_;
+    };
+
+    // Writes a complete frame into out, masking the copied payload when a masking key is given. Returns the number of
+    // bytes written, or 0 when out is too small.
+    inline std::size_t encodeFrame(std::span<char> out,
+                                   bool fin,
+                                   OpCode opCode,
+                                   std::string_view payload,
+                                   std::optional<MaskingKey> maskingKey = std::nullopt,
+                                   uint8_t reserved = 0) {
+        FrameHeader header{fin, opCode, payload.size(), maskingKey, reserved};
+        const std::size_t headerSize = header.size();
+        if (out.size() < headerSize || out.size() - headerSize < payload.size()) {
+            return 0;
+        }
+
+        header.encode(out);
+        std::span<char> body = out.subspan(headerSize, payload.size());
+        if (maskingKey) {
+            copyMasked(body, payload, *maskingKey);
+        } else {
+            std::copy(payload.begin(), payload.end(), body.begin());
+        }
+
+        return headerSize + payload.size();
+    }
+
+    // Incremental RFC 6455 frame decoder. Bytes are taken straight from the caller's buffer; a frame that is complete
+    // within one call is unmasked in place and handed over without copying. Only a frame split across calls is
+    // gathered into an internal buffer, which is reused from frame to frame. Reserved bits outside allowedReserved,
+    // such as FrameHeader::RSV1 once permessage-deflate is negotiated, fail the frame.
+    struct FrameDecoder final {
+        static constexpr std::size_t DEFAULT_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+        explicit FrameDecoder(Role role, std::size_t maxFrameSize = DEFAULT_MAX_FRAME_SIZE, uint8_t allowedReserved = 0)
+                : role_(role), maxFrameSize_(maxFrameSize), allowedReserved_(allowedReserved) {}
+
+        // Calls onFrame(const FrameHeader &, std::span<char> payload) for every frame completed by input. The payload
+        // span is only valid during the call. After a Failure the connection has to be closed.
+        template<class F>
+        [[nodiscard]] std::optional<Failure> decode(std::span<char> input, F &&onFrame) {
+            while (!input.empty()) {
+                if (!header_) {
+                    const std::size_t needed = headerSize_ < 2 ? 2 : encodedHeaderSize();
+                    const std::size_t take = std::min(needed - headerSize_, input.size());
+                    std::memcpy(headerBuffer_.data() + headerSize_, input.data(), take);
+                    headerSize_ += take;
+                    input = input.subspan(take);
+                    if (headerSize_ < 2 || headerSize_ < encodedHeaderSize()) {
+                        continue;
+                    }
+
+                    if (std::optional<Failure> failure = parseHeader()) {
+                        return failure;
+                    }
+
+                    if (header_->length() == 0) {
+                        emit(onFrame, input.first(0));
+                    }
+                    continue;
+                }
+
+                const std::size_t remaining = static_cast<std::size_t>(header_->length()) - received_;
+                if (received_ == 0 && input.size() >= remaining) {
+                    std::span<char> payload = input.first(remaining);
+                    unmask(payload);
+                    input = input.subspan(remaining);
+                    emit(onFrame, payload);
+                    continue;
+                }
+
+                const std::size_t take = std::min(remaining, input.size());
+                payloadBuffer_.insert(payloadBuffer_.end(), input.begin(), input.begin() + static_cast<std::ptrdiff_t>(take));
+                unmask(std::span<char>{payloadBuffer_}.subspan(received_));
+                received_ += take;
+                input = input.subspan(take);
+                if (received_ == header_->length()) {
+                    emit(onFrame, std::span<char>{payloadBuffer_});
+                }
+            }
+
+            return std::nullopt;
+        }
+
+    private:
+        [[nodiscard]] std::size_t encodedHeaderSize() const {
+            const auto second = static_cast<uint8_t>(headerBuffer_[1]);
+            const uint8_t length = second & 0x7F;
+            return 2 + (length == 127 ? 8 : length == 126 ? 2 : 0) + ((second & 0x80) ? 4 : 0);
+        }
+
+        std::optional<Failure> parseHeader() {
+            const auto first = static_cast<uint8_t>(headerBuffer_[0]);
+            const auto second = static_cast<uint8_t>(headerBuffer_[1]);
+            const auto opCode = static_cast<OpCode>(first & 0x0F);
+            const bool fin = (first & 0x80) != 0;
+            const bool masked = (second & 0x80) != 0;
+
+            std::size_t position = 2;
+            uint64_t length = second & 0x7F;
+            if (length >= 126) {
+                const std::size_t lengthSize = length == 126 ? 2 : 8;
+                length = 0;
+                for (std::size_t i = 0; i < lengthSize; ++i) {
+                    length = (length << 8) | static_cast<uint8_t>(headerBuffer_[position++]);
+                }
+            }
+
+            std::optional<MaskingKey> maskingKey;
+            if (masked) {
+                maskingKey = MaskingKey{};
+                std::memcpy(maskingKey->data(), headerBuffer_.data() + position, maskingKey->size());
+            }
+            headerSize_ = 0;
+
+            if ((first & 0x70 & ~allowedReserved_) != 0) {
+                return Failure{"WebSocket frame sets reserved bits", CloseCode::ProtocolError};
+            }
+            if (masked != (role_ == Role::Server)) {
+                return Failure{masked ? "WebSocket server frame is masked" : "WebSocket client frame is not masked",
+                               CloseCode::ProtocolError};
+            }
+            switch (opCode) {
+                case OpCode::Ping:
+                case OpCode::Pong:
+                case OpCode::Close:
+                    if (!fin || length > 125) {
+                        return Failure{"WebSocket control frame is fragmented or too long", CloseCode::ProtocolError};
+                    }
+                    break;
+                case OpCode::Continuation:
+                case OpCode::Text:
+                case OpCode::Binary:
+                    break;
+                default:
+                    return Failure{"WebSocket frame has a reserved op code", CloseCode::ProtocolError};
+            }
+            if ((length >> 63) != 0) {
+                return Failure{"WebSocket frame length is out of range", CloseCode::ProtocolError};
+            }
+            if (length > maxFrameSize_) {
+                return Failure{"WebSocket frame exceeds " + std::to_string(maxFrameSize_) + " bytes",
+                               CloseCode::MessageTooBig};
+            }
+
+            header_.emplace(fin, opCode, length, maskingKey, static_cast<uint8_t>(first & 0x70));
+            received_ = 0;
+            payloadBuffer_.clear();
+            return std::nullopt;
+        }
+
+        void unmask(std::span<char> payload) const {
+            if (header_->maskingKey()) {
+                applyMask(payload, *header_->maskingKey(), received_);
+            }
+        }
+
+        template<class F>
+        void emit(F &onFrame, std::span<char> payload) {
+            const FrameHeader header = *header_;
+            header_.reset();
+            onFrame(header, payload);
+        }
+
+        Role role_;
+        std::size_t maxFrameSize_;
+        uint8_t allowedReserved_;
+        std::array<char, FrameHeader::MAX_SIZE> headerBuffer_{};
+        std::size_t headerSize_ = 0;
+        std::optional<FrameHeader> header_;
+        std::size_t received_ = 0;
+        std::vector<char> payloadBuffer_;
+    };
+
+    // Frames queued for one gathered write. Payloads are referenced rather than copied and must stay alive until the
+    // batch is encoded; a frame may be given as several pieces, which go on the wire as one payload without being
+    // joined. encode() lays the batch out as segments in wire order: frame headers, and small payloads, are written
+    // into one scratch buffer, while larger payloads are sent from where they are. A client has to mask its frames, so
+    // its payloads are copied masked into the scratch buffer and the whole batch ends up as a single segment.
+    struct SendBatch final {
+        static constexpr std::size_t COPY_THRESHOLD = 512;
+
+        explicit SendBatch(Role role) : role_(role) {}
+
+        void add(OpCode opCode, std::string_view payload, uint8_t reserved = 0) {
+            add(opCode, std::span<const std::string_view>{&payload, 1}, reserved);
+        }
+
+        void add(OpCode opCode, std::span<const std::string_view> pieces, uint8_t reserved = 0) {
+            std::size_t length = 0;
+            for (std::string_view piece : pieces) {
+                length += piece.size();
+            }
+            frames_.push_back(Frame{opCode, reserved, pieces_.size(), pieces.size(), length});
+            pieces_.insert(pieces_.end(), pieces.begin(), pieces.end());
+        }
+
+        // Segments to write, in order. They point into the scratch buffer and the queued payloads, and stay valid
+        // until the batch is changed.
+        [[nodiscard]] std::span<const std::string_view> encode() {
+            std::size_t scratchSize = 0;
+            for (const Frame &frame : frames_) {
+                scratchSize += FrameHeader{true, frame.opCode, frame.length, role_ == Role::Client ? std::optional{MaskingKey{}} : std::nullopt}.size();
+                for (std::string_view piece : pieces(frame)) {
+                    if (role_ == Role::Client || piece.size() <= COPY_THRESHOLD) {
+                        scratchSize += piece.size();
+                    }
+                }
+            }
+            // Sized up front so segments can point into it while it is filled.
+            scratch_.resize(scratchSize);
+            segments_.clear();
+            bytes_ = 0;
+
+            std::size_t used = 0;
+            auto write = [&](std::string_view bytes, bool copy, const std::optional<MaskingKey> &maskingKey, std::size_t offset) {
+                if (copy) {
+                    std::span<char> out{scratch_.data() + used, bytes.size()};
+                    if (maskingKey) {
+                        copyMasked(out, bytes, *maskingKey, offset);
+                    } else {
+                        std::copy(bytes.begin(), bytes.end(), out.begin());
+                    }
+                    bytes = {out.data(), out.size()};
+                    used += out.size();
+                }
+                if (!segments_.empty() && segments_.back().data() + segments_.back().size() == bytes.data()) {
+                    segments_.back() = {segments_.back().data(), segments_.back().size() + bytes.size()};
+                } else if (!bytes.empty()) {
+                    segments_.push_back(bytes);
+                }
+                bytes_ += bytes.size();
+            };
+
+            for (const Frame &frame : frames_) {
+                const FrameHeader frameHeader = header(frame);
+                std::span<char> out{scratch_.data() + used, frameHeader.size()};
+                frameHeader.encode(out);
+                write({out.data(), out.size()}, false, std::nullopt, 0);
+                used += out.size();
+
+                std::size_t offset = 0;
+                for (std::string_view piece : pieces(frame)) {
+                    write(piece, role_ == Role::Client || piece.size() <= COPY_THRESHOLD, frameHeader.maskingKey(), offset);
+                    offset += piece.size();
+                }
+            }
+            return segments_;
+        }
+
+        // Calls onFrame(OpCode, uint8_t reserved, std::span<const std::string_view> pieces) for every queued frame,
+        // for transports that have to frame each message themselves.
+        template<class F>
+        void forEach(F &&onFrame) const {
+            for (const Frame &frame : frames_) {
+                onFrame(frame.opCode, frame.reserved, pieces(frame));
+            }
+        }
+
+        // Wire size of the batch as of the last encode().
+        [[nodiscard]] std::size_t bytes() const {
+            return bytes_;
+        }
+
+        [[nodiscard]] std::size_t frames() const {
+            return frames_.size();
+        }
+
+        [[nodiscard]] bool empty() const {
+            return frames_.empty();
+        }
+
+        // Drops the queued frames and keeps the buffers for the next batch.
+        void clear() {
+            frames_.clear();
+            pieces_.clear();
+            segments_.clear();
+            bytes_ = 0;
+        }
+
+    private:
+        struct Frame {
+            OpCode opCode;
+            uint8_t reserved;
+            std::size_t firstPiece;
+            std::size_t pieceCount;
+            std::size_t length;
+        };
+
+        [[nodiscard]] std::span<const std::string_view> pieces(const Frame &frame) const {
+            return std::span<const std::string_view>{pieces_}.subspan(frame.firstPiece, frame.pieceCount);
+        }
+
+        FrameHeader header(const Frame &frame) {
+            std::optional<MaskingKey> maskingKey;
+            if (role_ == Role::Client) {
+                maskingKey = randomMaskingKey();
+            }
+            return FrameHeader{true, frame.opCode, frame.length, maskingKey, frame.reserved};
+        }
+
+        Role role_;
+        std::vector<Frame> frames_;
+        std::vector<std::string_view> pieces_;
+        std::vector<char> scratch_;
+        std::vector<std::string_view> segments_;
+        std::size_t bytes_ = 0;
+    };
+
+    // Round trip times in power-of-two microsecond buckets: bucket 0 counts times under 1us, and bucket i those from
+    // 2^(i-1)us up to 2^i us. Percentiles are the upper edge of their bucket, so they err high by less than 2x.
+    struct RttHistogram final {
+        static constexpr std::size_t BUCKETS = 32;
+
+        void record(std::chrono::nanoseconds rtt) {
+            const auto micros = static_cast<uint64_t>(std::max<std::chrono::microseconds::rep>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(rtt).count(), 0));
+            ++buckets_[std::min<std::size_t>(std::bit_width(micros), BUCKETS - 1)];
+            min_ = count_ == 0 ? rtt : std::min(min_, rtt);
+            max_ = std::max(max_, rtt);
+            total_ += rtt;
+            ++count_;
+        }
+
+        [[nodiscard]] uint64_t count() const {
+            return count_;
+        }
+
+        [[nodiscard]] std::chrono::nanoseconds min() const {
+            return min_;
+        }
+
+        [[nodiscard]] std::chrono::nanoseconds max() const {
+            return max_;
+        }
+
+        [[nodiscard]] std::chrono::nanoseconds mean() const {
+            return count_ == 0 ? std::chrono::nanoseconds{} : total_ / static_cast<std::chrono::nanoseconds::rep>(count_);
+        }
+
+        // The time that a fraction quantile of the samples were at or under, e.g. percentile(0.99).
+        [[nodiscard]] std::chrono::nanoseconds percentile(double quantile) const {
+            if (count_ == 0) {
+                return std::chrono::nanoseconds{};
+            }
+            const auto rank = static_cast<uint64_t>(std::clamp(quantile, 0.0, 1.0) * static_cast<double>(count_ - 1)) + 1;
+            uint64_t seen = 0;
+            for (std::size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+                seen += buckets_[bucket];
+                if (seen >= rank) {
+                    return std::clamp<std::chrono::nanoseconds>(std::chrono::microseconds{uint64_t{1} << bucket}, min_, max_);
+                }
+            }
+            return max_;
+        }
+
+        [[nodiscard]] std::span<const uint64_t, BUCKETS> buckets() const {
+            return buckets_;
+        }
+
+    private:
+        std::array<uint64_t, BUCKETS> buckets_{};
+        uint64_t count_ = 0;
+        std::chrono::nanoseconds min_{};
+        std::chrono::nanoseconds max_{};
+        std::chrono::nanoseconds total_{};
+    };
+
+    struct HeartbeatOptions final {
+        // How often to ping. Zero sends no pings.
+        std::chrono::milliseconds interval{0};
+        // Pings in a row that may go unanswered before the connection is declared dead.
+        uint32_t maxMissedPongs = 2;
+        // Answer the peer's pings with a pong carrying the same payload.
+        bool autoPong = true;
+    };
+
+    // Keep-alive bookkeeping for one connection, independent of the transport. Every ping carries an 8 byte sequence
+    // number, so the pong that echoes it gives the round trip time. A pong answers its ping and every earlier one, and
+    // pongs that match no outstanding ping, e.g. unsolicited ones, are ignored.
+    struct Heartbeat final {
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr std::size_t PAYLOAD_SIZE = 8;
+
+        explicit Heartbeat(HeartbeatOptions options = {}) : options_(options) {}
+
+        // Called once per interval. Gives the payload of the next ping, or the Failure that declares the connection
+        // dead once maxMissedPongs pings have gone unanswered.
+        [[nodiscard]] std::variant<Failure, std::string> ping(Clock::time_point now = Clock::now()) {
+            if (outstanding_.size() >= options_.maxMissedPongs) {
+                return Failure{"WebSocket missed " + std::to_string(outstanding_.size()) + " pongs", CloseCode::GoingAway};
+            }
+            const uint64_t sequence = ++sent_;
+            outstanding_.emplace_back(sequence, now);
+            std::string payload(PAYLOAD_SIZE, '\0');
+            for (std::size_t i = 0; i < PAYLOAD_SIZE; ++i) {
+                payload[i] = static_cast<char>(sequence >> (8 * (PAYLOAD_SIZE - 1 - i)));
+            }
+            return payload;
+        }
+
+        // Returns whether the pong answered one of our pings.
+        bool pong(std::string_view payload, Clock::time_point now = Clock::now()) {
+            if (payload.size() != PAYLOAD_SIZE) {
+                return false;
+            }
+            uint64_t sequence = 0;
+            for (char byte : payload) {
+                sequence = sequence << 8 | static_cast<uint8_t>(byte);
+            }
+            const auto answered = std::find_if(outstanding_.begin(), outstanding_.end(),
+                                               [sequence](const auto &ping) { return ping.first == sequence; });
+            if (answered == outstanding_.end()) {
+                return false;
+            }
+            rtt_.record(now - answered->second);
+            outstanding_.erase(outstanding_.begin(), answered + 1);
+            return true;
+        }
+
+        [[nodiscard]] const HeartbeatOptions &options() const {
+            return options_;
+        }
+
+        // Pings sent and not answered yet.
+        [[nodiscard]] std::size_t outstanding() const {
+            return outstanding_.size();
+        }
+
+        [[nodiscard]] uint64_t sent() const {
+            return sent_;
+        }
+
+        [[nodiscard]] const RttHistogram &rtt() const {
+            return rtt_;
+        }
+
+    private:
+        HeartbeatOptions options_;
+        std::deque<std::pair<uint64_t, Clock::time_point>> outstanding_;
+        uint64_t sent_ = 0;
+        RttHistogram rtt_;
+    };
+
+    // Bounded multi-producer, multi-consumer queue after Dmitry Vyukov's design. Every cell carries a sequence number
+    // that says whose turn it is, so producers and consumers only contend on their own position counter and never
+    // take a lock. The capacity is rounded up to a power of two.
+    template<class T>
+    struct BoundedQueue final {
+        explicit BoundedQueue(std::size_t capacity)
+                : cells_(std::bit_ceil(std::max<std::size_t>(capacity, 2)))
+                , mask_(cells_.size() - 1) {
+            for (std::size_t i = 0; i < cells_.size(); ++i) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue &) = delete;
+
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+        // False when the queue is full.
+        template<class U>
+        bool tryPush(U &&value) {
+            std::size_t position = tail_.load(std::memory_order_relaxed);
+            while (true) {
+                Cell &cell = cells_[position & mask_];
+                const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+                if (difference == 0) {
+                    if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell.value.emplace(std::forward<U>(value));
+                        cell.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Empty when the queue is.
+        std::optional<T> tryPop() {
+            std::size_t position = head_.load(std::memory_order_relaxed);
+            while (true) {
+                Cell &cell = cells_[position & mask_];
+                const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+                if (difference == 0) {
+                    if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        std::optional<T> value = std::move(cell.value);
+                        cell.value.reset();
+                        cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+                        return value;
+                    }
+                } else if (difference < 0) {
+                    return std::nullopt;
+                } else {
+                    position = head_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        [[nodiscard]] std::size_t capacity() const {
+            return cells_.size();
+        }
+
+    private:
+        struct Cell {
+            std::atomic<std::size_t> sequence;
+            std::optional<T> value;
+        };
+
+        std::vector<Cell> cells_;
+        const std::size_t mask_;
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> tail_ = 0;
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> head_ = 0;
+    };
+
+    // What a WorkerPool does when a worker's queue is full: make the receive thread wait, drop the oldest message
+    // waiting for that worker, or end the connection with 1008 (policy violation).
+    enum class Backpressure {
+        Block,
+        DropOldest,
+        Close
+    };
+
+    struct WorkerPoolOptions final {
+        std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        std::size_t capacity = 1024;
+        Backpressure backpressure = Backpressure::Block;
+        // Runs on the worker thread when a handler throws.
+        std::function<void(const Failure &)> onError = nullptr;
+    };
+
+    // Moves handling off the receive thread. Each handler from attach() is pinned to one worker, and each worker has its
+    // own BoundedQueue, so one connection's messages are handled in the order they arrived while different connections
+    // run on different cores. Messages are copied on the way in, as the views they come from only live for the call.
+    // Destroying the pool handles whatever is still queued before the workers stop.
+    struct WorkerPool final {
+        static constexpr int SPINS_BEFORE_SLEEP = 64;
+
+        explicit WorkerPool(WorkerPoolOptions options = {}) : options_(std::move(options)) {
+            for (std::size_t i = 0; i < std::max<std::size_t>(options_.threads, 1); ++i) {
+                workers_.push_back(std::make_unique<Worker>(options_.capacity));
+            }
+            for (const std::unique_ptr<Worker> &worker : workers_) {
+                worker->thread = std::thread{[this, worker = worker.get()] { run(*worker); }};
+            }
+        }
+
+        WorkerPool(const WorkerPool &) = delete;
+
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        ~WorkerPool() {
+            stopping_ = true;
+            for (const std::unique_ptr<Worker> &worker : workers_) {
+                worker->wake();
+            }
+            for (const std::unique_ptr<Worker> &worker : workers_) {
+                worker->thread.join();
+            }
+        }
+
+        // A FrameHandler for the receive thread that queues each message for delegate on the next worker in turn. The
+        // pool has to outlive it. Under Backpressure::Close a full queue throws FailureError.
+        std::unique_ptr<FrameHandler> attach(std::unique_ptr<FrameHandler> delegate) {
+            Worker &worker = *workers_[next_++ % workers_.size()];
+            return std::make_unique<QueueingFrameHandler>(*this, worker, std::make_shared<MessageHandler>(std::move(delegate)));
+        }
+
+        [[nodiscard]] std::size_t threads() const {
+            return workers_.size();
+        }
+
+        // Messages dropped under Backpressure::DropOldest, and refused under Backpressure::Close.
+        [[nodiscard]] std::size_t dropped() const {
+            return dropped_;
+        }
+
+    private:
+        struct Job {
+            std::shared_ptr<MessageHandler> messageHandler;
+            CompactMessage message;
+        };
+
+        struct Worker {
+            explicit Worker(std::size_t capacity) : queue(capacity) {}
+
+            void wake() {
+                pushed.fetch_add(1);
+                if (sleeping.load()) {
+                    pushed.notify_one();
+                }
+            }
+
+            BoundedQueue<Job> queue;
+            std::atomic<uint32_t> pushed = 0;
+            std::atomic<bool> sleeping = false;
+            std::thread thread;
+        };
+
+        struct QueueingFrameHandler final : FrameHandler {
+            QueueingFrameHandler(WorkerPool &pool, Worker &worker, std::shared_ptr<MessageHandler> messageHandler)
+                    : pool_(pool), worker_(worker), messageHandler_(std::move(messageHandler)) {}
+
+            void handlePing(const PingFrame &pingFrame) override { queue(OpCode::Ping, pingFrame.value()); }
+
+            void handlePong(const PongFrame &pongFrame) override { queue(OpCode::Pong, pongFrame.value()); }
+
+            void handleText(const TextFrame &textFrame) override { queue(OpCode::Text, textFrame.value()); }
+
+            void handleBinary(const BinaryFrame &binaryFrame) override {
+                queue(OpCode::Binary, {binaryFrame.value().data(), binaryFrame.value().size()});
+            }
+
+            void handleClose(const CloseFrame &closeFrame) override { queue(OpCode::Close, closeFrame.value()); }
+
+            void handleUndefined(const UndefinedFrame &) override { queue(CompactMessage::UNDEFINED, {}); }
+
+            void handlePingView(const PingFrameView &pingFrameView) override { queue(OpCode::Ping, pingFrameView.value()); }
+
+            void handlePongView(const PongFrameView &pongFrameView) override { queue(OpCode::Pong, pongFrameView.value()); }
+
+            void handleTextView(const TextFrameView &textFrameView) override { queue(OpCode::Text, textFrameView.value()); }
+
+            void handleBinaryView(const BinaryFrameView &binaryFrameView) override {
+                queue(OpCode::Binary, {reinterpret_cast<const char *>(binaryFrameView.value().data()), binaryFrameView.value().size()});
+            }
+
+            void handleCloseView(const CloseFrameView &closeFrameView) override { queue(OpCode::Close, closeFrameView.value()); }
+
+        private:
+            void queue(OpCode opCode, std::string_view payload) {
+                pool_.queue(worker_, Job{messageHandler_, CompactMessage{opCode, payload}});
+            }
+
+            WorkerPool &pool_;
+            Worker &worker_;
+            std::shared_ptr<MessageHandler> messageHandler_;
+        };
+
+        void queue(Worker &worker, Job job) {
+            while (!worker.queue.tryPush(std::move(job))) {
+                switch (options_.backpressure) {
+                    case Backpressure::Block:
+                        std::this_thread::yield();
+                        break;
+                    case Backpressure::DropOldest:
+                        if (worker.queue.tryPop()) {
+                            ++dropped_;
+                        }
+                        break;
+                    case Backpressure::Close:
+                        ++dropped_;
+                        throw FailureError{Failure{"WebSocket handler queue is full", CloseCode::PolicyViolation}};
+                }
+            }
+            worker.wake();
+        }
+
+        void run(Worker &worker) {
+            int idle = 0;
+            while (true) {
+                if (std::optional<Job> job = worker.queue.tryPop()) {
+                    handle(*job);
+                    idle = 0;
+                    continue;
+                }
+                // A busy receive thread refills the queue within microseconds, and sleeping costs a wake-up per message.
+                if (++idle < SPINS_BEFORE_SLEEP) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                idle = 0;
+                // Announce the sleep before reading the counter, so a producer either sees the flag and notifies, or
+                // pushed before the read and the queue is checked again below.
+                worker.sleeping = true;
+                const uint32_t pushed = worker.pushed.load();
+                if (std::optional<Job> job = worker.queue.tryPop()) {
+                    worker.sleeping = false;
+                    handle(*job);
+                    continue;
+                }
+                if (stopping_) {
+                    return;
+                }
+                worker.pushed.wait(pushed);
+                worker.sleeping = false;
+            }
+        }
+
+        void handle(Job &job) {
+            try {
+                job.messageHandler->handle(job.message.view());
+            } catch (const std::exception &e) {
+                if (options_.onError) {
+                    options_.onError(Failure{e.what(), CloseCode::InternalError});
+                }
+            }
+        }
+
+        const WorkerPoolOptions options_;
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::atomic<std::size_t> next_ = 0;
+        std::atomic<std::size_t> dropped_ = 0;
+        std::atomic<bool> stopping_ = false;
+    };
+
+    struct ReconnectOptions final {
+        // The delay before the first retry. Every further failure in a row multiplies it by multiplier, up to maxDelay.
+        std::chrono::steady_clock::duration initialDelay = std::chrono::milliseconds{100};
+        std::chrono::steady_clock::duration maxDelay = std::chrono::seconds{30};
+        double multiplier = 2.0;
+        // The random share of each delay: 1 waits anywhere from zero up to the delay, 0 waits exactly the delay.
+        double jitter = 1.0;
+        // Failures in a row after which to give up. Zero never gives up.
+        uint32_t maxAttempts = 0;
+        // An attempt that stayed up this long before failing counts as a success, so the backoff starts over.
+        std::chrono::steady_clock::duration resetAfter = std::chrono::minutes{1};
+    };
+
+    // Paces reconnects with exponential backoff and jitter, so that clients cut off by the same restart do not all
+    // come back in the same instant. Not thread safe; each Workflow has its own.
+    struct ReconnectPolicy final {
+        using Clock = std::chrono::steady_clock;
+
+        explicit ReconnectPolicy(ReconnectOptions options = {}) : ReconnectPolicy(options, std::random_device{}()) {}
+
+        ReconnectPolicy(ReconnectOptions options, uint64_t seed) : options_(options), random_(seed) {}
+
+        // Called after an attempt that failed once it had been up for uptime. Gives the delay before the next
+        // attempt, or std::nullopt once maxAttempts attempts in a row have failed.
+        [[nodiscard]] std::optional<Clock::duration> next(Clock::duration uptime = Clock::duration::zero()) {
+            if (uptime >= options_.resetAfter) {
+                failures_ = 0;
+            }
+            ++failures_;
+            if (options_.maxAttempts != 0 && failures_ >= options_.maxAttempts) {
+                return std::nullopt;
+            }
+            const double backoff = std::min(static_cast<double>(options_.maxDelay.count()),
+                                            static_cast<double>(options_.initialDelay.count()) *
+                                            std::pow(options_.multiplier, static_cast<double>(failures_ - 1)));
+            const double jitter = std::clamp(options_.jitter, 0.0, 1.0) * std::uniform_real_distribution<double>{}(random_);
+            return Clock::duration{static_cast<Clock::duration::rep>(backoff * (1.0 - jitter))};
+        }
+
+        // Forgets the failures so far, e.g. once a session has opened.
+        void reset() {
+            failures_ = 0;
+        }
+
+        [[nodiscard]] uint32_t failures() const {
+            return failures_;
+        }
+
+        [[nodiscard]] const ReconnectOptions &options() const {
+            return options_;
+        }
+
+    private:
+        ReconnectOptions options_;
+        std::mt19937_64 random_;
+        uint32_t failures_ = 0;
+    };
+
+    struct WorkflowResult final {
+        explicit WorkflowResult(const std::monostate &unit) : value_(unit) {}
+
+        explicit WorkflowResult(Failure f) : value_(std::move(f)) {}
+
+        explicit WorkflowResult(std::variant<Failure, std::monostate> value) : value_(std::move(value)) {}
+
+        [[nodiscard]] const std::variant<Failure, std::monostate> &value() const {
+            return value_;
+        }
+
+        [[nodiscard]] bool complete() const {
+            return std::holds_alternative<std::monostate>(value_);
+        }
+
+        template<class R>
+        [[nodiscard]] R
+        match(const std::function<R(const Failure &a)> aFn, const std::function<R(const std::monostate &unit)> uFn) {
+            return std::visit(visitor{
+                    [&aFn](const Failure &a) { return aFn(a); },
+                    [&uFn](const std::monostate &u) { return uFn(u); }
+            }, value_);
+        }
+
+    private:
+        std::variant<Failure, std::monostate> value_;
+    };
+
+    // Runs runFn until it completes, sleeping for the reconnectPolicy's delay after each failure. Without a policy it
+    // retries straight away. A Metered policy M counts the reconnects.
+    template<MetricsPolicy M = NoMetrics>
+    struct BasicWorkflow final {
+        explicit BasicWorkflow(std::function<WorkflowResult()> runFn,
+                               std::function<void(const std::monostate &)> successFn,
+                               std::function<void(const Failure &)> recoveryFn,
+                               ReconnectPolicy reconnectPolicy = ReconnectPolicy{{.initialDelay = {}, .maxDelay = {}}},
+                               M metrics = {})
+                : runFn_(std::move(runFn))
+                , successFn_(std::move(successFn))
+                , recoveryFn_(std::move(recoveryFn))
+                , reconnectPolicy_(std::move(reconnectPolicy))
+                , metrics_(std::move(metrics))
+        { }
+
+        // Returns the completed result, or the last failure once the policy's attempt budget is spent.
+        WorkflowResult runUntilCancelled() {
+            while (true) {
+                const ReconnectPolicy::Clock::time_point started = ReconnectPolicy::Clock::now();
+                WorkflowResult workflowResult = runFn_();
+                workflowResult.template match<void>(recoveryFn_, successFn_);
+                if (workflowResult.complete()) {
+                    return workflowResult;
+                }
+
+                const std::optional<ReconnectPolicy::Clock::duration> delay = reconnectPolicy_.next(ReconnectPolicy::Clock::now() - started);
+                if (!delay) {
+                    return workflowResult;
+                }
+                if (*delay > ReconnectPolicy::Clock::duration::zero()) {
+                    std::this_thread::sleep_for(*delay);
+                }
+                metrics_.reconnected();
+            }
+        }
+
+    private:
+        const std::function<WorkflowResult()> runFn_;
+        const std::function<void(const std::monostate &)> successFn_;
+        const std::function<void(const Failure &)> recoveryFn_;
+        ReconnectPolicy reconnectPolicy_;
+        [[no_unique_address]] M metrics_;
+    };
+
+    using Workflow = BasicWorkflow<>;
+
+
+    struct ExecutionContext final {
+        ExecutionContext(std::string host, uint16_t port, std::string uri)
+                : host_(std::move(host)), port_(port), uri_(std::move(uri)) {}
+
+        [[nodiscard]] const std::string &host() const {
+            return host_;
+        }
+
+        [[nodiscard]] uint16_t port() const {
+            return port_;
+        }
+
+        [[nodiscard]] const std::string &uri() const {
+            return uri_;
+        }
+
+        auto operator<=>(const ExecutionContext &) const = default;
+
+    private:
+        std::string host_;
+        uint16_t port_;
+        std::string uri_;
+    };
+
+    // Both sides of the RFC 6455 opening handshake, for transports that do not come with one.
+    namespace Handshake {
+        constexpr std::string_view GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+        inline std::array<uint8_t, 20> sha1(std::string_view input) {
+            uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+            std::string message{input};
+            message.push_back('\x80');
+            while (message.size() % 64 != 56) {
+                message.push_back('\0');
+            }
+            const uint64_t bits = static_cast<uint64_t>(input.size()) * 8;
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                message.push_back(static_cast<char>(bits >> shift));
+            }
+
+            for (std::size_t chunk = 0; chunk < message.size(); chunk += 64) {
+                uint32_t words[80];
+                for (std::size_t i = 0; i < 16; ++i) {
+                    const auto *bytes = reinterpret_cast<const uint8_t *>(message.data() + chunk + i * 4);
+                    words[i] = static_cast<uint32_t>(bytes[0]) << 24 | static_cast<uint32_t>(bytes[1]) << 16 |
+                               static_cast<uint32_t>(bytes[2]) << 8 | bytes[3];
+                }
+                for (std::size_t i = 16; i < 80; ++i) {
+                    words[i] = std::rotl(words[i - 3] ^ words[i - 8] ^ words[i - 14] ^ words[i - 16], 1);
+                }
+
+                uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+                for (std::size_t i = 0; i < 80; ++i) {
+                    uint32_t f;
+                    uint32_t k;
+                    if (i < 20) {
+                        f = (b & c) | (~b & d);
+                        k = 0x5A827999;
+                    } else if (i < 40) {
+                        f = b ^ c ^ d;
+                        k = 0x6ED9EBA1;
+                    } else if (i < 60) {
+                        f = (b & c) | (b & d) | (c & d);
+                        k = 0x8F1BBCDC;
+                    } else {
+                        f = b ^ c ^ d;
+                        k = 0xCA62C1D6;
+                    }
+                    const uint32_t temp = std::rotl(a, 5) + f + e + k + words[i];
+                    e = d;
+                    d = c;
+                    c = std::rotl(b, 30);
+                    b = a;
+                    a = temp;
+                }
+                state[0] += a;
+                state[1] += b;
+                state[2] += c;
+                state[3] += d;
+                state[4] += e;
+            }
+
+            std::array<uint8_t, 20> digest{};
+            for (std::size_t i = 0; i < 20; ++i) {
+                digest[i] = static_cast<uint8_t>(state[i / 4] >> (24 - (i % 4) * 8));
+            }
+            return digest;
+        }
+
+        inline std::string base64(std::span<const uint8_t> input) {
+            constexpr std::string_view ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string encoded;
+            encoded.reserve((input.size() + 2) / 3 * 4);
+            for (std::size_t i = 0; i < input.size(); i += 3) {
+                const std::size_t remaining = input.size() - i;
+                const uint32_t group = static_cast<uint32_t>(input[i]) << 16 |
+                                       (remaining > 1 ? static_cast<uint32_t>(input[i + 1]) << 8 : 0) |
+                                       (remaining > 2 ? input[i + 2] : 0);
+                encoded.push_back(ALPHABET[group >> 18 & 0x3F]);
+                encoded.push_back(ALPHABET[group >> 12 & 0x3F]);
+                encoded.push_back(remaining > 1 ? ALPHABET[group >> 6 & 0x3F] : '=');
+                encoded.push_back(remaining > 2 ? ALPHABET[group & 0x3F] : '=');
+            }
+            return encoded;
+        }
+
+        // A fresh Sec-WebSocket-Key: 16 random bytes, base64 encoded.
+        inline std::string key() {
+            std::array<uint8_t, 16> nonce{};
+            randomBytes(std::span<char>{reinterpret_cast<char *>(nonce.data()), nonce.size()});
+            return base64(nonce);
+        }
+
+        // The Sec-WebSocket-Accept a server must answer key with.
+        inline std::string accept(std::string_view key) {
+            const std::array<uint8_t, 20> digest = sha1(std::string{key} + std::string{GUID});
+            return base64(digest);
+        }
+
+        inline std::string request(const ExecutionContext &executionContext, std::string_view key) {
+            return "GET " + executionContext.uri() + " HTTP/1.1\r\n"
+                   "Host: " + executionContext.host() + ":" + std::to_string(executionContext.port()) + "\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: " + std::string{key} + "\r\n"
+                   "Sec-WebSocket-Version: 13\r\n\r\n";
+        }
+
+        // Checks a complete response head, up to and including the blank line, against the key that was sent.
+        inline std::optional<Failure> validate(std::string_view response, std::string_view key) {
+            auto lower = [](std::string_view value) {
+                std::string lowered{value};
+                std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                return lowered;
+            };
+            auto trim = [](std::string_view value) {
+                const std::size_t begin = value.find_first_not_of(" \t");
+                return begin == std::string_view::npos ? std::string_view{} : value.substr(begin, value.find_last_not_of(" \t") - begin + 1);
+            };
+
+            std::size_t end = response.find("\r\n");
+            const std::string_view status = response.substr(0, end);
+            if (!status.starts_with("HTTP/1.1 101")) {
+                return Failure{"WebSocket upgrade refused: " + std::string{status}};
+            }
+
+            bool upgrade = false;
+            bool connection = false;
+            bool accepted = false;
+            while (end != std::string_view::npos && end + 2 < response.size()) {
+                const std::size_t begin = end + 2;
+                end = response.find("\r\n", begin);
+                const std::string_view line = response.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+                const std::size_t colon = line.find(':');
+                if (colon == std::string_view::npos) {
+                    continue;
+                }
+                const std::string name = lower(trim(line.substr(0, colon)));
+                const std::string_view value = trim(line.substr(colon + 1));
+                if (name == "upgrade") {
+                    upgrade = lower(value) == "websocket";
+                } else if (name == "connection") {
+                    connection = lower(value).find("upgrade") != std::string::npos;
+                } else if (name == "sec-websocket-accept") {
+                    accepted = value == accept(key);
+                } else if (name == "sec-websocket-extensions") {
+                    return Failure{"WebSocket server selected an extension that was not offered"};
+                }
+            }
+            if (!upgrade || !connection) {
+                return Failure{"WebSocket upgrade response is missing Upgrade or Connection"};
+            }
+            if (!accepted) {
+                return Failure{"WebSocket server answered with the wrong Sec-WebSocket-Accept"};
+            }
+            return std::nullopt;
+        }
+
+        // What a server needs from a client's upgrade request.
+        struct Upgrade final {
+            std::string uri;
+            std::string key;
+            // The Host header, if the client sent one.
+            std::string host;
+        };
+
+        // Checks a complete request head, up to and including the blank line, for a valid version 13 upgrade.
+        inline std::variant<Failure, Upgrade> parseRequest(std::string_view request) {
+            auto lower = [](std::string_view value) {
+                std::string lowered{value};
+                std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                return lowered;
+            };
+            auto trim = [](std::string_view value) {
+                const std::size_t begin = value.find_first_not_of(" \t");
+                return begin == std::string_view::npos ? std::string_view{} : value.substr(begin, value.find_last_not_of(" \t") - begin + 1);
+            };
+
+            std::size_t end = request.find("\r\n");
+            const std::string_view requestLine = request.substr(0, end);
+            const std::size_t target = requestLine.find(' ');
+            const std::size_t version = requestLine.rfind(' ');
+            if (!requestLine.starts_with("GET ") || version == target || requestLine.substr(version + 1) != "HTTP/1.1") {
+                return Failure{"WebSocket upgrade request is not an HTTP/1.1 GET: " + std::string{requestLine}};
+            }
+
+            Upgrade upgrade{std::string{requestLine.substr(target + 1, version - target - 1)}, {}, {}};
+            bool upgradeHeader = false;
+            bool connection = false;
+            bool version13 = false;
+            while (end != std::string_view::npos && end + 2 < request.size()) {
+                const std::size_t begin = end + 2;
+                end = request.find("\r\n", begin);
+                const std::string_view line = request.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+                const std::size_t colon = line.find(':');
+                if (colon == std::string_view::npos) {
+                    continue;
+                }
+                const std::string name = lower(trim(line.substr(0, colon)));
+                const std::string_view value = trim(line.substr(colon + 1));
+                if (name == "upgrade") {
+                    upgradeHeader = lower(value) == "websocket";
+                } else if (name == "connection") {
+                    connection = lower(value).find("upgrade") != std::string::npos;
+                } else if (name == "sec-websocket-key") {
+                    upgrade.key = value;
+                } else if (name == "sec-websocket-version") {
+                    version13 = value == "13";
+                } else if (name == "host") {
+                    upgrade.host = value;
+                }
+            }
+            if (!upgradeHeader || !connection) {
+                return Failure{"WebSocket upgrade request is missing Upgrade or Connection"};
+            }
+            if (upgrade.key.empty()) {
+                return Failure{"WebSocket upgrade request has no Sec-WebSocket-Key"};
+            }
+            if (!version13) {
+                return Failure{"WebSocket upgrade request is not for version 13"};
+            }
+            return upgrade;
+        }
+
+        // The 101 response that accepts an upgrade sent with key.
+        inline std::string response(std::string_view key) {
+            return "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: " + accept(key) + "\r\n\r\n";
+        }
+
+        // A response that turns the upgrade down, e.g. refusal("400 Bad Request"), after which the server closes the
+        // connection.
+        inline std::string refusal(std::string_view status) {
+            return "HTTP/1.1 " + std::string{status} + "\r\n"
+                   "Connection: close\r\n"
+                   "Sec-WebSocket-Version: 13\r\n"
+                   "Content-Length: 0\r\n\r\n";
+        }
+    }
+}
+
+#if __has_include(<sys/mman.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace SimpleWebSocket {
+    // The capture file format. A file starts with a FileHeader, followed by one record per message: a RecordHeader,
+    // the payload, and zero padding up to the next multiple of 8 bytes. Integers are in the writer's byte order, which
+    // FileHeader::byteOrder tells apart. A record cut short by a crash ends the capture.
+    namespace CaptureFormat {
+        constexpr std::array<char, 8> MAGIC{'S', 'W', 'S', 'C', 'A', 'P', '0', '1'};
+        constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+        struct FileHeader {
+            std::array<char, 8> magic;
+            uint32_t byteOrder;
+            uint32_t reserved;
+        };
+
+        struct RecordHeader {
+            // Nanoseconds since the Unix epoch.
+            int64_t timestamp;
+            uint32_t length;
+            uint8_t opCode;
+            std::array<uint8_t, 3> reserved;
+        };
+
+        static_assert(sizeof(FileHeader) == 16 && sizeof(RecordHeader) == 16);
+
+        constexpr std::size_t padded(std::size_t size) {
+            return (size + 7) & ~std::size_t{7};
+        }
+
+        // The op code a message was sent with. UndefinedFrame has none, and is recorded as reserved op code 0x3.
+        inline OpCode opCode(const MessageView &messageView) {
+            constexpr std::array<OpCode, 6> opCodes{OpCode::Ping, OpCode::Pong, OpCode::Text, OpCode::Binary, OpCode::Close,
+                                                    static_cast<OpCode>(0x3)};
+            return opCodes[messageView.value().index()];
+        }
+    }
+
+    // Appends messages to a capture file, which Capture maps back in. Thread safe. Records are buffered, and reach the
+    // file on flush(), when the buffer fills, and on destruction.
+    struct CaptureWriter final {
+        using Clock = std::chrono::system_clock;
+
+        static constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+
+        // The longest payload a record can hold.
+        static constexpr std::size_t MAX_PAYLOAD = std::numeric_limits<uint32_t>::max();
+
+        // Creates the file, or appends to a capture that is already there. A record cut short at the end of an
+        // existing capture, e.g. by a crash, is truncated away first, so that new records line up.
+        static std::variant<Failure, std::shared_ptr<CaptureWriter>> open(const std::string &path) {
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                return Failure{"WebSocket capture " + path + " could not be opened: " + std::strerror(errno)};
+            }
+            auto writer = std::shared_ptr<CaptureWriter>(new CaptureWriter(fd));
+
+            struct ::stat status{};
+            ::fstat(fd, &status);
+            if (status.st_size == 0) {
+                const CaptureFormat::FileHeader header{CaptureFormat::MAGIC, CaptureFormat::BYTE_ORDER_MARK, 0};
+                if (::write(fd, &header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+                    return Failure{"WebSocket capture " + path + " could not be written: " + std::strerror(errno)};
+                }
+                writer->size_ = sizeof(header);
+                return writer;
+            }
+
+            CaptureFormat::FileHeader header{};
+            const int reader = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            const bool valid = reader >= 0 && ::read(reader, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+                               header.magic == CaptureFormat::MAGIC && header.byteOrder == CaptureFormat::BYTE_ORDER_MARK;
+            if (valid) {
+                writer->size_ = wholeRecords(reader, static_cast<std::size_t>(status.st_size));
+            }
+            if (reader >= 0) {
+                ::close(reader);
+            }
+            if (!valid) {
+                return Failure{"WebSocket capture " + path + " is not a capture in this byte order"};
+            }
+            if (writer->size_ < static_cast<std::size_t>(status.st_size) && ::ftruncate(fd, static_cast<::off_t>(writer->size_)) != 0) {
+                return Failure{"WebSocket capture " + path + " could not be truncated: " + std::strerror(errno)};
+            }
+            return writer;
+        }
+
+        CaptureWriter(const CaptureWriter &) = delete;
+
+        CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+        ~CaptureWriter() {
+            flush();
+            ::close(fd_);
+        }
+
+        // Gives the Failure if the record was not kept: its payload is over MAX_PAYLOAD, or it filled the buffer and
+        // the write that followed failed.
+        std::optional<Failure> record(const MessageView &messageView, Clock::time_point timestamp = Clock::now()) {
+            std::string_view payload = std::visit(visitor{
+                    [](const BinaryFrameView &binaryFrameView) {
+                        return std::string_view{reinterpret_cast<const char *>(binaryFrameView.value().data()), binaryFrameView.value().size()};
+                    },
+                    [](const UndefinedFrame &) { return std::string_view{}; },
+                    [](const auto &frameView) { return std::string_view{frameView.value()}; },
+            }, messageView.value());
+            return record(CaptureFormat::opCode(messageView), payload, timestamp);
+        }
+
+        std::optional<Failure> record(OpCode opCode, std::string_view payload, Clock::time_point timestamp = Clock::now()) {
+            if (payload.size() > MAX_PAYLOAD) {
+                return Failure{"WebSocket capture record of " + std::to_string(payload.size()) + " bytes is over the limit", CloseCode::MessageTooBig};
+            }
+            const CaptureFormat::RecordHeader header{
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp.time_since_epoch()).count(),
+                    static_cast<uint32_t>(payload.size()), static_cast<uint8_t>(opCode), {}};
+            std::lock_guard lock{mutex_};
+            buffer_.append(reinterpret_cast<const char *>(&header), sizeof(header));
+            buffer_.append(payload);
+            buffer_.append(CaptureFormat::padded(payload.size()) - payload.size(), '\0');
+            ++records_;
+            ++buffered_;
+            if (buffer_.size() >= BUFFER_SIZE) {
+                return write();
+            }
+            return std::nullopt;
+        }
+
+        // Gives the Failure if the buffered records could not be written.
+        std::optional<Failure> flush() {
+            std::lock_guard lock{mutex_};
+            return write();
+        }
+
+        // Records written, or still buffered, since open.
+        [[nodiscard]] uint64_t records() const {
+            std::lock_guard lock{mutex_};
+            return records_;
+        }
+
+        // Records lost to failed writes, which records() no longer counts.
+        [[nodiscard]] uint64_t dropped() const {
+            std::lock_guard lock{mutex_};
+            return dropped_;
+        }
+
+    private:
+        explicit CaptureWriter(int fd) : fd_(fd) {
+            buffer_.reserve(BUFFER_SIZE);
+        }
+
+        // The size of the records in a capture of size bytes that are there in full.
+        static std::size_t wholeRecords(int reader, std::size_t size) {
+            std::size_t offset = sizeof(CaptureFormat::FileHeader);
+            CaptureFormat::RecordHeader header{};
+            while (offset + sizeof(header) <= size &&
+                   ::pread(reader, &header, sizeof(header), static_cast<::off_t>(offset)) == static_cast<ssize_t>(sizeof(header)) &&
+                   offset + sizeof(header) + CaptureFormat::padded(header.length) <= size) {
+                offset += sizeof(header) + CaptureFormat::padded(header.length);
+            }
+            return offset;
+        }
+
+        // Called with the mutex held. After a failed or short write the file is cut back to the last whole record and
+        // the buffered records are dropped, rather than left to grow, so the records written after them still line up.
+        std::optional<Failure> write() {
+            std::size_t written = 0;
+            int error = 0;
+            while (written < buffer_.size()) {
+                const ssize_t result = ::write(fd_, buffer_.data() + written, buffer_.size() - written);
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (result <= 0) {
+                    error = result < 0 ? errno : ENOSPC;
+                    break;
+                }
+                written += static_cast<std::size_t>(result);
+            }
+            buffer_.clear();
+            if (error == 0) {
+                size_ += written;
+                buffered_ = 0;
+                return std::nullopt;
+            }
+
+            if (written > 0) {
+                static_cast<void>(::ftruncate(fd_, static_cast<::off_t>(size_)));
+            }
+            records_ -= buffered_;
+            dropped_ += buffered_;
+            buffered_ = 0;
+            return Failure{std::string{"WebSocket capture could not be written: "} + std::strerror(error)};
+        }
+
+        int fd_;
+        mutable std::mutex mutex_;
+        std::string buffer_;
+        // Bytes of whole records in the file.
+        std::size_t size_ = 0;
+        uint64_t records_ = 0;
+        uint64_t buffered_ = 0;
+        uint64_t dropped_ = 0;
+    };
+
+    // A capture file mapped into memory. The payloads of its records are views into the mapping, so reading and
+    // replaying a capture copies nothing.
+    struct Capture final {
+        using Clock = CaptureWriter::Clock;
+
+        struct Record {
+            OpCode opCode;
+            Clock::time_point timestamp;
+            std::string_view payload;
+
+            [[nodiscard]] MessageView view() const {
+                return frameView(opCode, payload);
+            }
+        };
+
+        struct Iterator {
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = Record;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const Record *;
+            using reference = Record;
+
+            Record operator*() const {
+                CaptureFormat::RecordHeader header{};
+                std::memcpy(&header, position, sizeof(header));
+                return Record{static_cast<OpCode>(header.opCode),
+                              Clock::time_point{std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds{header.timestamp})},
+                              std::string_view{position + sizeof(header), header.length}};
+            }
+
+            Iterator &operator++() {
+                uint32_t length = 0;
+                std::memcpy(&length, position + offsetof(CaptureFormat::RecordHeader, length), sizeof(length));
+                position += sizeof(CaptureFormat::RecordHeader) + CaptureFormat::padded(length);
+                return *this;
+            }
+
+            Iterator operator++(int) {
+                Iterator previous = *this;
+                ++*this;
+                return previous;
+            }
+
+            bool operator==(const Iterator &) const = default;
+
+            const char *position;
+        };
+
+        static std::variant<Failure, Capture> open(const std::string &path) {
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return Failure{"WebSocket capture " + path + " could not be opened: " + std::strerror(errno)};
+            }
+            struct ::stat status{};
+            ::fstat(fd, &status);
+            const auto size = static_cast<std::size_t>(status.st_size);
+            if (size < sizeof(CaptureFormat::FileHeader)) {
+                ::close(fd);
+                return Failure{"WebSocket capture " + path + " has no header"};
+            }
+            void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED) {
+                return Failure{"WebSocket capture " + path + " could not be mapped: " + std::strerror(errno)};
+            }
+
+            Capture capture{static_cast<const char *>(mapped), size};
+            CaptureFormat::FileHeader header{};
+            std::memcpy(&header, capture.data_, sizeof(header));
+            if (header.magic != CaptureFormat::MAGIC || header.byteOrder != CaptureFormat::BYTE_ORDER_MARK) {
+                return Failure{"WebSocket capture " + path + " is not a capture in this byte order"};
+            }
+            capture.index();
+            ::madvise(const_cast<char *>(capture.data_), size, MADV_SEQUENTIAL);
+            return capture;
+        }
+
+        Capture(Capture &&other) noexcept
+                : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)), end_(other.end_), records_(other.records_) {}
+
+        Capture &operator=(Capture &&other) noexcept {
+            if (this != &other) {
+                unmap();
+                data_ = std::exchange(other.data_, nullptr);
+                size_ = std::exchange(other.size_, 0);
+                end_ = other.end_;
+                records_ = other.records_;
+            }
+            return *this;
+        }
+
+        ~Capture() {
+            unmap();
+        }
+
+        [[nodiscard]] Iterator begin() const {
+            return Iterator{data_ + sizeof(CaptureFormat::FileHeader)};
+        }
+
+        [[nodiscard]] Iterator end() const {
+            return Iterator{data_ + end_};
+        }
+
+        // Complete records, leaving out one cut short at the end of the file.
+        [[nodiscard]] std::size_t size() const {
+            return records_;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return records_ == 0;
+        }
+
+    private:
+        Capture(const char *data, std::size_t size) : data_(data), size_(size) {}
+
+        // Finds where the last complete record ends.
+        void index() {
+            std::size_t position = sizeof(CaptureFormat::FileHeader);
+            while (position + sizeof(CaptureFormat::RecordHeader) <= size_) {
+                uint32_t length = 0;
+                std::memcpy(&length, data_ + position + offsetof(CaptureFormat::RecordHeader, length), sizeof(length));
+                if (CaptureFormat::padded(length) > size_ - position - sizeof(CaptureFormat::RecordHeader)) {
+                    break;
+                }
+                position += sizeof(CaptureFormat::RecordHeader) + CaptureFormat::padded(length);
+                ++records_;
+            }
+            end_ = position;
+        }
+
+        void unmap() {
+            if (data_ != nullptr) {
+                ::munmap(const_cast<char *>(data_), size_);
+                data_ = nullptr;
+            }
+        }
+
+        const char *data_;
+        std::size_t size_;
+        std::size_t end_ = 0;
+        std::size_t records_ = 0;
+    };
+
+    struct ReplayOptions final {
+        // How many times faster than recorded to replay: 2 halves every gap between messages. Zero replays as fast as
+        // possible.
+        double speed = 1.0;
+    };
+
+    // Calls f with a MessageView of each record in turn, on the calling thread. Returns the number of messages.
+    template<class F> requires std::invocable<F &, const MessageView &>
+    std::size_t replay(const Capture &capture, F &&f, ReplayOptions options = {}) {
+        const auto started = std::chrono::steady_clock::now();
+        std::optional<Capture::Clock::time_point> first;
+        std::size_t replayed = 0;
+        for (const Capture::Record record : capture) {
+            if (options.speed > 0) {
+                if (!first) {
+                    first = record.timestamp;
+                }
+                const std::chrono::duration<double, std::nano> offset = (record.timestamp - *first) / options.speed;
+                std::this_thread::sleep_until(started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset));
+            }
+            f(record.view());
+            ++replayed;
+        }
+        return replayed;
+    }
+
+    template<MetricsPolicy M>
+    std::size_t replay(const Capture &capture, BasicMessageHandler<M> &messageHandler, ReplayOptions options = {}) {
+        return replay(capture, [&messageHandler](const MessageView &messageView) { messageHandler.handle(messageView); }, options);
+    }
+
+    // onParsed gets what the parser returned for each message.
+    template<class A, class F> requires std::invocable<F &, A>
+    std::size_t replay(const Capture &capture, MessageParser<A> &messageParser, F &&onParsed, ReplayOptions options = {}) {
+        return replay(capture, [&](const MessageView &messageView) { onParsed(messageParser.parse(messageView)); }, options);
+    }
+}
+#endif
+
+#if __has_include(<sys/epoll.h>)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <system_error>
+#include <tuple>
+#include <unordered_map>
+
+namespace SimpleWebSocket {
+    // A lazily started coroutine producing a T. Awaiting it runs it to completion and returns its result, or rethrows
+    // what escaped it. Start a Task<> that nothing awaits with EventLoop::spawn or Reactor::spawn.
+    template<class T = void>
+    struct Task;
+
+    struct TaskPromiseBase {
+        struct FinalAwaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            template<class Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                return handle.promise().continuation;
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr exception;
+    };
+
+    template<class T>
+    struct TaskPromise final : TaskPromiseBase {
+        Task<T> get_return_object();
+
+        template<class U>
+        void return_value(U &&value) {
+            result.emplace(std::forward<U>(value));
+        }
+
+        T take() {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+            return std::move(*result);
+        }
+
+        std::optional<T> result;
+    };
+
+    template<>
+    struct TaskPromise<void> final : TaskPromiseBase {
+        Task<void> get_return_object();
+
+        void return_void() {}
+
+        void take() {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+
+    template<class T>
+    struct [[nodiscard]] Task final {
+        using promise_type = TaskPromise<T>;
+
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+        Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+        Task &operator=(Task &&other) noexcept {
+            if (this != &other) {
+                if (handle_) {
+                    handle_.destroy();
+                }
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+            return *this;
+        }
+
+        ~Task() {
+            if (handle_) {
+                handle_.destroy();
+            }
+        }
+
+        auto operator co_await() noexcept {
+            struct Awaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+                    handle.promise().continuation = continuation;
+                    return handle;
+                }
+
+                T await_resume() {
+                    return handle.promise().take();
+                }
+
+                std::coroutine_handle<promise_type> handle;
+            };
+            return Awaiter{handle_};
+        }
+
+    private:
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    template<class T>
+    Task<T> TaskPromise<T>::get_return_object() {
+        return Task<T>{std::coroutine_handle<TaskPromise<T>>::from_promise(*this)};
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object() {
+        return Task<void>{std::coroutine_handle<TaskPromise<void>>::from_promise(*this)};
+    }
+
+    // One epoll instance run by one thread. Callbacks for watched file descriptors run on the loop thread, and other
+    // threads hand it work with post() and after(). watch, modify and unwatch may only be called on the loop thread.
+    struct EventLoop final {
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr std::size_t READ_BUFFER_SIZE = 256 * 1024;
+
+        EventLoop()
+                : epoll_(::epoll_create1(EPOLL_CLOEXEC))
+                , wake_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+                , readBuffer_(READ_BUFFER_SIZE) {
+            if (epoll_ < 0 || wake_ < 0) {
+                throw std::system_error(errno, std::generic_category(), "SimpleWebSocket::EventLoop");
+            }
+            ::epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            ::epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &event);
+        }
+
+        EventLoop(const EventLoop &) = delete;
+
+        EventLoop &operator=(const EventLoop &) = delete;
+
+        ~EventLoop() {
+            clear();
+            ::close(wake_);
+            ::close(epoll_);
+        }
+
+        // Runs callbacks, posted tasks and timers until stop() is called.
+        void run() {
+            thread_ = std::this_thread::get_id();
+            current_ = this;
+            std::array<::epoll_event, 128> events{};
+            while (running_) {
+                const int ready = ::epoll_wait(epoll_, events.data(), static_cast<int>(events.size()), timeout());
+                if (ready < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+                }
+                for (int i = 0; i < ready; ++i) {
+                    if (events[i].data.ptr == nullptr) {
+                        runPosted();
+                        continue;
+                    }
+                    auto *watcher = static_cast<Watcher *>(events[i].data.ptr);
+                    if (watcher->active) {
+                        watcher->callback(events[i].events);
+                    }
+                }
+                retired_.clear();
+                runTimers();
+            }
+            current_ = nullptr;
+        }
+
+        void stop() {
+            post([this] { running_ = false; });
+        }
+
+        // Thread safe. Runs task on the loop thread.
+        void post(std::function<void()> task) {
+            {
+                std::lock_guard lock{mutex_};
+                posted_.push_back(std::move(task));
+            }
+            const uint64_t one = 1;
+            const ssize_t written = ::write(wake_, &one, sizeof(one));
+            (void) written;
+        }
+
+        // Thread safe. Runs task on the loop thread once delay has passed, to the millisecond.
+        void after(Clock::duration delay, std::function<void()> task) {
+            const Clock::time_point deadline = Clock::now() + delay;
+            if (inLoopThread()) {
+                schedule(deadline, std::move(task));
+            } else {
+                post([this, deadline, task = std::move(task)]() mutable { schedule(deadline, std::move(task)); });
+            }
+        }
+
+        // Thread safe. Starts task on the loop thread. An exception escaping it terminates the process.
+        void spawn(Task<> task) {
+            auto started = std::make_shared<Task<>>(std::move(task));
+            post([started] { drive(std::move(*started)); });
+        }
+
+        [[nodiscard]] bool inLoopThread() const {
+            return thread_ == std::this_thread::get_id();
+        }
+
+        // The loop running on the calling thread, if any.
+        [[nodiscard]] static EventLoop *current() {
+            return current_;
+        }
+
+        void watch(int fd, uint32_t events, std::function<void(uint32_t)> callback) {
+            auto watcher = std::make_unique<Watcher>(Watcher{std::move(callback), true});
+            ::epoll_event event{};
+            event.events = events;
+            event.data.ptr = watcher.get();
+            ::epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+            watchers_[fd] = std::move(watcher);
+        }
+
+        void modify(int fd, uint32_t events) {
+            ::epoll_event event{};
+            event.events = events;
+            event.data.ptr = watchers_.at(fd).get();
+            ::epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &event);
+        }
+
+        // The callback is kept alive until the current batch of events has been handled, so a callback may unwatch
+        // its own descriptor.
+        void unwatch(int fd) {
+            auto found = watchers_.find(fd);
+            if (found == watchers_.end()) {
+                return;
+            }
+            ::epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+            found->second->active = false;
+            retired_.push_back(std::move(found->second));
+            watchers_.erase(found);
+        }
+
+        // Shared by every connection on this loop: reads happen one at a time, and a frame that is complete within
+        // one read is handed on straight from here.
+        [[nodiscard]] std::span<char> readBuffer() {
+            return readBuffer_;
+        }
+
+        [[nodiscard]] std::size_t connections() const {
+            return connections_;
+        }
+
+        // Drops every watcher, pending task and timer, and with them the connections they hold. Only valid once run()
+        // has returned.
+        void clear() {
+            std::lock_guard lock{mutex_};
+            posted_.clear();
+            timers_.clear();
+            for (auto &[fd, watcher] : watchers_) {
+                ::epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+            }
+            watchers_.clear();
+            retired_.clear();
+        }
+
+    private:
+        friend struct Connection;
+        friend struct Listener;
+
+        struct Watcher {
+            std::function<void(uint32_t)> callback;
+            bool active;
+        };
+
+        struct Timer {
+            Clock::time_point deadline;
+            uint64_t sequence;
+            std::function<void()> task;
+
+            // Orders the heap earliest first, and timers with the same deadline in the order they were scheduled.
+            bool operator<(const Timer &rhs) const {
+                return std::tie(deadline, sequence) > std::tie(rhs.deadline, rhs.sequence);
+            }
+        };
+
+        struct Detached {
+            struct promise_type {
+                Detached get_return_object() noexcept {
+                    return {};
+                }
+
+                std::suspend_never initial_suspend() noexcept {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() noexcept {
+                    return {};
+                }
+
+                void return_void() {}
+
+                void unhandled_exception() {
+                    std::terminate();
+                }
+            };
+        };
+
+        static Detached drive(Task<> task) {
+            co_await task;
+        }
+
+        void schedule(Clock::time_point deadline, std::function<void()> task) {
+            timers_.push_back(Timer{deadline, nextTimer_++, std::move(task)});
+            std::push_heap(timers_.begin(), timers_.end());
+        }
+
+        [[nodiscard]] int timeout() const {
+            if (timers_.empty()) {
+                return -1;
+            }
+            const auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers_.front().deadline - Clock::now());
+            return static_cast<int>(std::clamp<std::chrono::milliseconds::rep>(wait.count(), 0, INT_MAX));
+        }
+
+        void runTimers() {
+            const Clock::time_point now = Clock::now();
+            while (!timers_.empty() && timers_.front().deadline <= now) {
+                std::pop_heap(timers_.begin(), timers_.end());
+                std::function<void()> task = std::move(timers_.back().task);
+                timers_.pop_back();
+                task();
+            }
+        }
+
+        void runPosted() {
+            uint64_t count = 0;
+            const ssize_t drained = ::read(wake_, &count, sizeof(count));
+            (void) drained;
+            {
+                std::lock_guard lock{mutex_};
+                running_posted_.swap(posted_);
+            }
+            for (std::function<void()> &task : running_posted_) {
+                task();
+            }
+            running_posted_.clear();
+        }
+
+        int epoll_;
+        int wake_;
+        std::vector<char> readBuffer_;
+        std::atomic<bool> running_ = true;
+        std::atomic<std::thread::id> thread_;
+        std::atomic<std::size_t> connections_ = 0;
+        std::mutex mutex_;
+        std::vector<std::function<void()>> posted_;
+        std::vector<std::function<void()>> running_posted_;
+        std::unordered_map<int, std::unique_ptr<Watcher>> watchers_;
+        std::vector<std::unique_ptr<Watcher>> retired_;
+        std::vector<Timer> timers_;
+        uint64_t nextTimer_ = 0;
+        static inline thread_local EventLoop *current_ = nullptr;
+    };
+
+    // The addresses a host name resolved to, for connecting again without another lookup.
+    struct ResolvedAddresses final {
+        struct Address {
+            ::sockaddr_storage storage;
+            ::socklen_t length;
+            int family;
+            int protocol;
+        };
+
+        std::vector<Address> addresses;
+    };
+
+    // Resolves executionContext's host and port, blocking the calling thread.
+    inline std::variant<Failure, std::shared_ptr<const ResolvedAddresses>> resolve(const ExecutionContext &executionContext) {
+        ::addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        ::addrinfo *found = nullptr;
+        const int status = ::getaddrinfo(executionContext.host().c_str(), std::to_string(executionContext.port()).c_str(), &hints, &found);
+        if (status != 0) {
+            return Failure{"WebSocket could not resolve " + executionContext.host() + ": " + ::gai_strerror(status)};
+        }
+
+        auto resolved = std::make_shared<ResolvedAddresses>();
+        for (::addrinfo *address = found; address != nullptr; address = address->ai_next) {
+            ResolvedAddresses::Address &added = resolved->addresses.emplace_back();
+            std::memcpy(&added.storage, address->ai_addr, address->ai_addrlen);
+            added.length = address->ai_addrlen;
+            added.family = address->ai_family;
+            added.protocol = address->ai_protocol;
+        }
+        ::freeaddrinfo(found);
+        return resolved;
+    }
+
+    // Runs resolve() on a thread of its own, so a slow name server holds up only the connections waiting for it and
+    // not the loop they will run on. Lookups still queued when it is destroyed are dropped.
+    struct Resolver final {
+        using Resolved = std::variant<Failure, std::shared_ptr<const ResolvedAddresses>>;
+
+        Resolver() : thread_([this] { run(); }) {}
+
+        Resolver(const Resolver &) = delete;
+
+        Resolver &operator=(const Resolver &) = delete;
+
+        ~Resolver() {
+            {
+                std::lock_guard lock{mutex_};
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            thread_.join();
+        }
+
+        // Thread safe. done runs on the resolver's thread.
+        void resolve(ExecutionContext executionContext, std::function<void(Resolved)> done) {
+            {
+                std::lock_guard lock{mutex_};
+                lookups_.emplace_back(std::move(executionContext), std::move(done));
+            }
+            wake_.notify_one();
+        }
+
+    private:
+        void run() {
+            std::unique_lock lock{mutex_};
+            while (true) {
+                wake_.wait(lock, [this] { return stopping_ || !lookups_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                auto [executionContext, done] = std::move(lookups_.front());
+                lookups_.pop_front();
+                lock.unlock();
+                done(SimpleWebSocket::resolve(executionContext));
+                lock.lock();
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::deque<std::pair<ExecutionContext, std::function<void(Resolved)>>> lookups_;
+        bool stopping_ = false;
+        std::thread thread_;
+    };
+
+    struct Connection;
+
+    // Bytes that are already a complete frame, encoded once and without a mask, to queue on any number of server
+    // connections without copying them.
+    using SharedFrame = std::shared_ptr<const std::string>;
+
+    inline SharedFrame encodeShared(OpCode opCode, std::string_view payload) {
+        std::string frame(FrameHeader::MAX_SIZE + payload.size(), '\0');
+        frame.resize(encodeFrame(frame, true, opCode, payload));
+        return std::make_shared<const std::string>(std::move(frame));
+    }
+
+    struct ConnectionOptions final {
+        std::size_t maxMessageSize = Reassembler::DEFAULT_MAX_MESSAGE_SIZE;
+        bool validateUtf8 = false;
+        // Pings sent on the loop's timers, and whether the server's pings are answered. A connection that misses too
+        // many pongs fails, and onClosed is given the Failure.
+        HeartbeatOptions heartbeat{};
+        // Connect to these, e.g. from resolve(), rather than look the host up again.
+        std::shared_ptr<const ResolvedAddresses> addresses = nullptr;
+        // Records every message received, before the handler sees it.
+        std::shared_ptr<CaptureWriter> capture = nullptr;
+        // Runs on the loop thread once the opening handshake has completed.
+        std::function<void()> onOpen = nullptr;
+        // Runs once on the loop thread when the connection ends: std::monostate after a clean close, otherwise the
+        // Failure that ended it.
+        std::function<void(const std::variant<Failure, std::monostate> &)> onClosed = nullptr;
+    };
+
+    // What a server connection does with a shared frame that would take its queued output past maxQueuedBytes.
+    enum class SlowConsumer : uint8_t {
+        // Drop queued shared frames, oldest first, until the new one fits, or else the new one. A frame that has been
+        // partly written is always finished.
+        DropOldest,
+        // Close the connection with 1008.
+        Close
+    };
+
+    struct ServerOptions final {
+        // The interface to listen on. The default is every IPv4 interface.
+        std::string host = "0.0.0.0";
+        // Zero picks a free port, which Listener::port() gives.
+        uint16_t port = 0;
+        int backlog = SOMAXCONN;
+        // For every accepted connection. onOpen runs once the upgrade has been answered, and addresses is not used.
+        ConnectionOptions connectionOptions{};
+        // Output a connection may have queued before shared frames to it are dropped, or it is closed.
+        std::size_t maxQueuedBytes = 4 * 1024 * 1024;
+        SlowConsumer slowConsumer = SlowConsumer::DropOldest;
+    };
+
+    // Runs on the loop thread once a client's upgrade request has been read. Returns the FrameHandler for the
+    // connection, or nullptr to turn the upgrade down with 404 Not Found.
+    using UpgradeFn = std::function<std::unique_ptr<FrameHandler>(const std::shared_ptr<Connection> &, const Handshake::Upgrade &)>;
+
+    // A non-blocking connection owned by an EventLoop: a client connection from Reactor::connect, or a server
+    // connection accepted by a Listener. Complete messages are passed to its MessageHandler on the loop thread as views
+    // into the loop's read buffer, or the reassembly buffer, valid for the duration of the call. Pings are answered
+    // automatically unless options.heartbeat.autoPong is off.
+    struct Connection final : std::enable_shared_from_this<Connection> {
+        enum class State : uint8_t {
+            Connecting,
+            Handshaking,
+            Open,
+            Closing,
+            Closed
+        };
+
+        Connection(std::shared_ptr<EventLoop> loop,
+                   ExecutionContext executionContext,
+                   std::unique_ptr<FrameHandler> frameHandler,
+                   ConnectionOptions options = {})
+                : loop_(std::move(loop))
+                , executionContext_(std::move(executionContext))
+                , messageHandler_(std::in_place, std::move(frameHandler))
+                , options_(std::move(options))
+                , decoder_(Role::Client, options_.maxMessageSize)
+                , reassembler_(options_.maxMessageSize, options_.validateUtf8)
+                , heartbeat_(options_.heartbeat) {}
+
+        Connection(const Connection &) = delete;
+
+        Connection &operator=(const Connection &) = delete;
+
+        ~Connection() {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        // Thread safe. Frames sent before the handshake completes are held until it has.
+        void send(OpCode opCode, std::string_view payload) {
+            send(opCode, payload, nullptr);
+        }
+
+        // Thread safe. onWritten runs on the loop thread once the frame has been handed to the socket, with false if
+        // the connection ended first.
+        void send(OpCode opCode, std::string_view payload, std::function<void(bool)> onWritten) {
+            std::string frame(FrameHeader::MAX_SIZE + payload.size(), '\0');
+            frame.resize(encodeFrame(frame, true, opCode, payload, mask()));
+            onLoop([self = shared_from_this(), frame = std::move(frame), onWritten = std::move(onWritten)]() mutable {
+                self->enqueue(std::move(frame), std::move(onWritten));
+            });
+        }
+
+        // Thread safe. Queues a frame from encodeShared without copying it, subject to ServerOptions::maxQueuedBytes.
+        // Only for server connections, as a client has to mask each frame it sends.
+        void send(SharedFrame frame) {
+            if (role_ != Role::Server) {
+                throw std::logic_error("SimpleWebSocket::Connection: shared frames are unmasked, so only a server can send them");
+            }
+            onLoop([self = shared_from_this(), frame = std::move(frame)]() mutable { self->enqueueShared(std::move(frame)); });
+        }
+
+        // Thread safe. Starts the closing handshake; the connection is closed once the server has answered.
+        void close(CloseCode closeCode = CloseCode::Normal, std::string_view reason = {}) {
+            std::string payload = closePayload(closeCode, reason);
+            onLoop([self = shared_from_this(), payload = std::move(payload)] { self->startClose(payload); });
+        }
+
+        [[nodiscard]] State state() const {
+            return state_;
+        }
+
+        // For a server connection, the client's address and port, and the uri it asked for once it has upgraded.
+        [[nodiscard]] const ExecutionContext &executionContext() const {
+            return executionContext_;
+        }
+
+        [[nodiscard]] Role role() const {
+            return role_;
+        }
+
+        // Shared frames this server connection has dropped because it fell behind.
+        [[nodiscard]] uint64_t dropped() const {
+            return dropped_;
+        }
+
+        // Pings sent, pongs outstanding and round trip times. Only read it on the loop thread.
+        [[nodiscard]] const Heartbeat &heartbeat() const {
+            return heartbeat_;
+        }
+
+        // Resolves the host, unless options.addresses were given, and starts connecting. Name resolution blocks the
+        // calling thread; everything after it happens on the loop.
+        void open() {
+            ++loop_->connections_;
+            std::shared_ptr<const ResolvedAddresses> addresses = options_.addresses;
+            if (!addresses) {
+                std::variant<Failure, std::shared_ptr<const ResolvedAddresses>> resolved = resolve(executionContext_);
+                if (const auto *failure = std::get_if<Failure>(&resolved)) {
+                    loop_->post([self = shared_from_this(), failure = *failure] { self->finish(failure); });
+                    return;
+                }
+                addresses = std::get<std::shared_ptr<const ResolvedAddresses>>(std::move(resolved));
+            }
+
+            int error = 0;
+            for (auto address = addresses->addresses.begin(); address != addresses->addresses.end() && fd_ < 0; ++address) {
+                const int fd = ::socket(address->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, address->protocol);
+                if (fd < 0) {
+                    error = errno;
+                    continue;
+                }
+                const int noDelay = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                if (::connect(fd, reinterpret_cast<const ::sockaddr *>(&address->storage), address->length) == 0 || errno == EINPROGRESS) {
+                    fd_ = fd;
+                } else {
+                    error = errno;
+                    ::close(fd);
+                }
+            }
+
+            if (fd_ < 0) {
+                Failure failure{"WebSocket could not connect to " + executionContext_.host() + ": " + std::strerror(error)};
+                loop_->post([self = shared_from_this(), failure] { self->finish(failure); });
+                return;
+            }
+            loop_->post([self = shared_from_this()] {
+                self->loop_->watch(self->fd_, EPOLLOUT, [self](uint32_t events) { self->onEvents(events); });
+            });
+        }
+
+    private:
+        friend struct AsyncConnection;
+        friend struct Listener;
+        friend struct Broadcast;
+
+        // A frame waiting to be written: one this connection encoded, or one shared with other connections.
+        struct Outbound {
+            std::string owned;
+            SharedFrame shared;
+
+            [[nodiscard]] std::string_view bytes() const {
+                return shared ? std::string_view{*shared} : std::string_view{owned};
+            }
+        };
+
+        // A connection accepted by a Listener, waiting for the client's upgrade request.
+        Connection(std::shared_ptr<EventLoop> loop, int fd, ExecutionContext peer, UpgradeFn upgrade, const ServerOptions &options)
+                : loop_(std::move(loop))
+                , executionContext_(std::move(peer))
+                , options_(options.connectionOptions)
+                , decoder_(Role::Server, options_.maxMessageSize)
+                , reassembler_(options_.maxMessageSize, options_.validateUtf8)
+                , heartbeat_(options_.heartbeat)
+                , fd_(fd)
+                , state_(State::Handshaking)
+                , role_(Role::Server)
+                , upgrade_(std::move(upgrade))
+                , maxQueuedBytes_(options.maxQueuedBytes)
+                , slowConsumer_(options.slowConsumer) {}
+
+        void accepted() {
+            watchingInput_ = true;
+            loop_->watch(fd_, EPOLLIN, [self = shared_from_this()](uint32_t events) { self->onEvents(events); });
+        }
+
+        // A client masks every frame with a fresh key; a server never masks.
+        [[nodiscard]] std::optional<MaskingKey> mask() const {
+            if (role_ == Role::Server) {
+                return std::nullopt;
+            }
+            return randomMaskingKey();
+        }
+
+        static std::string closePayload(CloseCode closeCode, std::string_view reason) {
+            const auto code = static_cast<uint16_t>(closeCode);
+            std::string payload{static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+            payload.append(reason.substr(0, 123));
+            return payload;
+        }
+
+        template<class F>
+        void onLoop(F &&task) {
+            if (loop_->inLoopThread()) {
+                task();
+            } else {
+                loop_->post(std::forward<F>(task));
+            }
+        }
+
+        void onEvents(uint32_t events) {
+            if (state_ == State::Connecting) {
+                connected();
+                return;
+            }
+            if ((events & EPOLLOUT) != 0) {
+                flush();
+            }
+            if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0 && state_ != State::Closed) {
+                readable();
+            }
+        }
+
+        void connected() {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            ::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                finish(Failure{"WebSocket could not connect to " + executionContext_.host() + ": " + std::strerror(error)});
+                return;
+            }
+            state_ = State::Handshaking;
+            key_ = Handshake::key();
+            push(Handshake::request(executionContext_, key_), nullptr);
+            flush();
+        }
+
+        void readable() {
+            std::span<char> buffer = loop_->readBuffer();
+            const ssize_t received = ::recv(fd_, buffer.data(), buffer.size(), 0);
+            if (received < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    finish(Failure{std::string{"WebSocket read failed: "} + std::strerror(errno), CloseCode::AbnormalClosure});
+                }
+                return;
+            }
+            if (received == 0) {
+                if (state_ == State::Closing) {
+                    finish(std::monostate{});
+                } else {
+                    finish(Failure{"WebSocket connection closed", CloseCode::AbnormalClosure});
+                }
+                return;
+            }
+
+            std::span<char> input = buffer.first(static_cast<std::size_t>(received));
+            if (state_ == State::Handshaking) {
+                input = handshake(input);
+                if (state_ != State::Open) {
+                    return;
+                }
+            }
+            std::optional<Failure> failure = decoder_.decode(input, [this](const FrameHeader &header, std::span<char> payload) {
+                if (state_ != State::Closed) {
+                    frame(header, payload);
+                }
+            });
+            if (failure && state_ != State::Closed) {
+                fail(*failure);
+            }
+        }
+
+        // Collects the response head, or for a server the request head. Returns the bytes that followed it, which
+        // already belong to the first frames.
+        std::span<char> handshake(std::span<char> input) {
+            handshake_.append(input.data(), input.size());
+            const std::size_t end = handshake_.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                if (handshake_.size() > 16 * 1024) {
+                    finish(Failure{role_ == Role::Server ? "WebSocket upgrade request is too long" : "WebSocket upgrade response is too long"});
+                }
+                return {};
+            }
+
+            const std::size_t headSize = end + 4;
+            if (role_ == Role::Server) {
+                if (!answer(std::string_view{handshake_}.substr(0, headSize))) {
+                    return {};
+                }
+            } else if (std::optional<Failure> failure = Handshake::validate(std::string_view{handshake_}.substr(0, headSize), key_)) {
+                finish(*failure);
+                return {};
+            }
+            std::span<char> rest = input.last(handshake_.size() - headSize);
+            handshake_ = std::string{};
+            state_ = State::Open;
+            for (auto &[frame, onWritten] : pending_) {
+                push(std::move(frame), std::move(onWritten));
+            }
+            pending_.clear();
+            flush();
+            scheduleHeartbeat();
+            if (options_.onOpen) {
+                options_.onOpen();
+            }
+            return rest;
+        }
+
+        // Queues the answer to a client's upgrade request. Returns false if the upgrade was turned down, and the
+        // connection has ended.
+        bool answer(std::string_view request) {
+            std::variant<Failure, Handshake::Upgrade> parsed = Handshake::parseRequest(request);
+            if (const auto *failure = std::get_if<Failure>(&parsed)) {
+                refuse("400 Bad Request", *failure);
+                return false;
+            }
+            const Handshake::Upgrade &upgrade = std::get<Handshake::Upgrade>(parsed);
+            executionContext_ = ExecutionContext{executionContext_.host(), executionContext_.port(), upgrade.uri};
+            // Dropped afterwards, as it may hold on to things that hold this connection.
+            std::unique_ptr<FrameHandler> frameHandler = std::exchange(upgrade_, nullptr)(shared_from_this(), upgrade);
+            if (!frameHandler) {
+                refuse("404 Not Found", Failure{"WebSocket upgrade to " + upgrade.uri + " was turned down"});
+                return false;
+            }
+            messageHandler_.emplace(std::move(frameHandler));
+            push(Handshake::response(upgrade.key), nullptr);
+            return true;
+        }
+
+        void refuse(std::string_view status, const Failure &failure) {
+            push(Handshake::refusal(status), nullptr);
+            flush();
+            finish(failure);
+        }
+
+        void frame(const FrameHeader &header, std::span<char> payload) {
+            ReassemblyResult result = reassembler_.feed(header.fin(), header.opCode(), {payload.data(), payload.size()});
+            if (const auto *failure = std::get_if<Failure>(&result)) {
+                fail(*failure);
+                return;
+            }
+            const auto *messageView = std::get_if<MessageView>(&result);
+            if (messageView == nullptr) {
+                return;
+            }
+            if (options_.capture) {
+                options_.capture->record(*messageView);
+            }
+
+            if (const auto *ping = std::get_if<PingFrameView>(&messageView->value())) {
+                if (state_ == State::Open && options_.heartbeat.autoPong) {
+                    control(OpCode::Pong, ping->value());
+                }
+            } else if (const auto *pong = std::get_if<PongFrameView>(&messageView->value())) {
+                heartbeat_.pong(pong->value());
+            } else if (const auto *close = std::get_if<CloseFrameView>(&messageView->value())) {
+                if (state_ == State::Open) {
+                    // Echo the status code back. A client then waits for the server to close the connection.
+                    std::string frame(FrameHeader::MAX_SIZE + 2, '\0');
+                    frame.resize(encodeFrame(frame, true, OpCode::Close, close->value().substr(0, 2), mask()));
+                    push(std::move(frame), nullptr);
+                    state_ = State::Closing;
+                    flush();
+                }
+            }
+
+            try {
+                messageHandler_->handle(*messageView);
+            } catch (const FailureError &e) {
+                fail(e.failure());
+            } catch (const std::exception &e) {
+                fail(Failure{e.what(), CloseCode::InternalError});
+            }
+
+            // The closing handshake is over once a server has both sent and received a close frame.
+            if (role_ == Role::Server && std::holds_alternative<CloseFrameView>(messageView->value())) {
+                finish(std::monostate{});
+            }
+        }
+
+        void enqueue(std::string frame, std::function<void(bool)> onWritten) {
+            switch (state_) {
+                case State::Connecting:
+                case State::Handshaking:
+                    pending_.emplace_back(std::move(frame), std::move(onWritten));
+                    break;
+                case State::Open:
+                    push(std::move(frame), std::move(onWritten));
+                    flush();
+                    break;
+                default:
+                    if (onWritten) {
+                        onWritten(false);
+                    }
+                    break;
+            }
+        }
+
+        void push(std::string frame, std::function<void(bool)> onWritten) {
+            queuedBytes_ += frame.size();
+            outbound_.push_back(Outbound{std::move(frame), nullptr});
+            ++queued_;
+            if (onWritten) {
+                writeWaiters_.emplace_back(queued_, std::move(onWritten));
+            }
+        }
+
+        void enqueueShared(SharedFrame frame) {
+            if (state_ != State::Open) {
+                return;
+            }
+            if (queuedBytes_ + frame->size() > maxQueuedBytes_) {
+                if (slowConsumer_ == SlowConsumer::Close) {
+                    ++dropped_;
+                    fail(Failure{"WebSocket connection fell too far behind", CloseCode::PolicyViolation});
+                    return;
+                }
+                // Dropped frames stay queued with no bytes, which keeps the sequence numbers of writeWaiters_ valid.
+                for (auto queued = outbound_.begin() + (sent_ > 0 ? 1 : 0);
+                     queued != outbound_.end() && queuedBytes_ + frame->size() > maxQueuedBytes_; ++queued) {
+                    if (queued->shared) {
+                        queuedBytes_ -= queued->shared->size();
+                        queued->shared.reset();
+                        ++dropped_;
+                    }
+                }
+                if (queuedBytes_ + frame->size() > maxQueuedBytes_) {
+                    ++dropped_;
+                    return;
+                }
+            }
+            queuedBytes_ += frame->size();
+            outbound_.push_back(Outbound{{}, std::move(frame)});
+            ++queued_;
+            flush();
+        }
+
+        // Queues a control frame behind what is already queued and writes it. Only called on the loop thread.
+        void control(OpCode opCode, std::string_view payload) {
+            std::string frame(FrameHeader::MAX_SIZE + payload.size(), '\0');
+            frame.resize(encodeFrame(frame, true, opCode, payload, mask()));
+            push(std::move(frame), nullptr);
+            flush();
+        }
+
+        void scheduleHeartbeat() {
+            if (options_.heartbeat.interval.count() <= 0) {
+                return;
+            }
+            loop_->after(options_.heartbeat.interval, [weak = weak_from_this()] {
+                if (std::shared_ptr<Connection> self = weak.lock()) {
+                    self->beat();
+                }
+            });
+        }
+
+        void beat() {
+            if (state_ != State::Open) {
+                return;
+            }
+            std::variant<Failure, std::string> ping = heartbeat_.ping();
+            if (const auto *failure = std::get_if<Failure>(&ping)) {
+                fail(*failure);
+                return;
+            }
+            control(OpCode::Ping, std::get<std::string>(ping));
+            scheduleHeartbeat();
+        }
+
+        void startClose(const std::string &payload) {
+            if (state_ == State::Open) {
+                std::string frame(FrameHeader::MAX_SIZE + payload.size(), '\0');
+                frame.resize(encodeFrame(frame, true, OpCode::Close, payload, mask()));
+                push(std::move(frame), nullptr);
+                state_ = State::Closing;
+                flush();
+            } else if (state_ == State::Connecting || state_ == State::Handshaking) {
+                finish(std::monostate{});
+            }
+        }
+
+        // Writes as much of the outbound queue as the socket takes, and asks for EPOLLOUT while anything is left.
+        void flush() {
+            while (!outbound_.empty()) {
+                std::array<::iovec, 64> iovecs{};
+                std::size_t count = 0;
+                for (auto frame = outbound_.begin(); frame != outbound_.end() && count < iovecs.size(); ++frame, ++count) {
+                    const std::size_t offset = count == 0 ? sent_ : 0;
+                    const std::string_view bytes = frame->bytes();
+                    iovecs[count] = ::iovec{const_cast<char *>(bytes.data()) + offset, bytes.size() - offset};
+                }
+                ::msghdr message{};
+                message.msg_iov = iovecs.data();
+                message.msg_iovlen = count;
+                const ssize_t written = ::sendmsg(fd_, &message, MSG_NOSIGNAL);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+                    finish(Failure{std::string{"WebSocket write failed: "} + std::strerror(errno), CloseCode::AbnormalClosure});
+                    return;
+                }
+
+                auto remaining = static_cast<std::size_t>(written);
+                while (!outbound_.empty() && remaining >= outbound_.front().bytes().size() - sent_) {
+                    remaining -= outbound_.front().bytes().size() - sent_;
+                    queuedBytes_ -= outbound_.front().bytes().size();
+                    sent_ = 0;
+                    outbound_.pop_front();
+                    ++written_;
+                }
+                sent_ += remaining;
+            }
+
+            const bool writable = !outbound_.empty();
+            if (writable != waitingToWrite_ || !watchingInput_) {
+                waitingToWrite_ = writable;
+                watchingInput_ = true;
+                loop_->modify(fd_, writable ? EPOLLIN | EPOLLOUT : EPOLLIN);
+            }
+
+            // Last, as a callback may send, close or fail the connection.
+            while (!writeWaiters_.empty() && writeWaiters_.front().first <= written_ && state_ != State::Closed) {
+                std::function<void(bool)> onWritten = std::move(writeWaiters_.front().second);
+                writeWaiters_.pop_front();
+                onWritten(true);
+            }
+        }
+
+        // Sends a close frame for a protocol failure, as far as the socket takes it right away, and ends the connection.
+        void fail(const Failure &failure) {
+            if (state_ == State::Open) {
+                std::string frame(FrameHeader::MAX_SIZE + 2, '\0');
+                frame.resize(encodeFrame(frame, true, OpCode::Close,
+                                         closePayload(failure.closeCode().value_or(CloseCode::ProtocolError), {}),
+                                         mask()));
+                push(std::move(frame), nullptr);
+                state_ = State::Closing;
+                flush();
+            }
+            finish(failure);
+        }
+
+        void finish(const std::variant<Failure, std::monostate> &result) {
+            if (state_ == State::Closed) {
+                return;
+            }
+            state_ = State::Closed;
+            if (fd_ >= 0) {
+                loop_->unwatch(fd_);
+                ::close(fd_);
+                fd_ = -1;
+            }
+            outbound_.clear();
+            queuedBytes_ = 0;
+            std::deque<std::pair<uint64_t, std::function<void(bool)>>> writeWaiters = std::move(writeWaiters_);
+            std::vector<std::pair<std::string, std::function<void(bool)>>> pending = std::move(pending_);
+            writeWaiters_.clear();
+            pending_.clear();
+            --loop_->connections_;
+            for (auto &[sequence, onWritten] : writeWaiters) {
+                onWritten(false);
+            }
+            for (auto &[frame, onWritten] : pending) {
+                if (onWritten) {
+                    onWritten(false);
+                }
+            }
+            if (options_.onClosed) {
+                options_.onClosed(result);
+            }
+        }
+
+        std::shared_ptr<EventLoop> loop_;
+        ExecutionContext executionContext_;
+        // Only empty while a server connection waits for the upgrade request.
+        std::optional<MessageHandler> messageHandler_;
+        ConnectionOptions options_;
+        FrameDecoder decoder_;
+        Reassembler reassembler_;
+        Heartbeat heartbeat_;
+        int fd_ = -1;
+        std::atomic<State> state_ = State::Connecting;
+        std::string key_;
+        std::string handshake_;
+        std::deque<Outbound> outbound_;
+        std::size_t queuedBytes_ = 0;
+        std::size_t sent_ = 0;
+        uint64_t queued_ = 0;
+        uint64_t written_ = 0;
+        std::deque<std::pair<uint64_t, std::function<void(bool)>>> writeWaiters_;
+        std::vector<std::pair<std::string, std::function<void(bool)>>> pending_;
+        bool waitingToWrite_ = false;
+        bool watchingInput_ = false;
+        Role role_ = Role::Client;
+        UpgradeFn upgrade_;
+        std::size_t maxQueuedBytes_ = SIZE_MAX;
+        SlowConsumer slowConsumer_ = SlowConsumer::DropOldest;
+        std::atomic<uint64_t> dropped_ = 0;
+    };
+
+    // What awaiting AsyncConnection::receive gives: the next message, std::monostate once the connection has closed
+    // cleanly, or the Failure that ended it.
+    using ReceiveResult = std::variant<std::monostate, MessageView, Failure>;
+
+    // Coroutine face of a Connection, from Reactor::asyncConnect. Awaiting an operation resumes the coroutine on the
+    // connection's loop thread. A MessageView from receive() stays valid until the coroutine's next co_await: a message
+    // that arrives while the coroutine is waiting for it is handed over straight from the read buffer, and one that
+    // arrives while it is busy elsewhere is copied and queued.
+    struct AsyncConnection final {
+        // Receives messages on the loop thread and parks the one coroutine waiting for them.
+        struct Inbox final : FrameHandler {
+            void handlePing(const PingFrame &pingFrame) override { handlePingView(PingFrameView{pingFrame.value()}); }
+
+            void handlePong(const PongFrame &pongFrame) override { handlePongView(PongFrameView{pongFrame.value()}); }
+
+            void handleText(const TextFrame &textFrame) override { handleTextView(TextFrameView{textFrame.value()}); }
+
+            void handleBinary(const BinaryFrame &binaryFrame) override {
+                handleBinaryView(BinaryFrameView{std::as_bytes(std::span{binaryFrame.value()})});
+            }
+
+            void handleClose(const CloseFrame &closeFrame) override { handleCloseView(CloseFrameView{closeFrame.value()}); }
+
+            void handleUndefined(const UndefinedFrame &undefinedFrame) override { deliver(MessageView{undefinedFrame}); }
+
+            void handlePingView(const PingFrameView &pingFrameView) override { deliver(MessageView{pingFrameView}); }
+
+            void handlePongView(const PongFrameView &pongFrameView) override { deliver(MessageView{pongFrameView}); }
+
+            void handleTextView(const TextFrameView &textFrameView) override { deliver(MessageView{textFrameView}); }
+
+            void handleBinaryView(const BinaryFrameView &binaryFrameView) override { deliver(MessageView{binaryFrameView}); }
+
+            void handleCloseView(const CloseFrameView &closeFrameView) override { deliver(MessageView{closeFrameView}); }
+
+            [[nodiscard]] bool ready() const {
+                return !queued_.empty() || closed_.has_value();
+            }
+
+            void wait(std::coroutine_handle<> receiver) {
+                receiver_ = receiver;
+            }
+
+            ReceiveResult take() {
+                if (handedOver_) {
+                    return *std::exchange(handedOver_, std::nullopt);
+                }
+                if (!queued_.empty()) {
+                    held_ = std::move(queued_.front());
+                    queued_.pop_front();
+                    return held_->view();
+                }
+                return std::visit([](const auto &result) { return ReceiveResult{result}; }, *closed_);
+            }
+
+            void closed(const std::variant<Failure, std::monostate> &result) {
+                closed_ = result;
+                if (receiver_) {
+                    std::exchange(receiver_, nullptr).resume();
+                }
+                for (std::coroutine_handle<> closer : std::exchange(closers_, {})) {
+                    closer.resume();
+                }
+            }
+
+            [[nodiscard]] const std::optional<std::variant<Failure, std::monostate>> &result() const {
+                return closed_;
+            }
+
+            void waitForClose(std::coroutine_handle<> closer) {
+                closers_.push_back(closer);
+            }
+
+        private:
+            // A message is handed straight over to a waiting receiver, unless the receiver is already running further
+            // up this stack, in which case it is queued and the receiver picks it up without nesting.
+            void deliver(const MessageView &messageView) {
+                if (receiver_ && !resuming_) {
+                    handedOver_ = messageView;
+                    resuming_ = true;
+                    std::exchange(receiver_, nullptr).resume();
+                    while (receiver_ && ready()) {
+                        std::exchange(receiver_, nullptr).resume();
+                    }
+                    resuming_ = false;
+                } else {
+                    queued_.emplace_back(messageView);
+                }
+            }
+
+            std::coroutine_handle<> receiver_;
+            std::vector<std::coroutine_handle<>> closers_;
+            std::optional<MessageView> handedOver_;
+            std::deque<CompactMessage> queued_;
+            std::optional<CompactMessage> held_;
+            std::optional<std::variant<Failure, std::monostate>> closed_;
+            bool resuming_ = false;
+        };
+
+        AsyncConnection(std::shared_ptr<Connection> connection, Inbox &inbox)
+                : connection_(std::move(connection)), inbox_(&inbox) {}
+
+        // co_await gives a ReceiveResult.
+        [[nodiscard]] auto receive() const {
+            struct Awaiter {
+                bool await_ready() const {
+                    return connection->loop_->inLoopThread() && inbox->ready();
+                }
+
+                void await_suspend(std::coroutine_handle<> receiver) const {
+                    if (connection->loop_->inLoopThread()) {
+                        inbox->wait(receiver);
+                        return;
+                    }
+                    connection->loop_->post([inbox = inbox, receiver, keep = connection] {
+                        if (inbox->ready()) {
+                            receiver.resume();
+                        } else {
+                            inbox->wait(receiver);
+                        }
+                    });
+                }
+
+                ReceiveResult await_resume() const {
+                    return inbox->take();
+                }
+
+                std::shared_ptr<Connection> connection;
+                Inbox *inbox;
+            };
+            return Awaiter{connection_, inbox_};
+        }
+
+        // co_await finishes once the frame has been handed to the socket, and gives the Failure if the connection
+        // ended first. The payload is copied before the coroutine suspends.
+        [[nodiscard]] auto send(OpCode opCode, std::string_view payload) const {
+            struct Awaiter {
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                // A frame written straight away finishes before this returns, and the coroutine carries on without
+                // suspending. Otherwise it is resumed from a task posted to the loop, never from inside the write, so
+                // back to back sends do not nest.
+                bool await_suspend(std::coroutine_handle<> sender) {
+                    connection->send(opCode, payload, [this, sender, loop = connection->loop_](bool sent) {
+                        written = sent;
+                        if (finished.exchange(true)) {
+                            loop->post([sender] { sender.resume(); });
+                        }
+                    });
+                    return !finished.exchange(true);
+                }
+
+                std::optional<Failure> await_resume() const {
+                    if (written) {
+                        return std::nullopt;
+                    }
+                    return Failure{"WebSocket connection closed before the frame was written", CloseCode::AbnormalClosure};
+                }
+
+                std::shared_ptr<Connection> connection;
+                OpCode opCode;
+                std::string_view payload;
+                bool written = false;
+                std::atomic<bool> finished = false;
+            };
+            return Awaiter{connection_, opCode, payload};
+        }
+
+        // co_await finishes once the connection has closed, however that came about.
+        [[nodiscard]] auto closed() const {
+            struct Awaiter {
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                void await_suspend(std::coroutine_handle<> closer) const {
+                    connection->onLoop([inbox = inbox, closer, keep = connection] {
+                        if (inbox->result()) {
+                            closer.resume();
+                        } else {
+                            inbox->waitForClose(closer);
+                        }
+                    });
+                }
+
+                std::variant<Failure, std::monostate> await_resume() const {
+                    return *inbox->result();
+                }
+
+                std::shared_ptr<Connection> connection;
+                Inbox *inbox;
+            };
+            return Awaiter{connection_, inbox_};
+        }
+
+        // Starts the closing handshake. co_await finishes once the connection has closed, with std::monostate after a
+        // clean close and the Failure otherwise.
+        [[nodiscard]] auto close(CloseCode closeCode = CloseCode::Normal, std::string_view reason = {}) const {
+            connection_->close(closeCode, reason);
+            return closed();
+        }
+
+        // Starts the closing handshake once stopToken is stopped, for as long as the returned callback is alive. What
+        // the server sent before it answered the close is still received, so a receive loop drains it and then gets
+        // std::monostate.
+        [[nodiscard]] auto closeOn(std::stop_token stopToken, CloseCode closeCode = CloseCode::GoingAway) const {
+            return std::stop_callback{std::move(stopToken), [connection = connection_, closeCode] { connection->close(closeCode); }};
+        }
+
+        [[nodiscard]] const std::shared_ptr<Connection> &connection() const {
+            return connection_;
+        }
+
+    private:
+        std::shared_ptr<Connection> connection_;
+        Inbox *inbox_;
+    };
+
+    // Accepts connections on a listening socket for Reactor::listen. Each accepted connection goes to the loop with the
+    // fewest connections, and reads its upgrade request there. The listening socket stays open, and the Listener alive,
+    // until close() or the Reactor's destruction.
+    struct Listener final : std::enable_shared_from_this<Listener> {
+        Listener(const Listener &) = delete;
+
+        Listener &operator=(const Listener &) = delete;
+
+        ~Listener() {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        // The port the socket is bound to, which is the one picked for ServerOptions::port 0.
+        [[nodiscard]] uint16_t port() const {
+            return port_;
+        }
+
+        // Connections accepted so far, whether or not they went on to upgrade.
+        [[nodiscard]] uint64_t accepted() const {
+            return accepted_;
+        }
+
+        // Thread safe. Stops accepting. Connections already accepted stay open.
+        void close() {
+            loop_->post([self = shared_from_this()] {
+                if (self->fd_ >= 0) {
+                    self->loop_->unwatch(self->fd_);
+                    ::close(self->fd_);
+                    self->fd_ = -1;
+                }
+            });
+        }
+
+    private:
+        friend struct Reactor;
+
+        Listener(std::vector<std::shared_ptr<EventLoop>> loops, UpgradeFn upgrade, ServerOptions options)
+                : loops_(std::move(loops)), loop_(loops_.front()), upgrade_(std::move(upgrade)), options_(std::move(options)) {}
+
+        std::optional<Failure> bind() {
+            std::variant<Failure, std::shared_ptr<const ResolvedAddresses>> resolved = resolve(ExecutionContext{options_.host, options_.port, ""});
+            if (const auto *failure = std::get_if<Failure>(&resolved)) {
+                return *failure;
+            }
+
+            int error = 0;
+            for (const ResolvedAddresses::Address &address : std::get<std::shared_ptr<const ResolvedAddresses>>(resolved)->addresses) {
+                const int fd = ::socket(address.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, address.protocol);
+                if (fd < 0) {
+                    error = errno;
+                    continue;
+                }
+                const int reuse = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+                if (::bind(fd, reinterpret_cast<const ::sockaddr *>(&address.storage), address.length) == 0 &&
+                    ::listen(fd, options_.backlog) == 0) {
+                    fd_ = fd;
+                    break;
+                }
+                error = errno;
+                ::close(fd);
+            }
+            if (fd_ < 0) {
+                return Failure{"WebSocket could not listen on " + options_.host + ":" + std::to_string(options_.port) + ": " + std::strerror(error)};
+            }
+
+            ::sockaddr_storage bound{};
+            ::socklen_t length = sizeof(bound);
+            ::getsockname(fd_, reinterpret_cast<::sockaddr *>(&bound), &length);
+            port_ = ntohs(bound.ss_family == AF_INET6 ? reinterpret_cast<const ::sockaddr_in6 &>(bound).sin6_port
+                                                      : reinterpret_cast<const ::sockaddr_in &>(bound).sin_port);
+            loop_->post([self = shared_from_this()] {
+                if (self->fd_ >= 0) {
+                    self->loop_->watch(self->fd_, EPOLLIN, [self](uint32_t) { self->acceptAll(); });
+                }
+            });
+            return std::nullopt;
+        }
+
+        void acceptAll() {
+            while (fd_ >= 0) {
+                ::sockaddr_storage peer{};
+                ::socklen_t length = sizeof(peer);
+                const int fd = ::accept4(fd_, reinterpret_cast<::sockaddr *>(&peer), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    return;
+                }
+                ++accepted_;
+                const int noDelay = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+                std::array<char, NI_MAXHOST> host{};
+                std::array<char, NI_MAXSERV> port{};
+                ::getnameinfo(reinterpret_cast<const ::sockaddr *>(&peer), length, host.data(), host.size(), port.data(), port.size(),
+                              NI_NUMERICHOST | NI_NUMERICSERV);
+                const std::shared_ptr<EventLoop> &loop = *std::min_element(loops_.begin(), loops_.end(), [](const auto &lhs, const auto &rhs) {
+                    return lhs->connections() < rhs->connections();
+                });
+                ++loop->connections_;
+                std::shared_ptr<Connection> connection{new Connection(
+                        loop, fd, ExecutionContext{host.data(), static_cast<uint16_t>(std::atoi(port.data())), ""}, upgrade_, options_)};
+                loop->post([connection] { connection->accepted(); });
+            }
+        }
+
+        std::vector<std::shared_ptr<EventLoop>> loops_;
+        std::shared_ptr<EventLoop> loop_;
+        UpgradeFn upgrade_;
+        ServerOptions options_;
+        int fd_ = -1;
+        uint16_t port_ = 0;
+        std::atomic<uint64_t> accepted_ = 0;
+    };
+
+    // Sends the same frames to many server connections. A message is encoded once, and the one copy is queued on every
+    // subscriber, with one task per event loop rather than per connection. Each subscriber's queue is still bounded by
+    // its ServerOptions::maxQueuedBytes, so a slow one loses frames, or is closed, instead of holding on to all of them.
+    struct Broadcast final {
+        Broadcast() : state_(std::make_shared<State>()) {}
+
+        // Thread safe. Closed connections are dropped from the broadcast on their own.
+        void subscribe(const std::shared_ptr<Connection> &connection) {
+            if (connection->role() != Role::Server) {
+                throw std::logic_error("SimpleWebSocket::Broadcast: only server connections can subscribe");
+            }
+            std::lock_guard lock{state_->mutex};
+            auto groups = std::make_shared<std::vector<Group>>(*state_->groups);
+            auto group = std::find_if(groups->begin(), groups->end(), [&](const Group &existing) { return existing.loop == connection->loop_; });
+            if (group == groups->end()) {
+                group = groups->insert(groups->end(), Group{connection->loop_, {}});
+            }
+            auto members = std::make_shared<std::vector<std::weak_ptr<Connection>>>(group->members ? *group->members : Members{});
+            members->push_back(connection);
+            group->members = std::move(members);
+            state_->groups = std::move(groups);
+        }
+
+        // Thread safe.
+        void unsubscribe(const std::shared_ptr<Connection> &connection) {
+            std::lock_guard lock{state_->mutex};
+            state_->prune([&](const std::shared_ptr<Connection> &member) { return member == connection; });
+        }
+
+        // Thread safe. Returns the number of subscribers the frame was queued for, some of which may have closed since.
+        std::size_t publish(OpCode opCode, std::string_view payload) {
+            return publish(encodeShared(opCode, payload));
+        }
+
+        std::size_t publish(SharedFrame frame) {
+            std::shared_ptr<const std::vector<Group>> groups;
+            {
+                std::lock_guard lock{state_->mutex};
+                if (state_->stale.exchange(false)) {
+                    state_->prune([](const std::shared_ptr<Connection> &) { return false; });
+                }
+                groups = state_->groups;
+            }
+
+            std::size_t subscribers = 0;
+            for (const Group &group : *groups) {
+                subscribers += group.members->size();
+                auto deliver = [state = std::weak_ptr<State>{state_}, frame, members = group.members] {
+                    bool stale = false;
+                    for (const std::weak_ptr<Connection> &member : *members) {
+                        std::shared_ptr<Connection> connection = member.lock();
+                        if (connection && connection->state_ == Connection::State::Open) {
+                            connection->enqueueShared(frame);
+                        } else if (!connection || connection->state_ == Connection::State::Closed) {
+                            stale = true;
+                        }
+                    }
+                    if (std::shared_ptr<State> alive = state.lock(); alive && stale) {
+                        alive->stale = true;
+                    }
+                };
+                if (group.loop->inLoopThread()) {
+                    deliver();
+                } else {
+                    group.loop->post(std::move(deliver));
+                }
+            }
+            return subscribers;
+        }
+
+        [[nodiscard]] std::size_t subscribers() const {
+            std::lock_guard lock{state_->mutex};
+            std::size_t subscribers = 0;
+            for (const Group &group : *state_->groups) {
+                subscribers += group.members->size();
+            }
+            return subscribers;
+        }
+
+    private:
+        using Members = std::vector<std::weak_ptr<Connection>>;
+
+        // The subscribers on one loop. Both levels are copied on write, so publishing only takes the lock to copy a
+        // pointer.
+        struct Group {
+            std::shared_ptr<EventLoop> loop;
+            std::shared_ptr<const Members> members;
+        };
+
+        struct State {
+            // Drops closed connections, and those matching drop. Called with the mutex held.
+            template<class F>
+            void prune(F &&drop) {
+                auto pruned = std::make_shared<std::vector<Group>>();
+                for (const Group &group : *groups) {
+                    auto members = std::make_shared<Members>();
+                    for (const std::weak_ptr<Connection> &member : *group.members) {
+                        std::shared_ptr<Connection> connection = member.lock();
+                        if (connection && connection->state_ != Connection::State::Closed && !drop(connection)) {
+                            members->push_back(member);
+                        }
+                    }
+                    if (!members->empty()) {
+                        pruned->push_back(Group{group.loop, std::move(members)});
+                    }
+                }
+                groups = std::move(pruned);
+            }
+
+            mutable std::mutex mutex;
+            std::shared_ptr<const std::vector<Group>> groups = std::make_shared<const std::vector<Group>>();
+            // Set by a delivery that came across a closed subscriber.
+            std::atomic<bool> stale = false;
+        };
+
+        std::shared_ptr<State> state_;
+    };
+
+    // Runs many non-blocking connections on a fixed number of event loops, one thread each. New connections go to the
+    // loop with the fewest, so throughput grows with the number of loops rather than the number of connections.
+    // Destroying the Reactor stops the loops and drops any connections still open without a closing handshake.
+    struct Reactor final {
+        explicit Reactor(std::size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+            for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+                loops_.push_back(std::make_shared<EventLoop>());
+            }
+            for (const std::shared_ptr<EventLoop> &loop : loops_) {
+                threads_.emplace_back([loop] { loop->run(); });
+            }
+        }
+
+        Reactor(const Reactor &) = delete;
+
+        Reactor &operator=(const Reactor &) = delete;
+
+        ~Reactor() {
+            resolver_.reset();
+            for (const std::shared_ptr<EventLoop> &loop : loops_) {
+                loop->stop();
+            }
+            for (std::thread &thread : threads_) {
+                thread.join();
+            }
+            for (const std::shared_ptr<EventLoop> &loop : loops_) {
+                loop->clear();
+            }
+        }
+
+        // Name resolution happens on the calling thread; connecting, the handshake and all I/O on one of the loops.
+        std::shared_ptr<Connection> connect(ExecutionContext executionContext,
+                                            std::unique_ptr<FrameHandler> frameHandler,
+                                            ConnectionOptions options = {}) {
+            const std::shared_ptr<EventLoop> loop = leastLoaded();
+            auto connection = std::make_shared<Connection>(loop, std::move(executionContext), std::move(frameHandler), std::move(options));
+            connection->open();
+            return connection;
+        }
+
+        // Listens for WebSocket clients, accepting on one of the loops. upgrade runs on the loop that got the connection,
+        // and decides which FrameHandler, if any, the connection runs with.
+        std::variant<Failure, std::shared_ptr<Listener>> listen(UpgradeFn upgrade, ServerOptions options = {}) {
+            std::shared_ptr<Listener> listener{new Listener(loops_, std::move(upgrade), std::move(options))};
+            if (std::optional<Failure> failure = listener->bind()) {
+                return *failure;
+            }
+            return listener;
+        }
+
+        // co_await gives the open AsyncConnection, or the Failure that kept it from opening. Called from one of this
+        // reactor's loops, the connection stays on that loop, so a coroutine awaiting it never changes thread. Without
+        // ConnectionOptions::addresses, the host is looked up on the reactor's resolver thread rather than the loop.
+        [[nodiscard]] auto asyncConnect(ExecutionContext executionContext, ConnectionOptions options = {}) {
+            struct Awaiter {
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                void await_suspend(std::coroutine_handle<> connector) {
+                    if (options.addresses) {
+                        open(connector);
+                        return;
+                    }
+                    // The lookup blocks, so it runs on the resolver and the connection opens on the loop once it is done.
+                    resolver->resolve(executionContext, [this, connector](Resolver::Resolved resolved) {
+                        loop->post([this, connector, resolved = std::move(resolved)] {
+                            if (const auto *failure = std::get_if<Failure>(&resolved)) {
+                                if (options.onClosed) {
+                                    options.onClosed(*failure);
+                                }
+                                this->failure = *failure;
+                                connector.resume();
+                                return;
+                            }
+                            options.addresses = std::get<std::shared_ptr<const ResolvedAddresses>>(resolved);
+                            open(connector);
+                        });
+                    });
+                }
+
+                void open(std::coroutine_handle<> connector) {
+                    auto inbox = std::make_unique<AsyncConnection::Inbox>();
+                    AsyncConnection::Inbox *received = inbox.get();
+                    auto opened = std::make_shared<bool>(false);
+                    ConnectionOptions connectionOptions = options;
+                    connectionOptions.onOpen = [connector, opened, onOpen = options.onOpen] {
+                        *opened = true;
+                        if (onOpen) {
+                            onOpen();
+                        }
+                        connector.resume();
+                    };
+                    connectionOptions.onClosed = [this, connector, opened, received, onClosed = options.onClosed](const auto &result) {
+                        if (onClosed) {
+                            onClosed(result);
+                        }
+                        if (*opened) {
+                            received->closed(result);
+                            return;
+                        }
+                        const auto *failure = std::get_if<Failure>(&result);
+                        this->failure = failure ? *failure : Failure{"WebSocket connection closed before it opened"};
+                        connector.resume();
+                    };
+                    auto opening = std::make_shared<Connection>(loop, std::move(executionContext), std::move(inbox), std::move(connectionOptions));
+                    connection = opening;
+                    this->inbox = received;
+                    opening->open();
+                }
+
+                std::variant<Failure, AsyncConnection> await_resume() {
+                    if (failure) {
+                        return *failure;
+                    }
+                    return AsyncConnection{std::move(connection), *inbox};
+                }
+
+                Resolver *resolver;
+                std::shared_ptr<EventLoop> loop;
+                ExecutionContext executionContext;
+                ConnectionOptions options;
+                std::shared_ptr<Connection> connection = nullptr;
+                AsyncConnection::Inbox *inbox = nullptr;
+                std::optional<Failure> failure = std::nullopt;
+            };
+            return Awaiter{resolver_.get(), currentOrLeastLoaded(), std::move(executionContext), std::move(options)};
+        }
+
+        // Thread safe. Starts task on the loops in turn. An exception escaping it terminates the process, and a task
+        // still suspended when the Reactor is destroyed is never resumed.
+        void spawn(Task<> task) {
+            loops_[nextSpawn_++ % loops_.size()]->spawn(std::move(task));
+        }
+
+        [[nodiscard]] std::size_t threads() const {
+            return loops_.size();
+        }
+
+        [[nodiscard]] std::size_t connections() const {
+            std::size_t connections = 0;
+            for (const std::shared_ptr<EventLoop> &loop : loops_) {
+                connections += loop->connections();
+            }
+            return connections;
+        }
+
+        // co_await moves the coroutine to the loop with the fewest connections, so that the next connection it opens
+        // goes there too. It stays put when its own loop has no more connections than that one.
+        [[nodiscard]] auto rebalance() const {
+            struct Awaiter {
+                bool await_ready() const noexcept {
+                    return target.get() == EventLoop::current();
+                }
+
+                void await_suspend(std::coroutine_handle<> mover) const {
+                    target->post([mover] { mover.resume(); });
+                }
+
+                void await_resume() const noexcept {}
+
+                std::shared_ptr<EventLoop> target;
+            };
+            std::shared_ptr<EventLoop> target = leastLoaded();
+            for (const std::shared_ptr<EventLoop> &loop : loops_) {
+                if (loop.get() == EventLoop::current() && loop->connections() <= target->connections()) {
+                    target = loop;
+                }
+            }
+            return Awaiter{std::move(target)};
+        }
+
+    private:
+        std::shared_ptr<EventLoop> currentOrLeastLoaded() const {
+            for (const std::shared_ptr<EventLoop> &loop : loops_) {
+                if (loop.get() == EventLoop::current()) {
+                    return loop;
+                }
+            }
+            return leastLoaded();
+        }
+
+        std::shared_ptr<EventLoop> leastLoaded() const {
+            return *std::min_element(loops_.begin(), loops_.end(), [](const auto &lhs, const auto &rhs) {
+                return lhs->connections() < rhs->connections();
+            });
+        }
+
+        std::vector<std::shared_ptr<EventLoop>> loops_;
+        std::vector<std::thread> threads_;
+        std::atomic<std::size_t> nextSpawn_ = 0;
+        std::unique_ptr<Resolver> resolver_ = std::make_unique<Resolver>();
+    };
+
+    struct ConnectionPoolOptions final {
+        // Connections open at once to any one host, counting every port and uri on it.
+        std::size_t maxConnectionsPerHost = 4;
+        // Options for every pooled connection. Its onClosed still runs, after the subscribers have been told.
+        ConnectionOptions connectionOptions{};
+    };
+
+    // Shares one Connection between every subscriber to the same ExecutionContext. Each subscriber has its own
+    // MessageHandler, and every message is passed to all of them in turn on the loop thread as the same view, so a
+    // message is decoded once however many subscribers there are. The first subscriber opens the connection and the
+    // last one to leave closes it. Thread safe. An exception from any subscriber's handler fails the shared connection.
+    struct ConnectionPool final {
+        using ClosedFn = std::function<void(const std::variant<Failure, std::monostate> &)>;
+
+    private:
+        struct Subscriber final {
+            uint64_t id;
+            std::shared_ptr<MessageHandler> messageHandler;
+            ClosedFn onClosed;
+        };
+
+        // The subscribers are copied on write, so the loop delivers to a snapshot and a handler may unsubscribe,
+        // or subscribe another, from inside the call.
+        struct Channel final {
+            void deliver(const MessageView &messageView) {
+                std::shared_ptr<const std::vector<Subscriber>> snapshot;
+                {
+                    std::lock_guard lock{mutex};
+                    snapshot = subscribers;
+                }
+                for (const Subscriber &subscriber : *snapshot) {
+                    subscriber.messageHandler->handle(messageView);
+                }
+            }
+
+            std::mutex mutex;
+            std::shared_ptr<const std::vector<Subscriber>> subscribers = std::make_shared<const std::vector<Subscriber>>();
+            // The loop keeps an open connection alive, so the channel only watches it.
+            std::weak_ptr<Connection> connection;
+        };
+
+        struct FanOut final : FrameHandler {
+            explicit FanOut(std::shared_ptr<Channel> channel) : channel_(std::move(channel)) {}
+
+            void handlePing(const PingFrame &pingFrame) override { deliver(OpCode::Ping, pingFrame.value()); }
+
+            void handlePong(const PongFrame &pongFrame) override { deliver(OpCode::Pong, pongFrame.value()); }
+
+            void handleText(const TextFrame &textFrame) override { deliver(OpCode::Text, textFrame.value()); }
+
+            void handleBinary(const BinaryFrame &binaryFrame) override {
+                deliver(OpCode::Binary, {binaryFrame.value().data(), binaryFrame.value().size()});
+            }
+
+            void handleClose(const CloseFrame &closeFrame) override { deliver(OpCode::Close, closeFrame.value()); }
+
+            void handleUndefined(const UndefinedFrame &undefinedFrame) override { channel_->deliver(MessageView{undefinedFrame}); }
+
+            void handlePingView(const PingFrameView &pingFrameView) override { channel_->deliver(MessageView{pingFrameView}); }
+
+            void handlePongView(const PongFrameView &pongFrameView) override { channel_->deliver(MessageView{pongFrameView}); }
+
+            void handleTextView(const TextFrameView &textFrameView) override { channel_->deliver(MessageView{textFrameView}); }
+
+            void handleBinaryView(const BinaryFrameView &binaryFrameView) override { channel_->deliver(MessageView{binaryFrameView}); }
+
+            void handleCloseView(const CloseFrameView &closeFrameView) override { channel_->deliver(MessageView{closeFrameView}); }
+
+        private:
+            void deliver(OpCode opCode, std::string_view payload) {
+                channel_->deliver(frameView(opCode, payload));
+            }
+
+            std::shared_ptr<Channel> channel_;
+        };
+
+        struct State final {
+            explicit State(ConnectionPoolOptions options) : options(std::move(options)) {}
+
+            // Drops the channel if it is still the one pooled for executionContext. Takes the state's lock.
+            void release(const ExecutionContext &executionContext, const std::shared_ptr<Channel> &channel) {
+                std::lock_guard lock{mutex};
+                drop(executionContext, channel);
+            }
+
+            // As release, for a caller that already holds the state's lock.
+            void drop(const ExecutionContext &executionContext, const std::shared_ptr<Channel> &channel) {
+                auto pooled = channels.find(executionContext);
+                if (pooled != channels.end() && pooled->second == channel) {
+                    channels.erase(pooled);
+                    if (--hosts[executionContext.host()] == 0) {
+                        hosts.erase(executionContext.host());
+                    }
+                }
+            }
+
+            const ConnectionPoolOptions options;
+            std::mutex mutex;
+            std::map<ExecutionContext, std::shared_ptr<Channel>> channels;
+            std::map<std::string, std::size_t> hosts;
+            uint64_t nextId = 0;
+        };
+
+    public:
+        // One subscriber's share of a pooled connection. Destroying it unsubscribes, closing the connection if it
+        // was the last.
+        struct Subscription final {
+            Subscription(const Subscription &) = delete;
+
+            Subscription &operator=(const Subscription &) = delete;
+
+            Subscription(Subscription &&other) noexcept
+                    : state_(std::move(other.state_))
+                    , executionContext_(std::move(other.executionContext_))
+                    , channel_(std::move(other.channel_))
+                    , id_(other.id_) {}
+
+            Subscription &operator=(Subscription &&) = delete;
+
+            ~Subscription() {
+                if (!channel_) {
+                    return;
+                }
+                // Leaving and dropping an emptied channel from the pool happen under the state's lock, taken before
+                // the channel's as subscribe() does, so no one can join a channel that is about to be closed.
+                std::shared_ptr<State> state = state_.lock();
+                std::unique_lock<std::mutex> stateLock;
+                if (state) {
+                    stateLock = std::unique_lock{state->mutex};
+                }
+                {
+                    std::lock_guard lock{channel_->mutex};
+                    auto subscribers = std::make_shared<std::vector<Subscriber>>();
+                    for (const Subscriber &subscriber : *channel_->subscribers) {
+                        if (subscriber.id != id_) {
+                            subscribers->push_back(subscriber);
+                        }
+                    }
+                    channel_->subscribers = std::move(subscribers);
+                    if (!channel_->subscribers->empty()) {
+                        return;
+                    }
+                }
+                if (state) {
+                    state->drop(executionContext_, channel_);
+                    stateLock.unlock();
+                }
+                if (std::shared_ptr<Connection> connection = channel_->connection.lock()) {
+                    connection->close();
+                }
+            }
+
+            // Thread safe. Sends on the shared connection; dropped if it has already closed.
+            void send(OpCode opCode, std::string_view payload) const {
+                if (std::shared_ptr<Connection> connection = channel_->connection.lock()) {
+                    connection->send(opCode, payload);
+                }
+            }
+
+            // The shared connection, or nullptr once it has closed.
+            [[nodiscard]] std::shared_ptr<Connection> connection() const {
+                return channel_->connection.lock();
+            }
+
+            [[nodiscard]] const ExecutionContext &executionContext() const {
+                return executionContext_;
+            }
+
+        private:
+            friend struct ConnectionPool;
+
+            Subscription(std::weak_ptr<State> state, ExecutionContext executionContext, std::shared_ptr<Channel> channel, uint64_t id)
+                    : state_(std::move(state))
+                    , executionContext_(std::move(executionContext))
+                    , channel_(std::move(channel))
+                    , id_(id) {}
+
+            std::weak_ptr<State> state_;
+            ExecutionContext executionContext_;
+            std::shared_ptr<Channel> channel_;
+            uint64_t id_;
+        };
+
+        explicit ConnectionPool(Reactor &reactor, ConnectionPoolOptions options = {})
+                : reactor_(reactor), state_(std::make_shared<State>(std::move(options))) {}
+
+        ConnectionPool(const ConnectionPool &) = delete;
+
+        ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+        // Gives the frameHandler every message on the connection to executionContext, opening it for the first
+        // subscriber, or the Failure when that would take its host past maxConnectionsPerHost. onClosed runs on the
+        // loop thread if the connection ends while subscribed; the next subscribe opens a new one.
+        std::variant<Failure, Subscription> subscribe(const ExecutionContext &executionContext,
+                                                      std::unique_ptr<FrameHandler> frameHandler,
+                                                      ClosedFn onClosed = nullptr) {
+            std::shared_ptr<Channel> channel;
+            uint64_t id = 0;
+            bool opening = false;
+            {
+                std::lock_guard lock{state_->mutex};
+                auto pooled = state_->channels.find(executionContext);
+                if (pooled == state_->channels.end()) {
+                    std::size_t &open = state_->hosts[executionContext.host()];
+                    if (open >= state_->options.maxConnectionsPerHost) {
+                        if (open == 0) {
+                            state_->hosts.erase(executionContext.host());
+                        }
+                        return Failure{"WebSocket pool already has " + std::to_string(open) + " connections to " + executionContext.host()};
+                    }
+                    ++open;
+                    pooled = state_->channels.emplace(executionContext, std::make_shared<Channel>()).first;
+                    opening = true;
+                }
+                channel = pooled->second;
+                id = state_->nextId++;
+                std::lock_guard channelLock{channel->mutex};
+                auto subscribers = std::make_shared<std::vector<Subscriber>>(*channel->subscribers);
+                subscribers->push_back(Subscriber{id, std::make_shared<MessageHandler>(std::move(frameHandler)), std::move(onClosed)});
+                channel->subscribers = std::move(subscribers);
+            }
+            Subscription subscription{state_, executionContext, channel, id};
+            if (opening) {
+                open(executionContext, channel);
+            }
+            return subscription;
+        }
+
+        // Connections pooled right now, opening or open.
+        [[nodiscard]] std::size_t connections() const {
+            std::lock_guard lock{state_->mutex};
+            return state_->channels.size();
+        }
+
+        [[nodiscard]] std::size_t connections(const std::string &host) const {
+            std::lock_guard lock{state_->mutex};
+            auto open = state_->hosts.find(host);
+            return open == state_->hosts.end() ? 0 : open->second;
+        }
+
+        [[nodiscard]] std::size_t subscribers(const ExecutionContext &executionContext) const {
+            std::lock_guard lock{state_->mutex};
+            auto pooled = state_->channels.find(executionContext);
+            if (pooled == state_->channels.end()) {
+                return 0;
+            }
+            std::lock_guard channelLock{pooled->second->mutex};
+            return pooled->second->subscribers->size();
+        }
+
+    private:
+        // Name resolution blocks the subscribing thread, as Reactor::connect does, but not other subscribers.
+        void open(const ExecutionContext &executionContext, const std::shared_ptr<Channel> &channel) {
+            ConnectionOptions options = state_->options.connectionOptions;
+            options.onClosed = [state = std::weak_ptr<State>{state_}, executionContext, weakChannel = std::weak_ptr<Channel>{channel},
+                                onClosed = std::move(options.onClosed)](const auto &result) {
+                if (std::shared_ptr<Channel> channel = weakChannel.lock()) {
+                    if (std::shared_ptr<State> pool = state.lock()) {
+                        pool->release(executionContext, channel);
+                    }
+                    std::shared_ptr<const std::vector<Subscriber>> subscribers;
+                    {
+                        std::lock_guard lock{channel->mutex};
+                        subscribers = channel->subscribers;
+                    }
+                    for (const Subscriber &subscriber : *subscribers) {
+                        if (subscriber.onClosed) {
+                            subscriber.onClosed(result);
+                        }
+                    }
+                }
+                if (onClosed) {
+                    onClosed(result);
+                }
+            };
+            std::shared_ptr<Connection> connection = reactor_.connect(executionContext, std::make_unique<FanOut>(channel), std::move(options));
+            bool abandoned = false;
+            {
+                std::lock_guard lock{channel->mutex};
+                channel->connection = connection;
+                abandoned = channel->subscribers->empty();
+            }
+            // Every subscriber left while the host was being resolved.
+            if (abandoned) {
+                connection->close();
+            }
+        }
+
+        Reactor &reactor_;
+        std::shared_ptr<State> state_;
+    };
+
+    // co_await resumes the coroutine on the same loop once delay has passed, without holding up the loop's thread.
+    // Only valid on a loop thread.
+    inline auto sleepFor(EventLoop::Clock::duration delay) {
+        struct Awaiter {
+            bool await_ready() const noexcept {
+                return delay <= EventLoop::Clock::duration::zero();
+            }
+
+            void await_suspend(std::coroutine_handle<> sleeper) const {
+                EventLoop *loop = EventLoop::current();
+                if (loop == nullptr) {
+                    throw std::logic_error("SimpleWebSocket::sleepFor awaited outside an EventLoop");
+                }
+                loop->after(delay, [sleeper] { sleeper.resume(); });
+            }
+
+            void await_resume() const noexcept {}
+
+            EventLoop::Clock::duration delay;
+        };
+        return Awaiter{delay};
+    }
+
+    // As sleepFor, but resumes early once stopToken is stopped.
+    inline auto sleepFor(EventLoop::Clock::duration delay, std::stop_token stopToken) {
+        struct Awaiter {
+            bool await_ready() const noexcept {
+                return delay <= EventLoop::Clock::duration::zero() || stopToken.stop_requested();
+            }
+
+            void await_suspend(std::coroutine_handle<> sleeper) {
+                EventLoop *loop = EventLoop::current();
+                if (loop == nullptr) {
+                    throw std::logic_error("SimpleWebSocket::sleepFor awaited outside an EventLoop");
+                }
+                // Whichever of the timer and the stop request comes first resumes the sleeper.
+                auto woken = std::make_shared<std::atomic<bool>>(false);
+                std::function<void()> wake = [sleeper, woken] {
+                    if (!woken->exchange(true)) {
+                        sleeper.resume();
+                    }
+                };
+                loop->after(delay, wake);
+                stopped.emplace(stopToken, [loop, wake] { loop->post(wake); });
+            }
+
+            void await_resume() {
+                stopped.reset();
+            }
+
+            EventLoop::Clock::duration delay;
+            std::stop_token stopToken;
+            std::optional<std::stop_callback<std::function<void()>>> stopped;
+        };
+        return Awaiter{delay, std::move(stopToken), std::nullopt};
+    }
+
+    // Workflow for coroutines: runs runFn until it completes, waiting out the reconnectPolicy's delay on the loop after
+    // each failure instead of parking a thread, and giving up once its attempt budget is spent. The workflow has to
+    // outlive the task runUntilCancelled returns.
+    struct AsyncWorkflow final {
+        // Waits exactly retryDelay between attempts, for as long as it takes.
+        explicit AsyncWorkflow(std::function<Task<WorkflowResult>()> runFn,
+                               std::function<void(const std::monostate &)> successFn,
+                               std::function<void(const Failure &)> recoveryFn,
+                               EventLoop::Clock::duration retryDelay = std::chrono::seconds{1})
+                : AsyncWorkflow(std::move(runFn), std::move(successFn), std::move(recoveryFn),
+                                ReconnectPolicy{{.initialDelay = retryDelay, .maxDelay = retryDelay, .jitter = 0.0}})
+        { }
+
+        AsyncWorkflow(std::function<Task<WorkflowResult>()> runFn,
+                      std::function<void(const std::monostate &)> successFn,
+                      std::function<void(const Failure &)> recoveryFn,
+                      ReconnectPolicy reconnectPolicy)
+                : runFn_(std::move(runFn))
+                , successFn_(std::move(successFn))
+                , recoveryFn_(std::move(recoveryFn))
+                , reconnectPolicy_(std::move(reconnectPolicy))
+        { }
+
+        Task<> runUntilCancelled() {
+            while (true) {
+                const EventLoop::Clock::time_point started = EventLoop::Clock::now();
+                WorkflowResult workflowResult = co_await runFn_();
+                workflowResult.template match<void>(recoveryFn_, successFn_);
+                if (workflowResult.complete()) {
+                    co_return;
+                }
+
+                const std::optional<EventLoop::Clock::duration> delay = reconnectPolicy_.next(EventLoop::Clock::now() - started);
+                if (!delay) {
+                    co_return;
+                }
+                co_await sleepFor(*delay);
+            }
+        }
+
+    private:
+        const std::function<Task<WorkflowResult>()> runFn_;
+        const std::function<void(const std::monostate &)> successFn_;
+        const std::function<void(const Failure &)> recoveryFn_;
+        ReconnectPolicy reconnectPolicy_;
+    };
+
+    // Restarts shared by every session of a Supervisor: up to capacity back to back, then one every refillEvery. When
+    // an upstream outage cuts off hundreds of sessions, they come back at that rate instead of all at once. Thread safe.
+    struct RetryBudget final {
+        using Clock = EventLoop::Clock;
+
+        // A capacity of zero never holds a restart back.
+        RetryBudget(std::size_t capacity, Clock::duration refillEvery)
+                : capacity_(capacity), refillEvery_(std::max(refillEvery, Clock::duration{1})), tokens_(capacity) {}
+
+        // Takes a restart and gives zero, or gives how long until the next one is earned.
+        [[nodiscard]] Clock::duration acquire(Clock::time_point now = Clock::now()) {
+            if (capacity_ == 0) {
+                return Clock::duration::zero();
+            }
+            std::lock_guard lock{mutex_};
+            if (tokens_ == capacity_) {
+                // A full budget earns nothing until one is taken.
+                refilled_ = now;
+            } else if (const auto earned = (now - refilled_) / refillEvery_; earned > 0) {
+                tokens_ = std::min(capacity_, tokens_ + static_cast<std::size_t>(earned));
+                refilled_ += refillEvery_ * earned;
+            }
+            if (tokens_ == 0) {
+                return refilled_ + refillEvery_ - now;
+            }
+            --tokens_;
+            return Clock::duration::zero();
+        }
+
+    private:
+        const std::size_t capacity_;
+        const Clock::duration refillEvery_;
+        std::mutex mutex_;
+        std::size_t tokens_;
+        Clock::time_point refilled_;
+    };
+
+    struct SupervisorOptions final {
+        // Restarts the sessions may make back to back between them. Zero leaves restarts to each session's policy.
+        std::size_t retryBudget = 0;
+        // How often the budget earns back one restart.
+        EventLoop::Clock::duration refillEvery = std::chrono::milliseconds{100};
+        // How long stop() waits for the sessions to finish once it has asked them to.
+        EventLoop::Clock::duration drainTimeout = std::chrono::seconds{5};
+    };
+
+    // Runs many AsyncWorkflow sessions on a Reactor's loops, so hundreds of feeds share a few threads. After a failure
+    // a session waits out its own ReconnectPolicy, then for the shared RetryBudget, and restarts on the loop with the
+    // fewest connections. runFn gets the supervisor's stop token, and stop() asks every session to finish through it.
+    // The Supervisor has to be destroyed before the Reactor.
+    struct Supervisor final {
+        using RunFn = std::function<Task<WorkflowResult>(std::stop_token)>;
+
+        explicit Supervisor(Reactor &reactor, SupervisorOptions options = {})
+                : reactor_(reactor), state_(std::make_shared<State>(options)) {}
+
+        Supervisor(const Supervisor &) = delete;
+
+        Supervisor &operator=(const Supervisor &) = delete;
+
+        ~Supervisor() {
+            stop();
+        }
+
+        // Thread safe. Starts a session on the reactor's loops in turn. Does nothing once stop() has been called.
+        void supervise(RunFn runFn,
+                       std::function<void(const std::monostate &)> successFn,
+                       std::function<void(const Failure &)> recoveryFn,
+                       ReconnectPolicy reconnectPolicy = ReconnectPolicy{}) {
+            {
+                std::lock_guard lock{state_->mutex};
+                if (state_->stopSource.stop_requested()) {
+                    return;
+                }
+                ++state_->running;
+            }
+            reactor_.spawn(run(reactor_, state_, std::make_shared<Session>(Session{
+                    std::move(runFn), std::move(successFn), std::move(recoveryFn), std::move(reconnectPolicy)})));
+        }
+
+        // Thread safe. Asks every session to stop through its stop token, and waits up to drainTimeout for them to
+        // finish. True once none is left running. The sessions finish on the loops, so call it from outside them.
+        bool stop() {
+            state_->stopSource.request_stop();
+            std::unique_lock lock{state_->mutex};
+            return state_->drained.wait_for(lock, state_->options.drainTimeout, [this] { return state_->running == 0; });
+        }
+
+        [[nodiscard]] std::stop_token stopToken() const {
+            return state_->stopSource.get_token();
+        }
+
+        // Sessions that have not yet completed, given up or stopped.
+        [[nodiscard]] std::size_t running() const {
+            std::lock_guard lock{state_->mutex};
+            return state_->running;
+        }
+
+        // Restarts after a failure, across every session.
+        [[nodiscard]] uint64_t restarts() const {
+            return state_->restarts;
+        }
+
+    private:
+        struct Session final {
+            RunFn runFn;
+            std::function<void(const std::monostate &)> successFn;
+            std::function<void(const Failure &)> recoveryFn;
+            ReconnectPolicy reconnectPolicy;
+        };
+
+        // Shared with the sessions, which may still be finishing when the Supervisor is destroyed.
+        struct State final {
+            explicit State(SupervisorOptions supervisorOptions)
+                    : options(supervisorOptions), budget(supervisorOptions.retryBudget, supervisorOptions.refillEvery) {}
+
+            const SupervisorOptions options;
+            RetryBudget budget;
+            std::stop_source stopSource;
+            mutable std::mutex mutex;
+            std::condition_variable drained;
+            std::size_t running = 0;
+            std::atomic<uint64_t> restarts = 0;
+        };
+
+        static Task<> run(const Reactor &reactor, std::shared_ptr<State> state, std::shared_ptr<Session> session) {
+            const std::stop_token stopToken = state->stopSource.get_token();
+            while (!stopToken.stop_requested()) {
+                const EventLoop::Clock::time_point started = EventLoop::Clock::now();
+                WorkflowResult workflowResult = co_await session->runFn(stopToken);
+                workflowResult.template match<void>(session->recoveryFn, session->successFn);
+                if (workflowResult.complete()) {
+                    break;
+                }
+
+                const std::optional<EventLoop::Clock::duration> delay = session->reconnectPolicy.next(EventLoop::Clock::now() - started);
+                if (!delay) {
+                    break;
+                }
+                co_await sleepFor(*delay, stopToken);
+                EventLoop::Clock::duration wait = state->budget.acquire();
+                while (wait > EventLoop::Clock::duration::zero() && !stopToken.stop_requested()) {
+                    co_await sleepFor(wait, stopToken);
+                    wait = state->budget.acquire();
+                }
+                if (stopToken.stop_requested()) {
+                    break;
+                }
+                ++state->restarts;
+                co_await reactor.rebalance();
+            }
+
+            std::lock_guard lock{state->mutex};
+            if (--state->running == 0) {
+                state->drained.notify_all();
+            }
+        }
+
+        Reactor &reactor_;
+        std::shared_ptr<State> state_;
+    };
 }
+#endif
 
 #if __has_include(<Poco/Net/WebSocket.h>)
-#include <span>
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/NetSSL.h>
 #include <Poco/Net/HTTPSClientSession.h>
+#include <Poco/Net/NetException.h>
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/StreamSocket.h>
+#include <Poco/Net/SecureStreamSocket.h>
+#include <Poco/Net/SSLManager.h>
+#include <Poco/Net/Context.h>
+#include <Poco/Net/Session.h>
+#include <Poco/Timespan.h>
+#include <map>
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <climits>
+#include <cerrno>
+#endif
 
 namespace SimpleWebSocket::Poco {
     constexpr int PING_FRAME   = static_cast<int>(::Poco::Net::WebSocket::FRAME_FLAG_FIN) |
@@ -358,70 +7036,633 @@ namespace SimpleWebSocket::Poco {
     constexpr int CLOSE_FRAME  = static_cast<int>(::Poco::Net::WebSocket::FRAME_FLAG_FIN) |
                                  static_cast<int>(::Poco::Net::WebSocket::FRAME_OP_CLOSE);
 
+    inline bool fin(int flags) {
+      return (flags & ::Poco::Net::WebSocket::FRAME_FLAG_FIN) != 0;
+    }
+
+    inline SimpleWebSocket::OpCode opCode(int flags) {
+      return static_cast<SimpleWebSocket::OpCode>(flags & ::Poco::Net::WebSocket::FRAME_OP_BITMASK);
+    }
+
     inline SimpleWebSocket::Message fromPoco(int flags, const char *buf, int size) {
       switch(flags) {
         case PING_FRAME:
-          return SimpleWebSocket::Message{SimpleWebSocket::PingFrame{std::string(buf, size)}};
+          return SimpleWebSocket::Message{std::in_place_type<SimpleWebSocket::PingFrame>, std::string(buf, size)};
         case PONG_FRAME:
-          return SimpleWebSocket::Message{SimpleWebSocket::PongFrame{std::string(buf, size)}};
+          return SimpleWebSocket::Message{std::in_place_type<SimpleWebSocket::PongFrame>, std::string(buf, size)};
         case TEXT_FRAME:
-          return SimpleWebSocket::Message{SimpleWebSocket::TextFrame{std::string(buf, size)}};
+          return SimpleWebSocket::Message{std::in_place_type<SimpleWebSocket::TextFrame>, std::string(buf, size)};
         case BINARY_FRAME:
-          return SimpleWebSocket::Message{SimpleWebSocket::BinaryFrame{std::vector<char>(buf, buf + size)}};
+          return SimpleWebSocket::Message{std::in_place_type<SimpleWebSocket::BinaryFrame>, std::vector<char>(buf, buf + size)};
         case CLOSE_FRAME:
-          return SimpleWebSocket::Message{SimpleWebSocket::CloseFrame{std::string(buf, size)}};
+          return SimpleWebSocket::Message{std::in_place_type<SimpleWebSocket::CloseFrame>, std::string(buf, size)};
         default:
           return SimpleWebSocket::Message{SimpleWebSocket::UndefinedFrame{}};
       }
     }
 
-    template<int SIZE>
+    inline SimpleWebSocket::MessageView viewFromPoco(int flags, const char *buf, int size) {
+      std::string_view value{buf, static_cast<size_t>(size)};
+      switch(flags) {
+        case PING_FRAME:
+          return SimpleWebSocket::MessageView{SimpleWebSocket::PingFrameView{value}};
+        case PONG_FRAME:
+          return SimpleWebSocket::MessageView{SimpleWebSocket::PongFrameView{value}};
+        case TEXT_FRAME:
+          return SimpleWebSocket::MessageView{SimpleWebSocket::TextFrameView{value}};
+        case BINARY_FRAME:
+          return SimpleWebSocket::MessageView{SimpleWebSocket::BinaryFrameView{std::as_bytes(std::span{value})}};
+        case CLOSE_FRAME:
+          return SimpleWebSocket::MessageView{SimpleWebSocket::CloseFrameView{value}};
+        default:
+          return SimpleWebSocket::MessageView{SimpleWebSocket::UndefinedFrame{}};
+      }
+    }
+
+    // fromPoco with the payload allocated from allocator, e.g. std::pmr::polymorphic_allocator<char>{&payloadArena}.
+    template<class Allocator>
+    SimpleWebSocket::BasicMessage<Allocator> fromPoco(int flags, const char *buf, int size, const Allocator &allocator) {
+      return viewFromPoco(flags, buf, size).materialize(allocator);
+    }
+
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
     struct Wrapper final {
-      explicit Wrapper(const ::Poco::Net::WebSocket& webSocket) : webSocket_(webSocket) { }
+      explicit Wrapper(const ::Poco::Net::WebSocket& webSocket)
+        : webSocket_(webSocket)
+        , buffer_(new Buffer)
+      { }
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+      // A client connection that negotiated permessage-deflate. Text and binary messages sent through send(const
+      // std::string &, int) are compressed, and reassemblers made by reassembler() inflate what arrives.
+      Wrapper(const ::Poco::Net::WebSocket& webSocket,
+              const SimpleWebSocket::DeflateParameters &deflate,
+              std::shared_ptr<SimpleWebSocket::ZlibPool> pool = SimpleWebSocket::ZlibPool::shared())
+        : webSocket_(webSocket)
+        , buffer_(new Buffer)
+        , deflate_(deflate)
+        , pool_(std::move(pool))
+      {
+        // zlib cannot deflate with a 256 byte window, so a server asking for one is only ever sent uncompressed data.
+        if (deflate.clientMaxWindowBits > 8) {
+          deflater_ = std::make_unique<SimpleWebSocket::Deflater>(SimpleWebSocket::Role::Client, deflate, pool_);
+        }
+      }
+
+      [[nodiscard]] const std::optional<SimpleWebSocket::DeflateParameters> &deflate() const {
+        return deflate_;
+      }
+#endif
+
+      Wrapper(const Wrapper &) = delete;
+
+      Wrapper &operator=(const Wrapper &) = delete;
 
       ~Wrapper() {
         webSocket_.close();
       }
 
+      // The returned span points into this Wrapper's receive buffer and stays valid until the next receive.
       [[nodiscard]] std::span<char> receive(int &flags) {
-        char buffer[SIZE];
-        int bytesReceived = webSocket_.receiveFrame(buffer, SIZE, flags);
-        return {buffer, static_cast<size_t>(bytesReceived)};
+        return receive(std::span<char>{buffer_->data, SIZE}, flags);
+      }
+
+      [[nodiscard]] std::span<char> receive(std::span<char> buffer, int &flags) {
+        int bytesReceived = webSocket_.receiveFrame(buffer.data(), static_cast<int>(buffer.size()), flags);
+        if constexpr (M::ENABLED) {
+          received_ = SimpleWebSocket::Metrics::Clock::now();
+          if (bytesReceived > 0 || flags != 0) {
+            metrics_.received(opCode(flags), static_cast<std::size_t>(bytesReceived));
+          }
+        }
+        return buffer.first(static_cast<size_t>(bytesReceived));
+      }
+
+      // When the last frame was read, for MessageHandler::handle(messageView, received). Only kept with a Metered
+      // policy.
+      [[nodiscard]] SimpleWebSocket::Metrics::Clock::time_point received() const {
+        return received_;
+      }
+
+      // Records into metrics from now on, e.g. instrument(SimpleWebSocket::Metered{registry}).
+      void instrument(M metrics) {
+        metrics_ = std::move(metrics);
+      }
+
+      // Receives one frame and feeds it to the reassembler. Returns std::monostate while a fragmented message is
+      // still incomplete.
+      [[nodiscard]] SimpleWebSocket::ReassemblyResult receive(SimpleWebSocket::Reassembler &reassembler) {
+        if (std::optional<SimpleWebSocket::Failure> failure = beat()) {
+          return *failure;
+        }
+        int flags = 0;
+        std::span<char> frame = receive(flags);
+        if (frame.empty() && flags == 0) {
+          return SimpleWebSocket::Failure{"WebSocket connection closed", SimpleWebSocket::CloseCode::AbnormalClosure};
+        }
+
+        const bool compressed = (flags & ::Poco::Net::WebSocket::FRAME_FLAG_RSV1) != 0;
+        SimpleWebSocket::ReassemblyResult result = reassembler.feed(fin(flags), opCode(flags), {frame.data(), frame.size()}, compressed);
+        if (const auto *messageView = std::get_if<SimpleWebSocket::MessageView>(&result); messageView && heartbeat_) {
+          if (const auto *ping = std::get_if<SimpleWebSocket::PingFrameView>(&messageView->value())) {
+            if (heartbeat_->options().autoPong) {
+              sendFrame(ping->value(), PONG_FRAME);
+            }
+          } else if (const auto *pong = std::get_if<SimpleWebSocket::PongFrameView>(&messageView->value())) {
+            heartbeat_->pong(pong->value());
+          }
+        }
+        return result;
+      }
+
+      // From now on receive(Reassembler &) pings the server every options.interval while it waits for a frame, fails
+      // once options.maxMissedPongs pings in a row have gone unanswered, and answers the server's pings.
+      void keepAlive(const SimpleWebSocket::HeartbeatOptions &options) {
+        heartbeat_.emplace(options);
+        nextPing_ = SimpleWebSocket::Heartbeat::Clock::now() + options.interval;
+      }
+
+      [[nodiscard]] const std::optional<SimpleWebSocket::Heartbeat> &heartbeat() const {
+        return heartbeat_;
+      }
+
+      // A Reassembler for this connection, inflating messages when permessage-deflate was negotiated.
+      [[nodiscard]] SimpleWebSocket::Reassembler reassembler(
+          std::size_t maxMessageSize = SimpleWebSocket::Reassembler::DEFAULT_MAX_MESSAGE_SIZE,
+          bool validateUtf8 = false) const {
+        SimpleWebSocket::Reassembler reassembler{maxMessageSize, validateUtf8};
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+        if (deflate_) {
+          reassembler.setInflater(std::make_unique<SimpleWebSocket::Inflater>(SimpleWebSocket::Role::Client, *deflate_, pool_));
+        }
+#endif
+        return reassembler;
       }
       
       int send(const std::string &message, int opCode) {
-        return webSocket_.sendFrame(message.c_str(), static_cast<int>(message.length()), opCode);
+        return sendFrame({message.data(), message.size()}, opCode);
       }
       
       int send(std::span<char> buffer, int opCode) {
-        return webSocket_.sendBytes(buffer.data(), static_cast<int>(buffer.size()), opCode);
+        return sendFrame({buffer.data(), buffer.size()}, opCode);
+      }
+
+      // Sends every frame in the batch, uncompressed, and clears it. Over plain TCP the batch goes out in one
+      // sendmsg, or a few if the kernel takes it in parts. Over TLS the bytes have to pass through the SSL layer, so
+      // each frame is handed to Poco on its own. Batches for a Wrapper from wrapper() or tls_wrapper() are built with
+      // Role::Client. Returns the number of bytes written.
+      std::size_t send(SimpleWebSocket::SendBatch &batch) {
+        if constexpr (M::ENABLED) {
+          batch.forEach([this](SimpleWebSocket::OpCode opCode, uint8_t, std::span<const std::string_view> pieces) {
+            std::size_t size = 0;
+            for (std::string_view piece : pieces) {
+              size += piece.size();
+            }
+            metrics_.sent(opCode, size);
+          });
+        }
+        const SimpleWebSocket::Metrics::Clock::time_point started = sendStarted();
+        std::size_t sent = 0;
+#if __has_include(<sys/uio.h>)
+        if (!webSocket_.secure()) {
+          sent = sendSegments(batch.encode());
+          batch.clear();
+          sendFinished(started);
+          return sent;
+        }
+#endif
+        batch.forEach([this, &sent](SimpleWebSocket::OpCode opCode, uint8_t reserved, std::span<const std::string_view> pieces) {
+          std::string_view payload = pieces.empty() ? std::string_view{} : pieces.front();
+          if (pieces.size() > 1) {
+            joined_.clear();
+            for (std::string_view piece : pieces) {
+              joined_.append(piece);
+            }
+            payload = joined_;
+          }
+          const int flags = ::Poco::Net::WebSocket::FRAME_FLAG_FIN | reserved | static_cast<int>(opCode);
+          sent += static_cast<std::size_t>(webSocket_.sendFrame(payload.data(), static_cast<int>(payload.size()), flags));
+        });
+        batch.clear();
+        sendFinished(started);
+        return sent;
       }
 
     private:
+      // Sends the pings that fall due until a frame is ready to be read.
+      std::optional<SimpleWebSocket::Failure> beat() {
+        if (!heartbeat_ || heartbeat_->options().interval.count() <= 0) {
+          return std::nullopt;
+        }
+        while (true) {
+          const SimpleWebSocket::Heartbeat::Clock::time_point now = SimpleWebSocket::Heartbeat::Clock::now();
+          if (now >= nextPing_) {
+            std::variant<SimpleWebSocket::Failure, std::string> ping = heartbeat_->ping(now);
+            if (const auto *failure = std::get_if<SimpleWebSocket::Failure>(&ping)) {
+              return *failure;
+            }
+            sendFrame(std::get<std::string>(ping), PING_FRAME);
+            nextPing_ = now + heartbeat_->options().interval;
+          }
+          const auto wait = std::chrono::ceil<std::chrono::microseconds>(nextPing_ - now);
+          if (webSocket_.available() > 0 || webSocket_.poll(::Poco::Timespan{wait.count()}, ::Poco::Net::Socket::SELECT_READ)) {
+            return std::nullopt;
+          }
+        }
+      }
+
+      int sendFrame(std::string_view message, int opCode) {
+        const SimpleWebSocket::Metrics::Clock::time_point started = sendStarted();
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+        if (deflater_ && (opCode == TEXT_FRAME || opCode == BINARY_FRAME) && message.size() >= deflate_->minimumSize) {
+          std::string_view compressed = deflater_->deflate(message);
+          const int sent = webSocket_.sendFrame(compressed.data(), static_cast<int>(compressed.size()),
+                                                opCode | ::Poco::Net::WebSocket::FRAME_FLAG_RSV1);
+          metrics_.sent(SimpleWebSocket::Poco::opCode(opCode), static_cast<std::size_t>(sent));
+          sendFinished(started);
+          return sent;
+        }
+#endif
+        const int sent = webSocket_.sendFrame(message.data(), static_cast<int>(message.size()), opCode);
+        metrics_.sent(SimpleWebSocket::Poco::opCode(opCode), static_cast<std::size_t>(sent));
+        sendFinished(started);
+        return sent;
+      }
+
+      // The clock is only read with a Metered policy.
+      [[nodiscard]] SimpleWebSocket::Metrics::Clock::time_point sendStarted() const {
+        if constexpr (M::ENABLED) {
+          return SimpleWebSocket::Metrics::Clock::now();
+        } else {
+          return {};
+        }
+      }
+
+      void sendFinished(SimpleWebSocket::Metrics::Clock::time_point started) const {
+        if constexpr (M::ENABLED) {
+          metrics_.sendTook(SimpleWebSocket::Metrics::Clock::now() - started);
+        }
+      }
+
+#if __has_include(<sys/uio.h>)
+      // Writes already framed bytes straight to the socket, resuming after partial writes.
+      std::size_t sendSegments(std::span<const std::string_view> segments) {
+        iovecs_.clear();
+        for (std::string_view segment : segments) {
+          iovecs_.push_back(::iovec{const_cast<char *>(segment.data()), segment.size()});
+        }
+
+        const int fd = webSocket_.impl()->sockfd();
+        std::span<::iovec> pending{iovecs_};
+        std::size_t sent = 0;
+        while (!pending.empty()) {
+          ::msghdr message{};
+          message.msg_iov = pending.data();
+          message.msg_iovlen = std::min<std::size_t>(pending.size(), IOV_MAX);
+#ifdef MSG_NOSIGNAL
+          const ssize_t written = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+#else
+          const ssize_t written = ::sendmsg(fd, &message, 0);
+#endif
+          if (written < 0) {
+            const int error = errno;
+            if (error == EINTR) {
+              continue;
+            }
+            if (error == EAGAIN || error == EWOULDBLOCK) {
+              ::pollfd writable{fd, POLLOUT, 0};
+              ::poll(&writable, 1, -1);
+              continue;
+            }
+            throw ::Poco::Net::NetException(std::strerror(error), error);
+          }
+
+          sent += static_cast<std::size_t>(written);
+          auto remaining = static_cast<std::size_t>(written);
+          while (!pending.empty() && remaining >= pending.front().iov_len) {
+            remaining -= pending.front().iov_len;
+            pending = pending.subspan(1);
+          }
+          if (remaining > 0) {
+            pending.front().iov_base = static_cast<char *>(pending.front().iov_base) + remaining;
+            pending.front().iov_len -= remaining;
+          }
+        }
+        return sent;
+      }
+
+      std::vector<::iovec> iovecs_;
+#endif
+      std::string joined_;
+      std::optional<SimpleWebSocket::Heartbeat> heartbeat_;
+      SimpleWebSocket::Heartbeat::Clock::time_point nextPing_;
+      [[no_unique_address]] M metrics_{};
+      SimpleWebSocket::Metrics::Clock::time_point received_{};
+
+      struct alignas(SimpleWebSocket::CACHE_LINE_SIZE) Buffer {
+        char data[SIZE];
+      };
+
       ::Poco::Net::WebSocket webSocket_;
+      std::unique_ptr<Buffer> buffer_;
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+      std::optional<SimpleWebSocket::DeflateParameters> deflate_;
+      std::shared_ptr<SimpleWebSocket::ZlibPool> pool_;
+      std::unique_ptr<SimpleWebSocket::Deflater> deflater_;
+#endif
+    };
+
+    // A client TLS context to share between connections. SSL is initialized once, and the session last negotiated
+    // with each host and port is kept, so that a reconnect offers it and the server can resume it from a session
+    // ticket or its session cache instead of running a full handshake. Thread safe.
+    struct TlsContext final {
+      // Uses the SSLManager's default client context, with client side session caching turned on.
+      TlsContext() : TlsContext(defaultContext()) {}
+
+      explicit TlsContext(::Poco::Net::Context::Ptr context) : context_(std::move(context)) {
+        context_->enableSessionCache(true);
+      }
+
+      TlsContext(const TlsContext &) = delete;
+
+      TlsContext &operator=(const TlsContext &) = delete;
+
+      // The context tls_wrapper() uses when it is not given one.
+      [[nodiscard]] static const std::shared_ptr<TlsContext> &shared() {
+        static const std::shared_ptr<TlsContext> context = std::make_shared<TlsContext>();
+        return context;
+      }
+
+      // Connects and completes the TLS handshake, offering the session cached for host and port.
+      [[nodiscard]] ::Poco::Net::SecureStreamSocket connect(const std::string& host,
+                                                            ::Poco::UInt16 port,
+                                                            const ::Poco::Net::SocketAddress &address) {
+        ::Poco::Net::SecureStreamSocket socket{context_};
+        socket.setPeerHostName(host);
+        if (::Poco::Net::Session::Ptr session = cached(host, port)) {
+          socket.useSession(session);
+        }
+        socket.connect(address);
+        socket.completeHandshake();
+        socket.setNoDelay(true);
+        if (socket.sessionWasReused()) {
+          ++resumedHandshakes_;
+        } else {
+          ++fullHandshakes_;
+        }
+        return socket;
+      }
+
+      // Caches the socket's session for the next connection to host and port. Call it once the first response has
+      // been read, as a TLS 1.3 server only sends its session tickets after the handshake.
+      void remember(const std::string& host, ::Poco::UInt16 port, ::Poco::Net::SecureStreamSocket &socket) {
+        ::Poco::Net::Session::Ptr session = socket.currentSession();
+        std::lock_guard lock{mutex_};
+        if (session) {
+          sessions_[{host, port}] = std::move(session);
+        } else {
+          sessions_.erase({host, port});
+        }
+      }
+
+      void forget(const std::string& host, ::Poco::UInt16 port) {
+        std::lock_guard lock{mutex_};
+        sessions_.erase({host, port});
+      }
+
+      [[nodiscard]] uint64_t fullHandshakes() const {
+        return fullHandshakes_;
+      }
+
+      [[nodiscard]] uint64_t resumedHandshakes() const {
+        return resumedHandshakes_;
+      }
+
+      [[nodiscard]] const ::Poco::Net::Context::Ptr &context() const {
+        return context_;
+      }
+
+    private:
+      static ::Poco::Net::Context::Ptr defaultContext() {
+        ::Poco::Net::initializeSSL();
+        return ::Poco::Net::SSLManager::instance().defaultClientContext();
+      }
+
+      [[nodiscard]] ::Poco::Net::Session::Ptr cached(const std::string& host, ::Poco::UInt16 port) {
+        std::lock_guard lock{mutex_};
+        const auto found = sessions_.find({host, port});
+        return found == sessions_.end() ? nullptr : found->second;
+      }
+
+      ::Poco::Net::Context::Ptr context_;
+      std::mutex mutex_;
+      std::map<std::pair<std::string, ::Poco::UInt16>, ::Poco::Net::Session::Ptr> sessions_;
+      std::atomic<uint64_t> fullHandshakes_ = 0;
+      std::atomic<uint64_t> resumedHandshakes_ = 0;
+    };
+
+    // Keeps a connection to one host open ahead of the next reconnect. The host is resolved once, and prepare()
+    // connects and, for TLS, completes the TLS handshake, so that wrapper(standby, uri) only costs the WebSocket
+    // upgrade. TLS connections go through a TlsContext, TlsContext::shared() unless one is given, and resume its
+    // sessions.
+    struct Standby final {
+      Standby(const std::string& host, ::Poco::UInt16 port, bool tls = false)
+        : Standby(host, port, tls ? TlsContext::shared() : nullptr)
+      { }
+
+      Standby(const std::string& host, ::Poco::UInt16 port, std::shared_ptr<TlsContext> tlsContext)
+        : host_(host)
+        , port_(port)
+        , tlsContext_(std::move(tlsContext))
+        , address_(host, port)
+      { }
+
+      // Connects a spare session unless a live one is ready. Blocks for the connect and the TLS handshake, so call it
+      // when the thread has nothing better to do, e.g. right after a WebSocket has opened.
+      void prepare() {
+        if (!spare_.session || !alive(*spare_.session)) {
+          spare_ = connect();
+        }
+      }
+
+      // The prepared session, or a newly connected one if there is none or the server has closed it meanwhile.
+      [[nodiscard]] std::unique_ptr<::Poco::Net::HTTPClientSession> take() {
+        if (!spare_.session || !alive(*spare_.session)) {
+          spare_ = connect();
+        }
+        taken_ = std::move(spare_.socket);
+        spare_.socket.reset();
+        return std::move(spare_.session);
+      }
+
+      // Called by wrapper(standby, uri) once the upgrade response has been read, to keep the TLS session of the
+      // connection last taken for the next one.
+      void upgraded() {
+        if (tlsContext_ && taken_) {
+          tlsContext_->remember(host_, port_, *taken_);
+        }
+        taken_.reset();
+      }
+
+      [[nodiscard]] bool ready() const {
+        return spare_.session != nullptr;
+      }
+
+      [[nodiscard]] const std::string &host() const {
+        return host_;
+      }
+
+      [[nodiscard]] ::Poco::UInt16 port() const {
+        return port_;
+      }
+
+    private:
+      // A server that closed the idle connection leaves it readable, at the end of the stream.
+      static bool alive(::Poco::Net::HTTPClientSession &session) {
+        return !session.socket().poll(::Poco::Timespan{0}, ::Poco::Net::Socket::SELECT_READ);
+      }
+
+      struct Spare {
+        std::unique_ptr<::Poco::Net::HTTPClientSession> session;
+        std::optional<::Poco::Net::SecureStreamSocket> socket;
+      };
+
+      [[nodiscard]] Spare connect() const {
+        if (tlsContext_) {
+          ::Poco::Net::SecureStreamSocket socket = tlsContext_->connect(host_, port_, address_);
+          return Spare{std::make_unique<::Poco::Net::HTTPSClientSession>(socket), socket};
+        }
+        ::Poco::Net::StreamSocket socket;
+        socket.connect(address_);
+        socket.setNoDelay(true);
+        return Spare{std::make_unique<::Poco::Net::HTTPClientSession>(socket), std::nullopt};
+      }
+
+      std::string host_;
+      ::Poco::UInt16 port_;
+      std::shared_ptr<TlsContext> tlsContext_;
+      ::Poco::Net::SocketAddress address_;
+      Spare spare_;
+      std::optional<::Poco::Net::SecureStreamSocket> taken_;
     };
 
-    template<int SIZE>
-    inline Wrapper<SIZE> wrapper(const std::string& host,
-                                 ::Poco::UInt16 port,
-                                 const std::string& uri) {
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> wrapper(const std::string& host,
+                                    ::Poco::UInt16 port,
+                                    const std::string& uri) {
       ::Poco::Net::HTTPClientSession session{host, port};
       ::Poco::Net::HTTPRequest request{::Poco::Net::HTTPRequest::HTTP_GET, uri, ::Poco::Net::HTTPMessage::HTTP_1_1};
       ::Poco::Net::HTTPResponse response;
 
-      return Wrapper<SIZE>{::Poco::Net::WebSocket{session, request, response}};
+      return Wrapper<SIZE, M>{::Poco::Net::WebSocket{session, request, response}};
+    }
+
+    // Connects through tlsContext, resuming the TLS session of the last connection to the same host and port.
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> tls_wrapper(TlsContext &tlsContext,
+                                        const std::string& host,
+                                        ::Poco::UInt16 port,
+                                        const std::string& uri) {
+      ::Poco::Net::SecureStreamSocket socket = tlsContext.connect(host, port, ::Poco::Net::SocketAddress{host, port});
+      ::Poco::Net::HTTPSClientSession session{socket};
+      ::Poco::Net::HTTPRequest request{::Poco::Net::HTTPRequest::HTTP_GET, uri, ::Poco::Net::HTTPMessage::HTTP_1_1};
+      request.setHost(host, port);
+      ::Poco::Net::HTTPResponse response;
+      ::Poco::Net::WebSocket webSocket{session, request, response};
+      tlsContext.remember(host, port, socket);
+
+      return Wrapper<SIZE, M>{webSocket};
+    }
+
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> tls_wrapper(const std::string& host,
+                                        ::Poco::UInt16 port,
+                                        const std::string& uri) {
+      return tls_wrapper<SIZE, M>(*TlsContext::shared(), host, port, uri);
+    }
+
+    // Upgrades the session standby has prepared, or a new one if it has none.
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> wrapper(Standby &standby, const std::string& uri) {
+      std::unique_ptr<::Poco::Net::HTTPClientSession> session = standby.take();
+      ::Poco::Net::HTTPRequest request{::Poco::Net::HTTPRequest::HTTP_GET, uri, ::Poco::Net::HTTPMessage::HTTP_1_1};
+      // A session made from a connected socket does not know the host name.
+      request.setHost(standby.host(), standby.port());
+      ::Poco::Net::HTTPResponse response;
+      ::Poco::Net::WebSocket webSocket{*session, request, response};
+      standby.upgraded();
+
+      return Wrapper<SIZE, M>{webSocket};
+    }
+
+#ifdef SIMPLE_WEBSOCKET_ENABLE_DEFLATE
+    // Wraps a WebSocket whose upgrade offered permessage-deflate, compressing if the server's response agreed to it.
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> negotiatedWrapper(::Poco::Net::WebSocket &webSocket,
+                                              const ::Poco::Net::HTTPResponse &response,
+                                              const SimpleWebSocket::DeflateOptions &options,
+                                              std::shared_ptr<SimpleWebSocket::ZlibPool> pool) {
+      const SimpleWebSocket::DeflateNegotiation negotiation =
+          SimpleWebSocket::negotiateDeflate(options, response.get("Sec-WebSocket-Extensions", ""));
+      if (const auto *failure = std::get_if<SimpleWebSocket::Failure>(&negotiation)) {
+        webSocket.close();
+        throw ::Poco::Net::WebSocketException(failure->value());
+      }
+      if (const auto *parameters = std::get_if<SimpleWebSocket::DeflateParameters>(&negotiation)) {
+        return Wrapper<SIZE, M>{webSocket, *parameters, std::move(pool)};
+      }
+      return Wrapper<SIZE, M>{webSocket};
+    }
+
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> deflateWrapper(::Poco::Net::HTTPClientSession &session,
+                                           const std::string& uri,
+                                           const SimpleWebSocket::DeflateOptions &options,
+                                           std::shared_ptr<SimpleWebSocket::ZlibPool> pool) {
+      ::Poco::Net::HTTPRequest request{::Poco::Net::HTTPRequest::HTTP_GET, uri, ::Poco::Net::HTTPMessage::HTTP_1_1};
+      request.set("Sec-WebSocket-Extensions", options.offer());
+      ::Poco::Net::HTTPResponse response;
+      ::Poco::Net::WebSocket webSocket{session, request, response};
+      return negotiatedWrapper<SIZE, M>(webSocket, response, options, std::move(pool));
+    }
+
+    // Offers permessage-deflate during the upgrade. A server that declines it gives a Wrapper without compression.
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> wrapper(const std::string& host,
+                                    ::Poco::UInt16 port,
+                                    const std::string& uri,
+                                    const SimpleWebSocket::DeflateOptions &options,
+                                    std::shared_ptr<SimpleWebSocket::ZlibPool> pool = SimpleWebSocket::ZlibPool::shared()) {
+      ::Poco::Net::HTTPClientSession session{host, port};
+      return deflateWrapper<SIZE, M>(session, uri, options, std::move(pool));
     }
 
-    template<int SIZE>
-    inline Wrapper<SIZE> tls_wrapper(const std::string& host,
-                                     ::Poco::UInt16 port,
-                                     const std::string& uri) {
-      ::Poco::Net::initializeSSL();
-      ::Poco::Net::HTTPSClientSession session{host, port};
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> tls_wrapper(TlsContext &tlsContext,
+                                        const std::string& host,
+                                        ::Poco::UInt16 port,
+                                        const std::string& uri,
+                                        const SimpleWebSocket::DeflateOptions &options,
+                                        std::shared_ptr<SimpleWebSocket::ZlibPool> pool = SimpleWebSocket::ZlibPool::shared()) {
+      ::Poco::Net::SecureStreamSocket socket = tlsContext.connect(host, port, ::Poco::Net::SocketAddress{host, port});
+      ::Poco::Net::HTTPSClientSession session{socket};
       ::Poco::Net::HTTPRequest request{::Poco::Net::HTTPRequest::HTTP_GET, uri, ::Poco::Net::HTTPMessage::HTTP_1_1};
+      request.setHost(host, port);
+      request.set("Sec-WebSocket-Extensions", options.offer());
       ::Poco::Net::HTTPResponse response;
+      ::Poco::Net::WebSocket webSocket{session, request, response};
+      tlsContext.remember(host, port, socket);
+      return negotiatedWrapper<SIZE, M>(webSocket, response, options, std::move(pool));
+    }
 
-      return Wrapper<SIZE>{::Poco::Net::WebSocket{session, request, response}};
+    template<int SIZE, SimpleWebSocket::MetricsPolicy M = SimpleWebSocket::NoMetrics>
+    inline Wrapper<SIZE, M> tls_wrapper(const std::string& host,
+                                        ::Poco::UInt16 port,
+                                        const std::string& uri,
+                                        const SimpleWebSocket::DeflateOptions &options,
+                                        std::shared_ptr<SimpleWebSocket::ZlibPool> pool = SimpleWebSocket::ZlibPool::shared()) {
+      return tls_wrapper<SIZE, M>(*TlsContext::shared(), host, port, uri, options, std::move(pool));
     }
+#endif
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <Poco/Net/Context.h>
+#include <Poco/Net/HTTPServer.h>
+#include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <Poco/Net/HTTPServerParams.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/SecureServerSocket.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/WebSocket.h>
+
+// In-process WebSocket server on an ephemeral loopback port. Every upgraded connection is handed to `session`,
+// and the connection is closed when `session` returns. A non-empty `extensions` is sent back as the
+// Sec-WebSocket-Extensions response header. Given a server `tlsContext`, connections are accepted over TLS.
+struct LoopbackServer final {
+  explicit LoopbackServer(std::function<void(Poco::Net::WebSocket &)> session,
+                          std::string extensions = "",
+                          Poco::Net::Context::Ptr tlsContext = nullptr)
+    : socket_(listen(std::move(tlsContext)))
+    , server_(new SessionFactory(std::move(session), std::move(extensions)), socket_, new Poco::Net::HTTPServerParams)
+  {
+    server_.start();
+  }
+
+  ~LoopbackServer() {
+    server_.stopAll(true);
+  }
+
+  [[nodiscard]] Poco::UInt16 port() const {
+    return socket_.address().port();
+  }
+
+private:
+  static Poco::Net::ServerSocket listen(Poco::Net::Context::Ptr tlsContext) {
+    const Poco::Net::SocketAddress address{"127.0.0.1", 0};
+    if (tlsContext) {
+      return Poco::Net::SecureServerSocket{address, 64, std::move(tlsContext)};
+    }
+    return Poco::Net::ServerSocket{address};
+  }
+
+  struct SessionHandler final : Poco::Net::HTTPRequestHandler {
+    SessionHandler(const std::function<void(Poco::Net::WebSocket &)> &session, const std::string &extensions)
+      : session_(session), extensions_(extensions) {}
+
+    void handleRequest(Poco::Net::HTTPServerRequest &request, Poco::Net::HTTPServerResponse &response) override {
+      if (!extensions_.empty()) {
+        response.set("Sec-WebSocket-Extensions", extensions_);
+      }
+      Poco::Net::WebSocket webSocket{request, response};
+      session_(webSocket);
+    }
+
+  private:
+    const std::function<void(Poco::Net::WebSocket &)> &session_;
+    const std::string &extensions_;
+  };
+
+  struct SessionFactory final : Poco::Net::HTTPRequestHandlerFactory {
+    SessionFactory(std::function<void(Poco::Net::WebSocket &)> session, std::string extensions)
+      : session_(std::move(session)), extensions_(std::move(extensions)) {}
+
+    Poco::Net::HTTPRequestHandler *createRequestHandler(const Poco::Net::HTTPServerRequest &) override {
+      return new SessionHandler(session_, extensions_);
+    }
+
+  private:
+    std::function<void(Poco::Net::WebSocket &)> session_;
+    std::string extensions_;
+  };
+
+  Poco::Net::ServerSocket socket_;
+  Poco::Net::HTTPServer server_;
+};